@@ -119,5 +119,5 @@ Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
     u = Length(CrossProduct(cp, bp)) / full_area;
     v = Length(CrossProduct(ap, cp)) / full_area;
     w = Length(CrossProduct(ap, bp)) / full_area;
-    return Vector({u, v, w});
+    return Vector{u, v, w};
 }
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <vector.h>
+#include <sphere.h>
+#include <ray.h>
+#include <intersection.h>
+
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RAYTRACER_SPHERE_BATCH_AVX2
+#include <immintrin.h>
+#endif
+
+struct SphereHit {
+    double distance;
+    size_t index;
+};
+
+// Structure-of-arrays copy of the scene spheres. Every array is padded to a
+// multiple of kLanes with spheres that can never be hit, so the kernels do not
+// need a scalar tail loop.
+class SphereBatch {
+public:
+    static constexpr size_t kLanes = 4;
+
+    void Add(const Sphere& sphere) {
+        if (size_ == center_x_.size()) {
+            for (size_t i = 0; i < kLanes; ++i) {
+                center_x_.push_back(0.0);
+                center_y_.push_back(0.0);
+                center_z_.push_back(0.0);
+                radius2_.push_back(-1.0);
+            }
+        }
+        center_x_[size_] = sphere.GetCenter()[0];
+        center_y_[size_] = sphere.GetCenter()[1];
+        center_z_[size_] = sphere.GetCenter()[2];
+        radius2_[size_] = sphere.GetRadius() * sphere.GetRadius();
+        ++size_;
+    }
+
+    // Makes room for `count` spheres, so that Add does not allocate.
+    void Reserve(size_t count) {
+        size_t padded = (count + kLanes - 1) / kLanes * kLanes;
+        center_x_.reserve(padded);
+        center_y_.reserve(padded);
+        center_z_.reserve(padded);
+        radius2_.reserve(padded);
+    }
+
+    // Removes all spheres but keeps the storage.
+    void Clear() {
+        center_x_.clear();
+        center_y_.clear();
+        center_z_.clear();
+        radius2_.clear();
+        size_ = 0;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    size_t PaddedSize() const {
+        return center_x_.size();
+    }
+
+    Vector GetCenter(size_t index) const {
+        return Vector{center_x_[index], center_y_[index], center_z_[index]};
+    }
+
+    const double* CenterX() const {
+        return center_x_.data();
+    }
+
+    const double* CenterY() const {
+        return center_y_.data();
+    }
+
+    const double* CenterZ() const {
+        return center_z_.data();
+    }
+
+    const double* Radius2() const {
+        return radius2_.data();
+    }
+
+private:
+    std::vector<double> center_x_;
+    std::vector<double> center_y_;
+    std::vector<double> center_z_;
+    std::vector<double> radius2_;
+    size_t size_ = 0;
+};
+
+// Distance to sphere `index` of the batch along the ray, if it is hit.
+inline std::optional<double> IntersectSphere(const Ray& ray, const SphereBatch& batch,
+                                             size_t index) {
+    const auto& origin = ray.GetOrigin();
+    const auto& direction = ray.GetDirection();
+    double lx = batch.CenterX()[index] - origin[0];
+    double ly = batch.CenterY()[index] - origin[1];
+    double lz = batch.CenterZ()[index] - origin[2];
+    double r2 = batch.Radius2()[index];
+    double tca = lx * direction[0] + ly * direction[1] + lz * direction[2];
+    double d2 = lx * lx + ly * ly + lz * lz - tca * tca;
+    if (tca < 0.0 or d2 > r2) {
+        return {};
+    }
+    double thc = sqrt(r2 - d2);
+    double t = tca - thc;
+    if (t < 0.0) {
+        t = tca + thc;
+    }
+    return t;
+}
+
+inline std::optional<SphereHit> FindNearestSphereScalar(const Ray& ray, const SphereBatch& batch) {
+    std::optional<SphereHit> best;
+    for (size_t i = 0; i < batch.Size(); ++i) {
+        auto t = IntersectSphere(ray, batch, i);
+        if (t and (!best or t.value() < best.value().distance)) {
+            best = SphereHit{t.value(), i};
+        }
+    }
+    return best;
+}
+
+#ifdef RAYTRACER_SPHERE_BATCH_AVX2
+__attribute__((target("avx2"))) inline std::optional<SphereHit> FindNearestSphereAvx2(
+    const Ray& ray, const SphereBatch& batch) {
+    const auto& origin = ray.GetOrigin();
+    const auto& direction = ray.GetDirection();
+    const __m256d ox = _mm256_set1_pd(origin[0]);
+    const __m256d oy = _mm256_set1_pd(origin[1]);
+    const __m256d oz = _mm256_set1_pd(origin[2]);
+    const __m256d dx = _mm256_set1_pd(direction[0]);
+    const __m256d dy = _mm256_set1_pd(direction[1]);
+    const __m256d dz = _mm256_set1_pd(direction[2]);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    const __m256d step = _mm256_set1_pd(static_cast<double>(SphereBatch::kLanes));
+
+    __m256d best = inf;
+    __m256d best_index = _mm256_setzero_pd();
+    __m256d index = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    for (size_t i = 0; i < batch.PaddedSize(); i += SphereBatch::kLanes) {
+        __m256d lx = _mm256_sub_pd(_mm256_loadu_pd(batch.CenterX() + i), ox);
+        __m256d ly = _mm256_sub_pd(_mm256_loadu_pd(batch.CenterY() + i), oy);
+        __m256d lz = _mm256_sub_pd(_mm256_loadu_pd(batch.CenterZ() + i), oz);
+        __m256d r2 = _mm256_loadu_pd(batch.Radius2() + i);
+
+        __m256d tca = _mm256_mul_pd(lx, dx);
+        tca = _mm256_add_pd(tca, _mm256_mul_pd(ly, dy));
+        tca = _mm256_add_pd(tca, _mm256_mul_pd(lz, dz));
+        __m256d d2 = _mm256_mul_pd(lx, lx);
+        d2 = _mm256_add_pd(d2, _mm256_mul_pd(ly, ly));
+        d2 = _mm256_add_pd(d2, _mm256_mul_pd(lz, lz));
+        d2 = _mm256_sub_pd(d2, _mm256_mul_pd(tca, tca));
+
+        __m256d valid = _mm256_and_pd(_mm256_cmp_pd(tca, zero, _CMP_GE_OQ),
+                                      _mm256_cmp_pd(d2, r2, _CMP_LE_OQ));
+        __m256d thc = _mm256_sqrt_pd(_mm256_max_pd(_mm256_sub_pd(r2, d2), zero));
+        __m256d t0 = _mm256_sub_pd(tca, thc);
+        __m256d t1 = _mm256_add_pd(tca, thc);
+        __m256d t = _mm256_blendv_pd(t0, t1, _mm256_cmp_pd(t0, zero, _CMP_LT_OQ));
+        t = _mm256_blendv_pd(inf, t, valid);
+
+        __m256d closer = _mm256_cmp_pd(t, best, _CMP_LT_OQ);
+        best = _mm256_blendv_pd(best, t, closer);
+        best_index = _mm256_blendv_pd(best_index, index, closer);
+        index = _mm256_add_pd(index, step);
+    }
+
+    alignas(32) double lane_t[SphereBatch::kLanes];
+    alignas(32) double lane_index[SphereBatch::kLanes];
+    _mm256_store_pd(lane_t, best);
+    _mm256_store_pd(lane_index, best_index);
+    double result = std::numeric_limits<double>::infinity();
+    double result_index = 0.0;
+    for (size_t lane = 0; lane < SphereBatch::kLanes; ++lane) {
+        // Ties go to the lower index, as in the scalar scan.
+        if (lane_t[lane] < result or
+            (lane_t[lane] == result and lane_index[lane] < result_index)) {
+            result = lane_t[lane];
+            result_index = lane_index[lane];
+        }
+    }
+    if (result == std::numeric_limits<double>::infinity()) {
+        return {};
+    }
+    return SphereHit{result, static_cast<size_t>(result_index)};
+}
+#endif
+
+inline std::optional<SphereHit> FindNearestSphere(const Ray& ray, const SphereBatch& batch) {
+#ifdef RAYTRACER_SPHERE_BATCH_AVX2
+    static const bool kHasAvx2 = __builtin_cpu_supports("avx2");
+    if (kHasAvx2) {
+        return FindNearestSphereAvx2(ray, batch);
+    }
+#endif
+    return FindNearestSphereScalar(ray, batch);
+}
+
+// The normal is only built here, once the nearest sphere is known.
+inline Intersection MakeSphereIntersection(const Ray& ray, const SphereBatch& batch,
+                                           const SphereHit& hit) {
+    auto pos = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    auto norm = pos - batch.GetCenter(hit.index);
+    norm.Normalize();
+    if (DotProduct(norm, ray.GetDirection()) > 0) {
+        norm = norm * -1.0;
+    }
+    return Intersection(pos, norm, hit.distance);
+}
@@ -1,10 +1,14 @@
 #include <catch.hpp>
 
+#include <array>
+#include <chrono>
 #include <cmath>
 #include <string>
 #include <optional>
+#include <vector>
 
 #include <geometry.h>
+#include <sphere_batch.h>
 
 const double kX = 123.;
 const double kY = 456.;
@@ -174,3 +178,185 @@ TEST_CASE("Barycentric coords", "[raytracer]") {
     REQUIRE(std::fabs(inside[1] - 0.1) < kErr);
     REQUIRE(std::fabs(inside[2] - 0.1) < kErr);
 }
+
+TEST_CASE("Sphere batch", "[raytracer]") {
+    std::vector<Sphere> spheres;
+    SphereBatch batch;
+    for (int i = 0; i < 11; ++i) {
+        spheres.emplace_back(Vector{0.7 * i - 3, 0.3 * (i % 3), -5. - i}, 0.4 + 0.1 * (i % 4));
+        batch.Add(spheres.back());
+    }
+    REQUIRE(batch.Size() == 11);
+    REQUIRE(batch.PaddedSize() % SphereBatch::kLanes == 0);
+
+    for (int i = 0; i < 40; ++i) {
+        Ray ray{{0, 0, 0}, {0.15 * i - 3, 0.01 * i, -5}};
+        std::optional<Intersection> expected;
+        size_t expected_index = 0;
+        for (size_t k = 0; k < spheres.size(); ++k) {
+            auto inter = GetIntersection(ray, spheres[k]);
+            if (inter and (!expected or inter->GetDistance() < expected->GetDistance())) {
+                expected = inter;
+                expected_index = k;
+            }
+        }
+        auto hit = FindNearestSphere(ray, batch);
+        auto scalar_hit = FindNearestSphereScalar(ray, batch);
+        REQUIRE(hit.has_value() == expected.has_value());
+        REQUIRE(scalar_hit.has_value() == expected.has_value());
+        if (!hit) {
+            continue;
+        }
+        REQUIRE(hit->index == expected_index);
+        REQUIRE(scalar_hit->index == expected_index);
+        REQUIRE(std::fabs(hit->distance - expected->GetDistance()) < 1e-4);
+        auto inter = MakeSphereIntersection(ray, batch, *hit);
+        REQUIRE(std::fabs(DotProduct(inter.GetNormal(), expected->GetNormal()) - 1) < 1e-4);
+    }
+
+    Ray inside{{-3, 0, -5}, {0, 0, -1}};
+    auto hit = FindNearestSphere(inside, batch);
+    REQUIRE(hit);
+    REQUIRE(hit->index == 0);
+    REQUIRE(std::fabs(hit->distance - 0.4) < kErr);
+}
+
+TEST_CASE("Vector lanes", "[raytracer]") {
+    constexpr Vector kA{1., 2., 3.};
+    constexpr Vector kB{-2., 0.5, 4.};
+    static_assert(DotProduct(kA, kB) == 11.);
+    static_assert(CrossProduct(kA, kB)[0] == 6.5);
+    static_assert((kA + kB)[2] == 7. and (kA - kB)[0] == 3. and (kA * kB)[1] == 1.);
+    static_assert((2. * kA + 1.)[1] == 5.);
+    static_assert(alignof(Vector) == 32);
+
+    // Scalar addition must not leak into the padding lane that Dot ignores.
+    auto shifted = (kA + 1.) * 2.;
+    REQUIRE(std::fabs(Length(shifted) - std::sqrt(16. + 36. + 64.)) < kErr);
+
+    for (int i = 1; i < 100; ++i) {
+        Vector vec{kX * i, -kY / i, kZ * std::sin(i)};
+        Vector exact = vec;
+        exact.Normalize();
+        vec.NormalizeFast();
+        for (int k = 0; k < 3; ++k) {
+            REQUIRE(std::fabs(vec[k] - exact[k]) < 1e-9);
+        }
+    }
+    // Squared lengths a float can't hold take the exact path.
+    for (double scale : {1e-30, 1e-100, 1e30, 1e100}) {
+        Vector vec{3. * scale, -4. * scale, 12. * scale};
+        vec.NormalizeFast();
+        REQUIRE(std::fabs(vec[0] - 3. / 13.) < 1e-9);
+        REQUIRE(std::fabs(vec[1] + 4. / 13.) < 1e-9);
+        REQUIRE(std::fabs(vec[2] - 12. / 13.) < 1e-9);
+    }
+}
+
+// The Vector this tree used before the four-lane layout, kept for the
+// benchmark below.
+namespace legacy {
+
+class Vector {
+public:
+    Vector() {
+        data_ = {{0.0, 0.0, 0.0}};
+    }
+    Vector(std::initializer_list<double> list) {
+        int i = 0;
+        for (auto& elem : list) {
+            data_[i] = elem;
+            ++i;
+        }
+    }
+    Vector(std::array<double, 3> data) : data_{data} {
+    }
+    double operator[](size_t ind) const {
+        return data_[ind];
+    }
+    void Normalize() {
+        double length = std::sqrt(data_[0] * data_[0] + data_[1] * data_[1] + data_[2] * data_[2]);
+        for (int i = 0; i < 3; ++i) {
+            data_[i] /= length;
+        }
+    }
+
+private:
+    std::array<double, 3> data_;
+};
+
+double DotProduct(const Vector& lhs, const Vector& rhs) {
+    double output = 0;
+    for (int i = 0; i < 3; ++i) {
+        output += lhs[i] * rhs[i];
+    }
+    return output;
+}
+Vector CrossProduct(const Vector& a, const Vector& b) {
+    std::array<double, 3> data;
+    data[0] = a[1] * b[2] - a[2] * b[1];
+    data[1] = a[2] * b[0] - a[0] * b[2];
+    data[2] = a[0] * b[1] - a[1] * b[0];
+    return Vector(data);
+}
+Vector operator+(const Vector& lhs, const Vector& rhs) {
+    return Vector(std::array<double, 3>{lhs[0] + rhs[0], lhs[1] + rhs[1], lhs[2] + rhs[2]});
+}
+Vector operator-(const Vector& lhs, const Vector& rhs) {
+    return Vector(std::array<double, 3>{lhs[0] - rhs[0], lhs[1] - rhs[1], lhs[2] - rhs[2]});
+}
+Vector operator*(const Vector& lhs, double alpha) {
+    return Vector(std::array<double, 3>{alpha * lhs[0], alpha * lhs[1], alpha * lhs[2]});
+}
+
+}  // namespace legacy
+
+// The vector arithmetic of GetIntersection (triangle and sphere), Reflect
+// and Normalize, written once for both implementations.
+template <class V>
+double GeometryKernels(const std::vector<V>& points, int rounds) {
+    double sum = 0;
+    for (int round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i + 4 < points.size(); ++i) {
+            V origin = points[i];
+            V direction = points[i + 1] - origin;
+            direction.Normalize();
+            V ab = points[i + 3] - points[i + 2];
+            V ac = points[i + 4] - points[i + 2];
+            V h = CrossProduct(direction, ac);
+            double a = DotProduct(ab, h);
+            V s = origin - points[i + 2];
+            V q = CrossProduct(s, ab);
+            sum += (DotProduct(s, h) + DotProduct(direction, q) + DotProduct(ac, q)) / a;
+
+            V to_center = points[i + 3] - origin;
+            double tca = DotProduct(to_center, direction);
+            sum += DotProduct(to_center, to_center) - tca * tca;
+
+            V normal = CrossProduct(ab, ac);
+            normal.Normalize();
+            V reflected = direction - normal * (2 * DotProduct(normal, direction));
+            sum += reflected[0] + reflected[1] + reflected[2];
+        }
+    }
+    return sum;
+}
+
+TEST_CASE("Vector math speed", "[.][benchmark]") {
+    std::vector<Vector> points;
+    std::vector<legacy::Vector> legacy_points;
+    for (int i = 0; i < 4096; ++i) {
+        double x = std::sin(i * 0.37) * 5, y = std::cos(i * 0.91) * 5, z = -5. - (i % 17);
+        points.push_back(Vector{x, y, z});
+        legacy_points.push_back(legacy::Vector{x, y, z});
+    }
+    const int rounds = 500;
+    auto start = std::chrono::steady_clock::now();
+    auto legacy_sum = GeometryKernels(legacy_points, rounds);
+    auto middle = std::chrono::steady_clock::now();
+    auto sum = GeometryKernels(points, rounds);
+    auto end = std::chrono::steady_clock::now();
+    REQUIRE(std::fabs(sum - legacy_sum) < 1e-6 * std::fabs(legacy_sum));
+    std::chrono::duration<double> legacy_time = middle - start, time = end - middle;
+    WARN("legacy " << legacy_time.count() << "s, four-lane " << time.count() << "s");
+}
@@ -2,24 +2,15 @@
 
 // #include <vector.h>
 #include "../raytracer-geom/vector.h"
-#include <string>
+#include <array>
 
+// The name lives in the MaterialTable, so that shading only touches colors.
 struct Material {
-    Material() {
-    }
-
-    Material(std::string& name) : name{name} {
-        specular_exponent = 0.0;
-        refraction_index = 0.0;
-        albedo = {{1.0, 0.0, 0.0}};
-    }
-
-    std::string name;
     Vector ambient_color;
     Vector diffuse_color;
     Vector specular_color;
     Vector intensity;
-    double specular_exponent;
-    double refraction_index;
-    std::array<double, 3> albedo;
+    double specular_exponent = 0.0;
+    double refraction_index = 0.0;
+    std::array<double, 3> albedo = {{1.0, 0.0, 0.0}};
 };
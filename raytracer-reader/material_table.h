@@ -0,0 +1,114 @@
+#pragma once
+
+#include <material.h>
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Shading constants of one material, derived once when the table is built.
+struct MaterialConstants {
+    // Ka + Ke: the part of the color that needs no rays.
+    Vector emission;
+    // al[0] and a diffuse or specular color: lights can contribute.
+    bool lit = false;
+    bool reflects = false;
+    bool refracts = false;
+    // No specular lobe, no reflection and no refraction.
+    bool purely_diffuse = false;
+};
+
+inline MaterialConstants ComputeMaterialConstants(const Material& material) {
+    MaterialConstants output;
+    output.emission = material.ambient_color + material.intensity;
+    bool diffuse = false, specular = false;
+    for (int k = 0; k < 3; ++k) {
+        diffuse = diffuse or material.diffuse_color[k] != 0;
+        specular = specular or material.specular_color[k] != 0;
+    }
+    output.lit = material.albedo[0] != 0 and (diffuse or specular);
+    output.reflects = material.albedo[1] > 0;
+    output.refracts = material.albedo[2] > 0;
+    output.purely_diffuse = !specular and !output.reflects and !output.refracts;
+    return output;
+}
+
+// Materials stored contiguously and addressed by a small integer ID, with
+// their constants alongside. The name map is only used for lookups; the
+// lower-case members keep the std::map interface the readers already use.
+class MaterialTable {
+public:
+    MaterialTable() = default;
+
+    explicit MaterialTable(std::map<std::string, Material> materials) {
+        materials_.reserve(materials.size());
+        names_.reserve(materials.size());
+        for (auto& [name, material] : materials) {
+            ids_.emplace(name, static_cast<int>(materials_.size()));
+            names_.push_back(name);
+            materials_.push_back(std::move(material));
+        }
+        Refresh();
+    }
+
+    size_t Size() const {
+        return materials_.size();
+    }
+
+    size_t size() const {
+        return Size();
+    }
+
+    const Material& Get(int id) const {
+        return materials_[id];
+    }
+
+    Material& Get(int id) {
+        return materials_[id];
+    }
+
+    const MaterialConstants& GetConstants(int id) const {
+        return constants_[id];
+    }
+
+    int GetId(const std::string& name) const {
+        auto it = ids_.find(name);
+        if (it == ids_.end()) {
+            throw std::runtime_error("Unknown material " + name);
+        }
+        return it->second;
+    }
+
+    const std::string& GetName(int id) const {
+        return names_[id];
+    }
+
+    const Material& at(const std::string& name) const {
+        return materials_[GetId(name)];
+    }
+
+    std::map<std::string, int>::const_iterator find(const std::string& name) const {
+        return ids_.find(name);
+    }
+
+    std::map<std::string, int>::const_iterator end() const {
+        return ids_.end();
+    }
+
+    // Recomputes the constants after materials were edited in place.
+    void Refresh() {
+        constants_.clear();
+        for (const auto& material : materials_) {
+            constants_.push_back(ComputeMaterialConstants(material));
+        }
+    }
+
+private:
+    std::vector<Material> materials_;
+    std::vector<MaterialConstants> constants_;
+    // Names are only needed to resolve usemtl and for reports.
+    std::map<std::string, int> ids_;
+    std::vector<std::string> names_;
+};
@@ -4,17 +4,22 @@
 #include <material.h>
 #include <sphere.h>
 
+#include <array>
+#include <optional>
+
 struct Object {
-    Object(const Material* material, Triangle triangle) : material{material}, polygon{triangle} {
+    Object(int material_id, Triangle triangle) : material_id{material_id}, polygon{triangle} {
     }
 
-    const Material* material = nullptr;
+    // Index into the scene's MaterialTable.
+    int material_id = -1;
     Triangle polygon;
 
-    std::vector<std::optional<Vector>> normals;
+    // Vertex normals, stored inline; empty where the face gives none.
+    std::array<std::optional<Vector>, 3> normals;
 
-    void AddNormal(Vector normal) {
-        normals.push_back(normal);
+    void SetNormal(size_t index, Vector normal) {
+        normals[index] = normal;
     }
 
     const Vector* GetNormal(size_t index) const {
@@ -33,10 +38,11 @@ struct Object {
 };
 
 struct SphereObject {
-    SphereObject(const Material* material, Vector center, double r)
-        : material{material}, sphere{center, r} {
+    SphereObject(int material_id, Vector center, double r)
+        : material_id{material_id}, sphere{center, r} {
         // sphere = Sphere(center, r);
     }
-    const Material* material = nullptr;
+    // Index into the scene's MaterialTable.
+    int material_id = -1;
     Sphere sphere;
 };
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <material.h>
+#include <material_table.h>
 #include <vector.h>
 #include <object.h>
 #include <light.h>
+#include <sphere_batch.h>
+#include <timeline.h>
 
 #include <vector>
 #include <map>
@@ -25,19 +28,38 @@ public:
         return spheres_;
     }
 
+    const SphereBatch& GetSphereBatch() const {
+        return sphere_batch_;
+    }
+
     const std::vector<Light>& GetLights() const {
         return lights_;
     }
 
-    const std::map<std::string, Material>& GetMaterials() const {
+    const MaterialTable& GetMaterials() const {
         return materials_;
     }
 
+    // Edits in place; objects refer to materials by ID, so they see the
+    // edit. Call RefreshMaterials once the edits are done.
+    Material& GetMaterial(const std::string& name) {
+        return materials_.Get(materials_.GetId(name));
+    }
+
+    void RefreshMaterials() {
+        materials_.Refresh();
+    }
+
+    Light& GetLight(size_t index) {
+        return lights_.at(index);
+    }
+
     void AddObject(Object& obj) {
         objects_.push_back(obj);
     }
 
     void AddSphere(SphereObject sphere) {
+        sphere_batch_.Add(sphere.sphere);
         spheres_.push_back(sphere);
     }
 
@@ -45,15 +67,16 @@ public:
         lights_.push_back(light);
     }
 
-    void SetMaterials(const std::map<std::string, Material>& materials) {
-        materials_ = materials;
+    void SetMaterials(std::map<std::string, Material> materials) {
+        materials_ = MaterialTable{std::move(materials)};
     }
 
 private:
     std::vector<Object> objects_;
     std::vector<SphereObject> spheres_;
+    SphereBatch sphere_batch_;
     std::vector<Light> lights_;
-    std::map<std::string, Material> materials_;
+    MaterialTable materials_;
 };
 
 Vector ParseVector(const std::vector<std::string>& splitted_line) {
@@ -103,6 +126,7 @@ inline size_t GetIndex(int ind, const std::vector<T>& vector) {
 }
 
 inline std::map<std::string, Material> ReadMaterials(std::string_view filename) {
+    TIMELINE_SCOPE("ReadMaterials", "load");
     std::fstream file;
     file.open(filename.data(), std::ios::in);
     std::string buffer;
@@ -127,7 +151,7 @@ inline std::map<std::string, Material> ReadMaterials(std::string_view filename)
         }
         if (splitted_line[0] == "newmtl") {
             current_material = splitted_line[1];
-            output[current_material] = Material(current_material);
+            output[current_material] = Material{};
         } else if (splitted_line[0] == "Ka") {
             output[current_material].ambient_color = ParseVector(splitted_line);
         } else if (splitted_line[0] == "Kd") {
@@ -150,11 +174,11 @@ inline std::map<std::string, Material> ReadMaterials(std::string_view filename)
 }
 
 inline Scene ReadScene(std::string_view filename) {
+    TIMELINE_SCOPE("ReadScene", "load");
     std::fstream file;
     file.open(filename.data(), std::ios::in);
     std::string buffer;
-    std::map<std::string, Material> materials;
-    const Material* cur_material;
+    int cur_material_id = -1;
     std::vector<Vector> vertexes, normals;
     Scene scene;
 
@@ -174,14 +198,13 @@ inline Scene ReadScene(std::string_view filename) {
         if (splitted_line[0] == "mtllib") {
             std::filesystem::path path_to_obj(filename);
             auto path_to_mtl = path_to_obj.parent_path() / std::filesystem::path(splitted_line[1]);
-            materials = ReadMaterials(path_to_mtl.string());
-            scene.SetMaterials(materials);
+            scene.SetMaterials(ReadMaterials(path_to_mtl.string()));
         } else if (splitted_line[0] == "usemtl") {
-            cur_material = &(scene.GetMaterials().at(splitted_line[1]));
+            cur_material_id = scene.GetMaterials().GetId(splitted_line[1]);
         } else if (splitted_line[0] == "S") {
             auto center = ParseVector(splitted_line);
             auto r = std::stod(splitted_line[4]);
-            scene.AddSphere(SphereObject(cur_material, center, r));
+            scene.AddSphere(SphereObject(cur_material_id, center, r));
         } else if (splitted_line[0] == "P") {
             auto position = ParseVector(splitted_line);
             Vector intensity{std::stod(splitted_line[4]), std::stod(splitted_line[5]),
@@ -197,21 +220,12 @@ inline Scene ReadScene(std::string_view filename) {
             for (size_t i = 1; i < indexes.size() - 1; ++i) {
                 Vector v1{vertexes[GetIndex(indexes[i].first, vertexes)]};
                 Vector v2{vertexes[GetIndex(indexes[i + 1].first, vertexes)]};
-                Object obj{cur_material, Triangle{v0, v1, v2}};
-                if (indexes[0].second != 0) {
-                    obj.AddNormal(normals[GetIndex(indexes[0].second, normals)]);
-                } else {
-                    obj.normals.push_back({});
-                }
-                if (indexes[i].second != 0) {
-                    obj.AddNormal(normals[GetIndex(indexes[i].second, normals)]);
-                } else {
-                    obj.normals.push_back({});
-                }
-                if (indexes[i + 1].second != 0) {
-                    obj.AddNormal(normals[GetIndex(indexes[i + 1].second, normals)]);
-                } else {
-                    obj.normals.push_back({});
+                Object obj{cur_material_id, Triangle{v0, v1, v2}};
+                size_t corners[3] = {0, i, i + 1};
+                for (int k = 0; k < 3; ++k) {
+                    if (indexes[corners[k]].second != 0) {
+                        obj.SetNormal(k, normals[GetIndex(indexes[corners[k]].second, normals)]);
+                    }
                 }
                 scene.AddObject(obj);
             }
@@ -29,7 +29,8 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(normal_check[2] - 0.) < eps);
 
     for (const auto& object : objects) {
-        REQUIRE(materials_map.find(object.material->name) != materials_map.end());
+        REQUIRE(materials_map.find(materials_map.GetName(object.material_id)) !=
+                materials_map.end());
     }
 
     // spheres
@@ -42,7 +43,8 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(center[2] - (-0.4)) < eps);
     REQUIRE(std::fabs(spheres[0].sphere.GetRadius() - 0.3) < eps);
     for (const auto& sphere : spheres) {
-        REQUIRE(materials_map.find(sphere.material->name) != materials_map.end());
+        REQUIRE(materials_map.find(materials_map.GetName(sphere.material_id)) !=
+                materials_map.end());
     }
 
     // lights
@@ -72,4 +74,40 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(wall_behind_diffuse[0] - 0.2) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[1] - 0.7) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[2] - 0.8) < eps);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Material table", "[raytracer]") {
+    const std::string dir_path(SHAD_TASK_DIR);
+    const auto scene = ReadScene(dir_path + "tests/box/cube.obj");
+    const auto& materials = scene.GetMaterials();
+    REQUIRE(materials.Size() == 9);
+
+    for (const auto& object : scene.GetObjects()) {
+        REQUIRE(materials.GetId(materials.GetName(object.material_id)) == object.material_id);
+    }
+    for (const auto& sphere : scene.GetSphereObjects()) {
+        REQUIRE(materials.GetId(materials.GetName(sphere.material_id)) == sphere.material_id);
+    }
+
+    // A copy of the scene sees its own materials.
+    auto copy = scene;
+    int sphere_id = copy.GetSphereObjects()[0].material_id;
+    copy.GetMaterial(materials.GetName(sphere_id)).diffuse_color = Vector{1.0, 2.0, 3.0};
+    REQUIRE(copy.GetMaterials().Get(sphere_id).diffuse_color[1] == 2.0);
+    REQUIRE(materials.Get(sphere_id).diffuse_color[1] != 2.0);
+
+    const auto& right_sphere = materials.GetConstants(materials.GetId("rightSphere"));
+    REQUIRE(right_sphere.reflects);
+    REQUIRE(right_sphere.refracts);
+    REQUIRE_FALSE(right_sphere.lit);
+    REQUIRE_FALSE(right_sphere.purely_diffuse);
+
+    const auto& wall = materials.GetConstants(materials.GetId("wallBehind"));
+    REQUIRE(wall.lit);
+    REQUIRE(wall.purely_diffuse);
+
+    const auto& light = materials.GetConstants(materials.GetId("light"));
+    REQUIRE(std::fabs(light.emission[0] - 1.78) < 1e-9);
+    REQUIRE(materials.GetName(materials.GetId("light")) == "light");
+    REQUIRE_THROWS(materials.GetId("missing"));
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Timeline of scoped events in the Chrome trace-event format, for Perfetto or
+// chrome://tracing. Recording is off until Timeline::Enable(); while it is
+// off a scope costs one relaxed load. Building with RAYTRACER_NO_TIMELINE
+// removes the scopes altogether.
+//
+// Every thread appends to its own buffer, a list of fixed-size chunks that
+// are never moved, so recording takes no lock and export may run while
+// threads are still recording: it sees every event published before it.
+
+struct TimelineEvent {
+    // String literals; the timeline keeps the pointers.
+    const char* name;
+    const char* category;
+    int64_t start_ns;
+    int64_t duration_ns;
+    // Shown as args.index when non-negative, e.g. the tile index.
+    int64_t index;
+};
+
+class TimelineBuffer {
+public:
+    static constexpr size_t kChunkSize = 1024;
+
+    explicit TimelineBuffer(int thread_id) : thread_id_{thread_id} {
+    }
+
+    TimelineBuffer(const TimelineBuffer&) = delete;
+    TimelineBuffer& operator=(const TimelineBuffer&) = delete;
+
+    ~TimelineBuffer() {
+        auto chunk = head_.next.load(std::memory_order_relaxed);
+        while (chunk) {
+            auto next = chunk->next.load(std::memory_order_relaxed);
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    // Only called by the owning thread.
+    void Append(const TimelineEvent& event) {
+        auto count = tail_->count.load(std::memory_order_relaxed);
+        if (count == kChunkSize) {
+            // After Clear the chain is still there; only grow it at the end.
+            auto chunk = tail_->next.load(std::memory_order_relaxed);
+            if (!chunk) {
+                chunk = new Chunk;
+                tail_->next.store(chunk, std::memory_order_release);
+            }
+            tail_ = chunk;
+            count = 0;
+        }
+        tail_->events[count] = event;
+        tail_->count.store(count + 1, std::memory_order_release);
+    }
+
+    template <class Visit>
+    void ForEach(Visit visit) const {
+        for (auto chunk = &head_; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+            auto count = chunk->count.load(std::memory_order_acquire);
+            for (size_t k = 0; k < count; ++k) {
+                visit(chunk->events[k]);
+            }
+        }
+    }
+
+    // Drops the events but keeps the chunks. Only safe while the owner is
+    // not recording.
+    void Clear() {
+        for (auto chunk = &head_; chunk; chunk = chunk->next.load(std::memory_order_relaxed)) {
+            chunk->count.store(0, std::memory_order_relaxed);
+        }
+        tail_ = &head_;
+    }
+
+    int ThreadId() const {
+        return thread_id_;
+    }
+
+private:
+    struct Chunk {
+        TimelineEvent events[kChunkSize];
+        std::atomic<size_t> count = 0;
+        std::atomic<Chunk*> next = nullptr;
+    };
+
+    int thread_id_;
+    Chunk head_;
+    Chunk* tail_ = &head_;
+};
+
+class Timeline {
+public:
+    static Timeline& Get() {
+        static Timeline timeline;
+        return timeline;
+    }
+
+    void Enable() {
+        enabled_.store(true, std::memory_order_relaxed);
+    }
+
+    void Disable() {
+        enabled_.store(false, std::memory_order_relaxed);
+    }
+
+    bool Enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    int64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin_)
+            .count();
+    }
+
+    void Record(const TimelineEvent& event) {
+        thread_local Lease lease{*this};
+        lease.buffer->Append(event);
+    }
+
+    size_t EventCount() const {
+        size_t output = 0;
+        ForEachEvent([&output](int, const TimelineEvent&) { ++output; });
+        return output;
+    }
+
+    // visit(thread_id, event) for every recorded event.
+    template <class Visit>
+    void ForEachEvent(Visit visit) const {
+        std::lock_guard lock{mutex_};
+        for (const auto& buffer : buffers_) {
+            buffer->ForEach([&](const TimelineEvent& event) { visit(buffer->ThreadId(), event); });
+        }
+    }
+
+    // Drops all events. Call it when no thread is recording.
+    void Clear() {
+        std::lock_guard lock{mutex_};
+        for (auto& buffer : buffers_) {
+            buffer->Clear();
+        }
+    }
+
+    std::string ToChromeTrace() const {
+        std::ostringstream output;
+        output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        ForEachEvent([&](int thread_id, const TimelineEvent& event) {
+            output << (first ? "\n" : ",\n");
+            first = false;
+            // Timestamps are in microseconds.
+            output << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+                   << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread_id
+                   << ",\"ts\":" << event.start_ns / 1000 << "." << Padded(event.start_ns % 1000)
+                   << ",\"dur\":" << event.duration_ns / 1000 << "."
+                   << Padded(event.duration_ns % 1000);
+            if (event.index >= 0) {
+                output << ",\"args\":{\"index\":" << event.index << "}";
+            }
+            output << "}";
+        });
+        output << "\n]}\n";
+        return output.str();
+    }
+
+    void WriteChromeTrace(const std::string& filename) const {
+        std::ofstream file{filename};
+        if (!file) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        file << ToChromeTrace();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    Timeline() : origin_{Clock::now()} {
+    }
+
+    // A thread's hold on a buffer. Buffers outlive their threads, so that
+    // their events can still be exported; the buffer of a finished thread is
+    // handed to the next new one, which keeps the number of trace rows at the
+    // number of threads alive at once.
+    struct Lease {
+        explicit Lease(Timeline& timeline) : timeline{timeline} {
+            std::lock_guard lock{timeline.mutex_};
+            if (timeline.free_.empty()) {
+                timeline.buffers_.push_back(
+                    std::make_unique<TimelineBuffer>(static_cast<int>(timeline.buffers_.size())));
+                buffer = timeline.buffers_.back().get();
+            } else {
+                buffer = timeline.free_.back();
+                timeline.free_.pop_back();
+            }
+        }
+
+        ~Lease() {
+            std::lock_guard lock{timeline.mutex_};
+            timeline.free_.push_back(buffer);
+        }
+
+        Timeline& timeline;
+        TimelineBuffer* buffer;
+    };
+
+    static std::string Padded(int64_t value) {
+        auto output = std::to_string(value);
+        return std::string(3 - output.size(), '0') + output;
+    }
+
+    std::atomic<bool> enabled_ = false;
+    Clock::time_point origin_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<TimelineBuffer>> buffers_;
+    std::vector<TimelineBuffer*> free_;
+};
+
+// Records one event for its lifetime, if the timeline was enabled when it
+// started.
+class TimelineScope {
+public:
+    explicit TimelineScope(const char* name, const char* category = "render", int64_t index = -1)
+        : name_{name}, category_{category}, index_{index} {
+        if (Timeline::Get().Enabled()) {
+            start_ = Timeline::Get().Now();
+        }
+    }
+
+    TimelineScope(const TimelineScope&) = delete;
+    TimelineScope& operator=(const TimelineScope&) = delete;
+
+    ~TimelineScope() {
+        if (start_ >= 0) {
+            auto& timeline = Timeline::Get();
+            timeline.Record(
+                TimelineEvent{name_, category_, start_, timeline.Now() - start_, index_});
+        }
+    }
+
+private:
+    const char* name_;
+    const char* category_;
+    int64_t index_;
+    int64_t start_ = -1;
+};
+
+#define RAYTRACER_TIMELINE_JOIN_(a, b) a##b
+#define RAYTRACER_TIMELINE_JOIN(a, b) RAYTRACER_TIMELINE_JOIN_(a, b)
+#ifdef RAYTRACER_NO_TIMELINE
+#define TIMELINE_SCOPE(...)
+#else
+// TIMELINE_SCOPE(name[, category[, index]]) times the rest of the block.
+#define TIMELINE_SCOPE(...) \
+    TimelineScope RAYTRACER_TIMELINE_JOIN(timeline_scope_, __LINE__)(__VA_ARGS__)
+#endif
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <trace.h>
+#include <denoise.h>
+#include <camera.h>
+#include <camera_options.h>
+#include <render_statistics.h>
+#include <tile.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+struct PixelSample {
+    Vector value;
+    // Both are -1 for a ray that hits nothing.
+    double distance;
+    int object_id;
+};
+
+template <class SceneT>
+PixelSample TraceSample(const Ray& ray, const SceneT& scene, const RenderOptions& render_options) {
+    auto hit = FindNearestHit(ray, scene);
+    PixelSample output{ShadeSceneHit(ray, hit, scene, render_options), -1.0, -1};
+    if (hit) {
+        output.distance = hit.value().intersection.GetDistance();
+        output.object_id = hit.value().object_id;
+    }
+    return output;
+}
+
+inline bool SamplesDiffer(const PixelSample& lhs, const PixelSample& rhs,
+                          const AntiAliasingOptions& options) {
+    if (lhs.object_id != rhs.object_id) {
+        return true;
+    }
+    if (lhs.object_id == -1) {
+        return false;
+    }
+    auto depth_difference =
+        std::fabs(lhs.distance - rhs.distance) / std::max(lhs.distance, rhs.distance);
+    if (depth_difference > options.depth_threshold) {
+        return true;
+    }
+    for (int k = 0; k < 3; ++k) {
+        auto a = lhs.value[k] / (1 + lhs.value[k]);
+        auto b = rhs.value[k] / (1 + rhs.value[k]);
+        if (std::fabs(a - b) > options.color_threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Traces one sample through every pixel center, then refines only the pixels
+// whose center sample differs from a neighbor's. A refined pixel is covered by
+// n x n jittered strata; the center sample is reused for the stratum that
+// contains it, so no pixel takes more than max_samples samples.
+//
+// Traces the pixels of `window`, a rectangle of the frame, into unresolved
+// values, prepixels[i][j] for pixel (window.x + i, window.y + j). The centers
+// of a one pixel margin around the window are traced too, so the refined
+// pixels and their jitter are those of the whole frame. Returns the number of
+// samples taken. SceneT is a Scene or an OutOfCoreScene.
+template <class SceneT>
+size_t AntiAliasPixels(const SceneT& scene, const CameraOptions& camera_options,
+                       const RenderOptions& render_options, const Tile& window,
+                       std::vector<std::vector<Vector>>& prepixels) {
+    const auto& options = render_options.anti_aliasing;
+    int frame_height = camera_options.screen_height;
+    int x0 = std::max(window.x - 1, 0);
+    int y0 = std::max(window.y - 1, 0);
+    int width = std::min(window.x + window.width + 1, camera_options.screen_width) - x0;
+    int height = std::min(window.y + window.height + 1, frame_height) - y0;
+    Camera camera{&camera_options};
+
+    std::vector<std::vector<PixelSample>> centers(width, std::vector<PixelSample>(height));
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            Ray ray{camera_options.look_from, camera.GetDirection(x0 + i, y0 + j)};
+            centers[i][j] = TraceSample(ray, scene, render_options);
+        }
+    }
+
+    std::vector<std::vector<bool>> refine(width, std::vector<bool>(height));
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            if (i + 1 < width and SamplesDiffer(centers[i][j], centers[i + 1][j], options)) {
+                refine[i][j] = refine[i + 1][j] = true;
+            }
+            if (j + 1 < height and SamplesDiffer(centers[i][j], centers[i][j + 1], options)) {
+                refine[i][j] = refine[i][j + 1] = true;
+            }
+        }
+    }
+
+    int strata = static_cast<int>(std::sqrt(std::max(options.max_samples, 1)));
+    int center_stratum = strata / 2;
+    size_t samples = static_cast<size_t>(width) * height;
+    prepixels.assign(window.width, std::vector<Vector>(window.height));
+    for (int i = 0; i < window.width; ++i) {
+        for (int j = 0; j < window.height; ++j) {
+            // Frame and margin coordinates of the pixel.
+            int x = window.x + i, y = window.y + j;
+            int ci = x - x0, cj = y - y0;
+            prepixels[i][j] = centers[ci][cj].value;
+            if (!refine[ci][cj] or strata < 2) {
+                continue;
+            }
+            std::minstd_rand rng(static_cast<unsigned>(x * frame_height + y + 1));
+            std::uniform_real_distribution<double> jitter(0.0, 1.0);
+            Vector sum = centers[ci][cj].value;
+            for (int sx = 0; sx < strata; ++sx) {
+                for (int sy = 0; sy < strata; ++sy) {
+                    if (sx == center_stratum and sy == center_stratum) {
+                        continue;
+                    }
+                    double dx = (sx + jitter(rng)) / strata;
+                    double dy = (sy + jitter(rng)) / strata;
+                    Ray ray{camera_options.look_from, camera.GetDirection(x, y, dx, dy)};
+                    sum = sum + TraceSample(ray, scene, render_options).value;
+                    ++samples;
+                }
+            }
+            prepixels[i][j] = sum * (1.0 / (strata * strata));
+        }
+    }
+    return samples;
+}
+
+// Renders the pixels of `window` into an image of the window's size.
+inline Image RenderAntiAliased(const Scene& scene, const CameraOptions& camera_options,
+                               const RenderOptions& render_options, const Tile& window,
+                               RenderStatistics* statistics = nullptr) {
+    std::vector<std::vector<Vector>> prepixels;
+    auto samples = AntiAliasPixels(scene, camera_options, render_options, window, prepixels);
+    Image output{window.width, window.height};
+    ResolveFrame(output, prepixels, scene, camera_options, render_options, window.x, window.y);
+    if (statistics) {
+        statistics->samples_per_pixel =
+            static_cast<double>(samples) / (window.width * window.height);
+    }
+    return output;
+}
+
+inline Image RenderAntiAliased(const Scene& scene, const CameraOptions& camera_options,
+                               const RenderOptions& render_options,
+                               RenderStatistics* statistics = nullptr) {
+    return RenderAntiAliased(
+        scene, camera_options, render_options,
+        Tile{0, 0, camera_options.screen_width, camera_options.screen_height}, statistics);
+}
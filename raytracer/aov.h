@@ -0,0 +1,148 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Arbitrary output variables that one pass of primary rays can fill.
+enum class Aov { kDepth, kNormal, kObjectId, kMaterialId, kAlbedo, kColor };
+
+inline std::string AovName(Aov aov) {
+    switch (aov) {
+        case Aov::kDepth:
+            return "depth";
+        case Aov::kNormal:
+            return "normal";
+        case Aov::kObjectId:
+            return "object_id";
+        case Aov::kMaterialId:
+            return "material_id";
+        case Aov::kAlbedo:
+            return "albedo";
+        case Aov::kColor:
+            return "color";
+    }
+    return "unknown";
+}
+
+// Distinct, stable false color for an ID; -1 (no hit) stays black.
+inline RGB IdColor(int id) {
+    if (id < 0) {
+        return RGB{0, 0, 0};
+    }
+    uint32_t hash = static_cast<uint32_t>(id + 1) * 0x9e3779b1u;
+    hash ^= hash >> 15;
+    hash *= 0x85ebca77u;
+    hash ^= hash >> 13;
+    return RGB{static_cast<int>(hash & 0xff), static_cast<int>((hash >> 8) & 0xff),
+               static_cast<int>((hash >> 16) & 0xff)};
+}
+
+inline void IdMapping(Image& image, const std::vector<std::vector<int>>& ids) {
+    for (int i = 0; i < image.Width(); ++i) {
+        for (int j = 0; j < image.Height(); ++j) {
+            image.SetPixel(IdColor(ids[i][j]), j, i);
+        }
+    }
+}
+
+inline void AlbedoMapping(Image& image, const std::vector<std::vector<Vector>>& albedo) {
+    for (int i = 0; i < image.Width(); ++i) {
+        for (int j = 0; j < image.Height(); ++j) {
+            RGB rgb;
+            rgb.r = round(255 * std::clamp(albedo[i][j][0], 0.0, 1.0));
+            rgb.g = round(255 * std::clamp(albedo[i][j][1], 0.0, 1.0));
+            rgb.b = round(255 * std::clamp(albedo[i][j][2], 0.0, 1.0));
+            image.SetPixel(rgb, j, i);
+        }
+    }
+}
+
+// Traces every primary ray once and fills each requested output from that
+// hit. The depth, normal and color outputs match RenderScene in kDepth,
+// kNormal and kFull modes, the color tone mapped with `tone_mapping`; albedo
+// is the diffuse color Kd, and material IDs are the MaterialTable IDs.
+inline std::map<Aov, Image> RenderAovs(const Scene& scene, const CameraOptions& camera_options,
+                                       int depth, const std::vector<Aov>& outputs,
+                                       const ToneMappingOptions& tone_mapping = {}) {
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    auto wants = [&outputs](Aov aov) {
+        return std::find(outputs.begin(), outputs.end(), aov) != outputs.end();
+    };
+    std::vector<std::vector<Vector>> distances(width, std::vector<Vector>(height));
+    std::vector<std::vector<Vector>> normals(width, std::vector<Vector>(height));
+    std::vector<std::vector<Vector>> albedo(width, std::vector<Vector>(height));
+    std::vector<std::vector<Vector>> colors(width, std::vector<Vector>(height));
+    std::vector<std::vector<int>> object_ids(width, std::vector<int>(height, -1));
+    std::vector<std::vector<int>> material_indexes(width, std::vector<int>(height, -1));
+    RenderOptions full_options{depth, RenderMode::kFull};
+    Camera camera{&camera_options};
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            Ray ray{camera_options.look_from, camera.GetDirection(i, j)};
+            auto hit = FindNearestHit(ray, scene);
+            if (!hit) {
+                continue;
+            }
+            const auto& inter = hit.value().intersection;
+            auto distance = inter.GetDistance();
+            distances[i][j] = Vector{distance, distance, distance};
+            normals[i][j] = inter.GetNormal() * 0.5 + 0.5;
+            albedo[i][j] = scene.GetMaterials().Get(hit.value().material_id).diffuse_color;
+            object_ids[i][j] = hit.value().object_id;
+            material_indexes[i][j] = hit.value().material_id;
+            if (wants(Aov::kColor)) {
+                colors[i][j] = ShadeHit(ray, hit, scene, full_options);
+            }
+        }
+    }
+
+    std::map<Aov, Image> output;
+    for (auto aov : outputs) {
+        if (output.count(aov)) {
+            continue;
+        }
+        Image image{width, height};
+        switch (aov) {
+            case Aov::kDepth:
+                DepthMapping(image, distances);
+                break;
+            case Aov::kNormal:
+                NormalMapping(image, normals);
+                break;
+            case Aov::kObjectId:
+                IdMapping(image, object_ids);
+                break;
+            case Aov::kMaterialId:
+                IdMapping(image, material_indexes);
+                break;
+            case Aov::kAlbedo:
+                AlbedoMapping(image, albedo);
+                break;
+            case Aov::kColor:
+                ToneMapping(image, colors, tone_mapping);
+                break;
+        }
+        output.emplace(aov, std::move(image));
+    }
+    return output;
+}
+
+inline std::map<Aov, Image> RenderAovs(const std::string& filename,
+                                       const CameraOptions& camera_options, int depth,
+                                       const std::vector<Aov>& outputs,
+                                       const ToneMappingOptions& tone_mapping = {}) {
+    return RenderAovs(ReadScene(filename), camera_options, depth, outputs, tone_mapping);
+}
+
+// Writes each output to prefix + "_" + AovName(aov) + ".png".
+inline void WriteAovs(const std::map<Aov, Image>& images, const std::string& prefix) {
+    for (const auto& [aov, image] : images) {
+        image.Write(prefix + "_" + AovName(aov) + ".png");
+    }
+}
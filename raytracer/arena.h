@@ -0,0 +1,150 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Bump allocator for transient render data. Memory is only given back all at
+// once, by rewinding to a mark; the blocks stay allocated for the next
+// frame, so a warmed-up arena serves a frame without touching the heap.
+class Arena {
+public:
+    static constexpr size_t kAlignment = 64;
+
+    explicit Arena(size_t block_size = 1 << 20) : block_size_{block_size} {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        while (true) {
+            if (current_ < blocks_.size()) {
+                auto& block = blocks_[current_];
+                size_t offset = (offset_ + alignment - 1) / alignment * alignment;
+                if (offset + size <= block.size) {
+                    offset_ = offset + size;
+                    return block.data.get() + offset;
+                }
+                if (current_ + 1 < blocks_.size()) {
+                    ++current_;
+                    offset_ = 0;
+                    continue;
+                }
+            }
+            size_t block_size = std::max(block_size_, size + alignment);
+            blocks_.push_back(Block{std::unique_ptr<std::byte[], Deleter>{static_cast<std::byte*>(
+                                        ::operator new(block_size, std::align_val_t{kAlignment}))},
+                                    block_size});
+            current_ = blocks_.size() - 1;
+            offset_ = 0;
+        }
+    }
+
+    // Uninitialized storage for `count` objects of type T.
+    template <class T>
+    T* AllocateArray(size_t count) {
+        return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+    }
+
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    Mark GetMark() const {
+        return Mark{current_, offset_};
+    }
+
+    void Rewind(const Mark& mark) {
+        current_ = mark.block;
+        offset_ = mark.offset;
+    }
+
+    size_t Capacity() const {
+        size_t output = 0;
+        for (const auto& block : blocks_) {
+            output += block.size;
+        }
+        return output;
+    }
+
+private:
+    struct Deleter {
+        void operator()(std::byte* data) const {
+            ::operator delete(data, std::align_val_t{kAlignment});
+        }
+    };
+
+    struct Block {
+        std::unique_ptr<std::byte[], Deleter> data;
+        size_t size;
+    };
+
+    size_t block_size_;
+    std::vector<Block> blocks_;
+    size_t current_ = 0;
+    size_t offset_ = 0;
+};
+
+// The calling thread's arena.
+inline Arena& ThreadArena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+// Rewinds the arena to where it was when the scope was entered.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena& arena) : arena_{arena}, mark_{arena.GetMark()} {
+    }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+    ~ArenaScope() {
+        arena_.Rewind(mark_);
+    }
+
+private:
+    Arena& arena_;
+    Arena::Mark mark_;
+};
+
+// Column-major width x height buffer of pixel values in arena memory, indexed
+// like the vector-of-columns buffers: buffer[i][j] is column i, row j. It
+// lives until the arena is rewound past it.
+class PixelBuffer {
+public:
+    PixelBuffer(int width, int height, Arena& arena)
+        : width_{width},
+          height_{height},
+          data_{arena.AllocateArray<Vector>(static_cast<size_t>(width) * height)} {
+        std::uninitialized_fill_n(data_, static_cast<size_t>(width) * height, Vector());
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    Vector* operator[](int i) {
+        return data_ + static_cast<size_t>(i) * height_;
+    }
+
+    const Vector* operator[](int i) const {
+        return data_ + static_cast<size_t>(i) * height_;
+    }
+
+private:
+    int width_;
+    int height_;
+    Vector* data_;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <raytracer.h>
+#include <tuning_profile.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct TuningGrid {
+    std::vector<int> tile_sizes = {8, 16, 32, 64};
+    // 0 is one thread per hardware thread.
+    std::vector<int> thread_counts = {1, 0};
+    // Only tried for renders with rasterize_primary.
+    std::vector<int> raster_tile_sizes = {16, 32, 64};
+    // Calibration renders use this fraction of the screen width and height.
+    double scale = 0.25;
+    // A configuration is timed by its fastest of this many renders.
+    int repetitions = 2;
+};
+
+struct TuningResult {
+    TuningParameters best;
+    // Every configuration tried, with its time in seconds.
+    std::vector<std::pair<TuningParameters, double>> timings;
+};
+
+// Renders the scene at reduced resolution with every configuration of the
+// grid and picks the fastest. Thread counts that come out the same on this
+// machine are tried once.
+inline TuningResult AutoTune(const Scene& scene, const CameraOptions& camera_options,
+                             const RenderOptions& render_options, const TuningGrid& grid = {}) {
+    auto calibration = camera_options;
+    calibration.screen_width =
+        std::max(1, static_cast<int>(camera_options.screen_width * grid.scale));
+    calibration.screen_height =
+        std::max(1, static_cast<int>(camera_options.screen_height * grid.scale));
+
+    std::vector<int> thread_counts;
+    std::vector<size_t> resolved;
+    for (int threads : grid.thread_counts) {
+        if (std::find(resolved.begin(), resolved.end(), ThreadCount(threads)) == resolved.end()) {
+            thread_counts.push_back(threads);
+            resolved.push_back(ThreadCount(threads));
+        }
+    }
+    std::vector<int> raster_tile_sizes{kRasterTileSize};
+    if (render_options.rasterize_primary) {
+        raster_tile_sizes = grid.raster_tile_sizes;
+    }
+
+    TuningResult output;
+    double best_time = std::numeric_limits<double>::infinity();
+    for (int tile_size : grid.tile_sizes) {
+        for (int threads : thread_counts) {
+            for (int raster_tile_size : raster_tile_sizes) {
+                TuningParameters parameters{tile_size, threads, raster_tile_size};
+                auto options = render_options;
+                options.tuning = parameters;
+                double time = std::numeric_limits<double>::infinity();
+                for (int k = 0; k < std::max(1, grid.repetitions); ++k) {
+                    auto start = std::chrono::steady_clock::now();
+                    RenderScene(scene, calibration, options);
+                    time = std::min(time, std::chrono::duration<double>(
+                                              std::chrono::steady_clock::now() - start)
+                                              .count());
+                }
+                output.timings.emplace_back(parameters, time);
+                if (time < best_time) {
+                    best_time = time;
+                    output.best = parameters;
+                }
+            }
+        }
+    }
+    return output;
+}
+
+// Tunes the scene in `filename` and saves the result as its profile, which
+// Render then picks up.
+inline TuningResult AutoTune(const std::string& filename, const CameraOptions& camera_options,
+                             const RenderOptions& render_options, const TuningGrid& grid = {}) {
+    auto output = AutoTune(ReadScene(filename), camera_options, render_options, grid);
+    SaveTuningProfile(filename, output.best);
+    return output;
+}
@@ -4,16 +4,29 @@
 #include <camera_options.h>
 #include <rotation_matrix.h>
 
+#include <utility>
+
 class Camera {
 public:
-    Camera(const CameraOptions* options)
-        : options_{options}, matrix_{options->look_from, options->look_to} {
+    // Pixel (i, j) of the camera is pixel (i + offset_x, j + offset_y) of the
+    // frame the options describe, so that a window of the frame can be
+    // rendered on its own.
+    Camera(const CameraOptions* options, int offset_x = 0, int offset_y = 0)
+        : options_{options},
+          matrix_{options->look_from, options->look_to},
+          offset_x_{offset_x},
+          offset_y_{offset_y} {
         height_ = 2 * tan(options->fov / 2);
         width_ = height_ / options->screen_height * options->screen_width;
     }
 
-    Vector GetDirection(int i, int j) {
-        double x = i + 0.5, y = -j - 0.5;
+    Vector GetDirection(int i, int j) const {
+        return GetDirection(i, j, 0.5, 0.5);
+    }
+
+    // (dx, dy) is the sample position inside pixel (i, j), both in [0, 1).
+    Vector GetDirection(int i, int j, double dx, double dy) const {
+        double x = i + offset_x_ + dx, y = -(j + offset_y_) - dy;
         x = 2 * x / options_->screen_width - 1;
         y = 2 * y / options_->screen_height + 1;
         x = x * width_ / 2;
@@ -24,8 +37,27 @@ public:
         return output;
     }
 
+    // Camera space looks down -z, so visible points have a negative z.
+    Vector ToCameraSpace(const Vector& point) const {
+        return TransposedProduct(matrix_, point - options_->look_from);
+    }
+
+    Vector ToCameraDirection(const Vector& direction) const {
+        return TransposedProduct(matrix_, direction);
+    }
+
+    // Inverse of GetDirection for a camera-space point with z < 0: the center
+    // of pixel (i, j) maps to (i + 0.5, j + 0.5).
+    std::pair<double, double> ToRaster(const Vector& camera_point) const {
+        double x = camera_point[0] / -camera_point[2];
+        double y = camera_point[1] / -camera_point[2];
+        return {(x / (width_ / 2) + 1) * options_->screen_width / 2 - offset_x_,
+                (1 - y / (height_ / 2)) * options_->screen_height / 2 - offset_y_};
+    }
+
 private:
     const CameraOptions* options_;
     RotationMatrix matrix_;
+    int offset_x_, offset_y_;
     double width_, height_;
 };
\ No newline at end of file
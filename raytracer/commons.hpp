@@ -1,6 +1,7 @@
 #pragma once
 
 #include <image.h>
+#include <camera_options.h>
 
 #include <cmath>
 #include <string>
@@ -39,4 +40,24 @@ inline void Compare(const Image& actual, const Image& expected) {
 
     double similarity = static_cast<double>(matches) / (actual.Width() * actual.Height());
     REQUIRE(similarity >= 0.99);
-}
\ No newline at end of file
+}
+
+inline void RequireEqual(const Image& actual, const Image& expected) {
+    REQUIRE(actual.Width() == expected.Width());
+    REQUIRE(actual.Height() == expected.Height());
+    int mismatches = 0;
+    for (int y = 0; y < actual.Height(); ++y) {
+        for (int x = 0; x < actual.Width(); ++x) {
+            mismatches += !(actual.GetPixel(y, x) == expected.GetPixel(y, x));
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
+
+// The view of tests/box/cube.obj most tests render.
+inline CameraOptions BoxCamera(int width = 96, int height = 72) {
+    CameraOptions camera_options(width, height, M_PI / 3);
+    camera_options.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_options.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    return camera_options;
+}
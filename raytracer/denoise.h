@@ -0,0 +1,432 @@
+#pragma once
+
+#include <tone_mapping.h>
+#include <trace.h>
+#include <camera.h>
+#include <camera_options.h>
+#include <render_options.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+// Edge-aware à-trous wavelet filter over the float framebuffer (Dammertz et
+// al., "Edge-Avoiding À-Trous Wavelet Transform"). Each pass blurs with a
+// 5 x 5 B3-spline kernel whose taps are 2^pass pixels apart; a tap's weight
+// drops with its difference to the center in depth, normal, albedo and
+// luminance, so the blur stays inside surfaces.
+
+// Planar floats: `channels` row-major planes of width x height, in arena
+// memory.
+class PlanarBuffer {
+public:
+    PlanarBuffer(int width, int height, int channels, Arena& arena)
+        : width_{width},
+          height_{height},
+          channels_{channels},
+          data_{static_cast<float*>(arena.Allocate(
+              static_cast<size_t>(width) * height * channels * sizeof(float), 32))} {
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    int Channels() const {
+        return channels_;
+    }
+
+    float* GetRow(int channel, int y) {
+        return data_ + (static_cast<size_t>(channel) * height_ + y) * width_;
+    }
+
+    const float* GetRow(int channel, int y) const {
+        return data_ + (static_cast<size_t>(channel) * height_ + y) * width_;
+    }
+
+private:
+    int width_;
+    int height_;
+    int channels_;
+    float* data_;
+};
+
+// Distance stored for rays that hit nothing. Large but finite, so that
+// differences stay finite too.
+const float kMissDepth = 1e20f;
+
+// The guides of one pixel: primary hit distance, normal (zero for a miss)
+// and diffuse albedo Kd.
+struct GuideSample {
+    float depth = kMissDepth;
+    Vector normal;
+    Vector albedo;
+};
+
+template <class SceneT>
+GuideSample TraceGuide(const Ray& ray, const SceneT& scene) {
+    GuideSample output;
+    if (auto hit = FindNearestHit(ray, scene)) {
+        output.depth = static_cast<float>(hit->intersection.GetDistance());
+        output.normal = hit->intersection.GetNormal();
+        output.albedo = scene.GetMaterials().Get(hit->material_id).diffuse_color;
+    }
+    return output;
+}
+
+// What the filter is guided by, for every pixel.
+struct GuideBuffers {
+    GuideBuffers(int width, int height, Arena& arena)
+        : depth{width, height, 1, arena}, normal{width, height, 3, arena},
+          albedo{width, height, 3, arena} {
+    }
+
+    void Set(int x, int y, const GuideSample& sample) {
+        depth.GetRow(0, y)[x] = sample.depth;
+        for (int c = 0; c < 3; ++c) {
+            normal.GetRow(c, y)[x] = static_cast<float>(sample.normal[c]);
+            albedo.GetRow(c, y)[x] = static_cast<float>(sample.albedo[c]);
+        }
+    }
+
+    PlanarBuffer depth;
+    PlanarBuffer normal;
+    PlanarBuffer albedo;
+};
+
+// Fills the guides with one primary ray through each pixel center. The
+// guides may cover a window of the frame starting at (offset_x, offset_y).
+template <class SceneT>
+void RenderGuides(const SceneT& scene, const CameraOptions& camera_options, GuideBuffers& guides,
+                  int offset_x = 0, int offset_y = 0, int threads = 0) {
+    Camera camera{&camera_options, offset_x, offset_y};
+    ParallelRows(guides.depth.Height(), threads, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            for (int x = 0; x < guides.depth.Width(); ++x) {
+                Ray ray{camera_options.look_from, camera.GetDirection(x, y)};
+                guides.Set(x, y, TraceGuide(ray, scene));
+            }
+        }
+    });
+}
+
+// e^x for x <= 0 within 2e-4 relative: 2^(x log2 e) split into a power of two
+// and a degree 5 polynomial of the fraction. Inputs below -87 give e^-87.
+inline float FastExp(float x) {
+    float t = std::max(x, -87.0f) * 1.44269504f;
+    float whole = std::floor(t);
+    float f = t - whole;
+    float p = 1.0f + f * (0.693147f + f * (0.240227f + f * (0.0555041f +
+                                                              f * (0.00961813f + f * 0.00133336f))));
+    auto scale = std::bit_cast<float>(static_cast<uint32_t>(static_cast<int>(whole) + 127) << 23);
+    return p * scale;
+}
+
+// What a pass needs besides the buffers.
+struct AtrousParameters {
+    int step;
+    // Edge-stopping factors: the sigmas of DenoiseOptions, inverted except
+    // for the normal one, and the depth one divided by the tap spacing.
+    float inv_depth;
+    float normal;
+    float inv_albedo2;
+    float inv_color;
+    // Keeps the relative luminance difference of dark pixels finite.
+    float luminance_floor;
+};
+
+inline AtrousParameters MakeAtrousParameters(const DenoiseOptions& options, int step,
+                                             float mean_luminance) {
+    return AtrousParameters{
+        step, static_cast<float>(1.0 / (options.sigma_depth * step)),
+        static_cast<float>(options.sigma_normal),
+        static_cast<float>(1.0 / (options.sigma_albedo * options.sigma_albedo)),
+        static_cast<float>(1.0 / options.sigma_color),
+        std::max(0.1f * mean_luminance, std::numeric_limits<float>::min())};
+}
+
+const float kAtrousKernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+inline float Luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// One pass over pixels [begin, end) of row y; taps outside the image are
+// dropped.
+inline void AtrousRowScalar(const PlanarBuffer& input, PlanarBuffer& output,
+                            const GuideBuffers& guides, int y, int begin, int end,
+                            const AtrousParameters& parameters) {
+    int width = input.Width();
+    int height = input.Height();
+    for (int x = begin; x < end; ++x) {
+        float depth = guides.depth.GetRow(0, y)[x];
+        float normal[3], albedo[3], color[3];
+        for (int c = 0; c < 3; ++c) {
+            normal[c] = guides.normal.GetRow(c, y)[x];
+            albedo[c] = guides.albedo.GetRow(c, y)[x];
+            color[c] = input.GetRow(c, y)[x];
+        }
+        float luminance = Luminance(color[0], color[1], color[2]);
+        float depth_scale = parameters.inv_depth / depth;
+        float sum[3] = {0, 0, 0};
+        float weights = 0;
+        for (int dy = -2; dy <= 2; ++dy) {
+            int ty = y + dy * parameters.step;
+            if (ty < 0 or ty >= height) {
+                continue;
+            }
+            for (int dx = -2; dx <= 2; ++dx) {
+                int tx = x + dx * parameters.step;
+                if (tx < 0 or tx >= width) {
+                    continue;
+                }
+                float tap[3], dot = 0, albedo_distance = 0;
+                for (int c = 0; c < 3; ++c) {
+                    tap[c] = input.GetRow(c, ty)[tx];
+                    dot += normal[c] * guides.normal.GetRow(c, ty)[tx];
+                    float difference = albedo[c] - guides.albedo.GetRow(c, ty)[tx];
+                    albedo_distance += difference * difference;
+                }
+                float tap_luminance = Luminance(tap[0], tap[1], tap[2]);
+                float exponent =
+                    std::fabs(depth - guides.depth.GetRow(0, ty)[tx]) * depth_scale +
+                    parameters.normal * (1.0f - dot) + albedo_distance * parameters.inv_albedo2 +
+                    std::fabs(luminance - tap_luminance) * parameters.inv_color /
+                        (luminance + tap_luminance + parameters.luminance_floor);
+                float weight = kAtrousKernel[dx + 2] * kAtrousKernel[dy + 2] * FastExp(-exponent);
+                for (int c = 0; c < 3; ++c) {
+                    sum[c] += weight * tap[c];
+                }
+                weights += weight;
+            }
+        }
+        // The center tap has weight kAtrousKernel[2]^2 > 0.
+        for (int c = 0; c < 3; ++c) {
+            output.GetRow(c, y)[x] = sum[c] / weights;
+        }
+    }
+}
+
+#ifdef RAYTRACER_TONE_MAPPING_AVX2
+__attribute__((target("avx2"))) inline __m256 FastExpAvx2(__m256 x) {
+    __m256 t = _mm256_mul_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)),
+                             _mm256_set1_ps(1.44269504f));
+    __m256 whole = _mm256_floor_ps(t);
+    __m256 f = _mm256_sub_ps(t, whole);
+    __m256 p = _mm256_set1_ps(0.00133336f);
+    for (float c : {0.00961813f, 0.0555041f, 0.240227f, 0.693147f, 1.0f}) {
+        p = _mm256_add_ps(_mm256_set1_ps(c), _mm256_mul_ps(f, p));
+    }
+    __m256i scale = _mm256_slli_epi32(
+        _mm256_add_epi32(_mm256_cvtps_epi32(whole), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+}
+
+__attribute__((target("avx2"))) inline __m256 LuminanceAvx2(__m256 r, __m256 g, __m256 b) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), r),
+                                       _mm256_mul_ps(_mm256_set1_ps(0.7152f), g)),
+                         _mm256_mul_ps(_mm256_set1_ps(0.0722f), b));
+}
+
+// Eight pixels at a time where every horizontal tap is inside the image; the
+// columns near the left and right edges go through the scalar kernel.
+__attribute__((target("avx2"))) inline void AtrousRowAvx2(const PlanarBuffer& input,
+                                                          PlanarBuffer& output,
+                                                          const GuideBuffers& guides, int y,
+                                                          int begin, int end,
+                                                          const AtrousParameters& parameters) {
+    int reach = 2 * parameters.step;
+    int first = std::clamp(reach, begin, end);
+    int last = std::max(first, std::min(end, input.Width() - reach));
+    AtrousRowScalar(input, output, guides, y, begin, first, parameters);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    int x = first;
+    for (; x + 8 <= last; x += 8) {
+        __m256 depth = _mm256_loadu_ps(guides.depth.GetRow(0, y) + x);
+        __m256 normal[3], albedo[3];
+        for (int c = 0; c < 3; ++c) {
+            normal[c] = _mm256_loadu_ps(guides.normal.GetRow(c, y) + x);
+            albedo[c] = _mm256_loadu_ps(guides.albedo.GetRow(c, y) + x);
+        }
+        __m256 luminance =
+            LuminanceAvx2(_mm256_loadu_ps(input.GetRow(0, y) + x),
+                          _mm256_loadu_ps(input.GetRow(1, y) + x),
+                          _mm256_loadu_ps(input.GetRow(2, y) + x));
+        __m256 depth_scale = _mm256_div_ps(_mm256_set1_ps(parameters.inv_depth), depth);
+        __m256 sum[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+        __m256 weights = _mm256_setzero_ps();
+        for (int dy = -2; dy <= 2; ++dy) {
+            int ty = y + dy * parameters.step;
+            if (ty < 0 or ty >= input.Height()) {
+                continue;
+            }
+            for (int dx = -2; dx <= 2; ++dx) {
+                int tx = x + dx * parameters.step;
+                __m256 tap[3];
+                __m256 dot = _mm256_setzero_ps(), albedo_distance = _mm256_setzero_ps();
+                for (int c = 0; c < 3; ++c) {
+                    tap[c] = _mm256_loadu_ps(input.GetRow(c, ty) + tx);
+                    dot = _mm256_add_ps(
+                        dot, _mm256_mul_ps(normal[c],
+                                           _mm256_loadu_ps(guides.normal.GetRow(c, ty) + tx)));
+                    __m256 difference =
+                        _mm256_sub_ps(albedo[c], _mm256_loadu_ps(guides.albedo.GetRow(c, ty) + tx));
+                    albedo_distance =
+                        _mm256_add_ps(albedo_distance, _mm256_mul_ps(difference, difference));
+                }
+                __m256 exponent = _mm256_mul_ps(
+                    _mm256_andnot_ps(sign, _mm256_sub_ps(depth, _mm256_loadu_ps(
+                                               guides.depth.GetRow(0, ty) + tx))),
+                    depth_scale);
+                exponent = _mm256_add_ps(exponent, _mm256_mul_ps(_mm256_set1_ps(parameters.normal),
+                                                                 _mm256_sub_ps(one, dot)));
+                exponent = _mm256_add_ps(
+                    exponent, _mm256_mul_ps(albedo_distance, _mm256_set1_ps(parameters.inv_albedo2)));
+                __m256 tap_luminance = LuminanceAvx2(tap[0], tap[1], tap[2]);
+                exponent = _mm256_add_ps(
+                    exponent,
+                    _mm256_div_ps(
+                        _mm256_mul_ps(
+                            _mm256_andnot_ps(sign, _mm256_sub_ps(luminance, tap_luminance)),
+                            _mm256_set1_ps(parameters.inv_color)),
+                        _mm256_add_ps(_mm256_add_ps(luminance, tap_luminance),
+                                      _mm256_set1_ps(parameters.luminance_floor))));
+                __m256 weight =
+                    _mm256_mul_ps(_mm256_set1_ps(kAtrousKernel[dx + 2] * kAtrousKernel[dy + 2]),
+                                  FastExpAvx2(_mm256_xor_ps(exponent, sign)));
+                for (int c = 0; c < 3; ++c) {
+                    sum[c] = _mm256_add_ps(sum[c], _mm256_mul_ps(weight, tap[c]));
+                }
+                weights = _mm256_add_ps(weights, weight);
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            _mm256_storeu_ps(output.GetRow(c, y) + x, _mm256_div_ps(sum[c], weights));
+        }
+    }
+    AtrousRowScalar(input, output, guides, y, x, end, parameters);
+}
+#endif
+
+inline void AtrousRow(const PlanarBuffer& input, PlanarBuffer& output, const GuideBuffers& guides,
+                      int y, const AtrousParameters& parameters) {
+#ifdef RAYTRACER_TONE_MAPPING_AVX2
+    static const bool kHasAvx2 = __builtin_cpu_supports("avx2");
+    if (kHasAvx2) {
+        AtrousRowAvx2(input, output, guides, y, 0, input.Width(), parameters);
+        return;
+    }
+#endif
+    AtrousRowScalar(input, output, guides, y, 0, input.Width(), parameters);
+}
+
+inline float MeanLuminance(const PlanarBuffer& color) {
+    double sum = 0;
+    for (int y = 0; y < color.Height(); ++y) {
+        for (int x = 0; x < color.Width(); ++x) {
+            sum += Luminance(color.GetRow(0, y)[x], color.GetRow(1, y)[x], color.GetRow(2, y)[x]);
+        }
+    }
+    return static_cast<float>(sum / std::max(1, color.Width() * color.Height()));
+}
+
+// Filters `hdr` in place; the guides must have its size.
+inline void Denoise(HdrBuffer& hdr, const GuideBuffers& guides, const DenoiseOptions& options,
+                    int threads = 0) {
+    TIMELINE_SCOPE("Denoise", "post");
+    int width = hdr.Width();
+    int height = hdr.Height();
+    auto& arena = ThreadArena();
+    ArenaScope scope{arena};
+    PlanarBuffer front{width, height, 3, arena}, back{width, height, 3, arena};
+    ParallelRows(height, threads, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            const float* row = hdr.GetRow(y);
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < 3; ++c) {
+                    front.GetRow(c, y)[x] = row[3 * x + c];
+                }
+            }
+        }
+    });
+    float mean_luminance = MeanLuminance(front);
+    for (int pass = 0; pass < options.iterations; ++pass) {
+        auto parameters = MakeAtrousParameters(options, 1 << pass, mean_luminance);
+        ParallelRows(height, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; ++y) {
+                AtrousRow(front, back, guides, y, parameters);
+            }
+        });
+        std::swap(front, back);
+    }
+    ParallelRows(height, threads, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            float* row = hdr.GetRow(y);
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < 3; ++c) {
+                    row[3 * x + c] = front.GetRow(c, y)[x];
+                }
+            }
+        }
+    });
+}
+
+// ResolvePixels for kFull with render_options.denoise set: the colors are
+// filtered, guided by `guides` of the image's size, before tone mapping.
+template <class Buffer>
+void ResolveDenoised(Image& image, const Buffer& prepixels, const GuideBuffers& guides,
+                     const RenderOptions& render_options, std::optional<float> max_channel = {}) {
+    StageScope stage{RenderStage::kToneMapping};
+    auto& arena = ThreadArena();
+    ArenaScope scope{arena};
+    int threads = RequestedThreads(render_options);
+    HdrBuffer hdr{image.Width(), image.Height(), arena};
+    GatherHdr(prepixels, hdr, threads);
+    Denoise(hdr, guides, *render_options.denoise, threads);
+    ToneMap(hdr, image, render_options.tone_mapping, max_channel, threads);
+}
+
+// The same, guided by a primary pass over the scene.
+template <class Buffer, class SceneT>
+void ResolveDenoised(Image& image, const Buffer& prepixels, const SceneT& scene,
+                     const CameraOptions& camera_options, const RenderOptions& render_options,
+                     int offset_x = 0, int offset_y = 0, std::optional<float> max_channel = {}) {
+    auto& arena = ThreadArena();
+    ArenaScope scope{arena};
+    GuideBuffers guides{image.Width(), image.Height(), arena};
+    {
+        StageScope stage{RenderStage::kToneMapping};
+        RenderGuides(scene, camera_options, guides, offset_x, offset_y,
+                     RequestedThreads(render_options));
+    }
+    ResolveDenoised(image, prepixels, guides, render_options, max_channel);
+}
+
+// Whether ResolveFrame denoises: only kFull colors are filtered.
+inline bool Denoises(const RenderOptions& render_options) {
+    return render_options.denoise and render_options.mode == RenderMode::kFull;
+}
+
+// Resolves through the denoiser when render_options ask for it. The image
+// may be a window of the frame starting at (offset_x, offset_y); max_value
+// is as in ResolvePixels.
+template <class Buffer, class SceneT>
+void ResolveFrame(Image& image, const Buffer& prepixels, const SceneT& scene,
+                  const CameraOptions& camera_options, const RenderOptions& render_options,
+                  int offset_x = 0, int offset_y = 0, std::optional<double> max_value = {}) {
+    if (Denoises(render_options)) {
+        ResolveDenoised(image, prepixels, scene, camera_options, render_options, offset_x,
+                        offset_y, max_value ? std::optional<float>{*max_value} : std::nullopt);
+    } else {
+        ResolvePixels(image, prepixels, render_options.mode, render_options.tone_mapping,
+                      max_value, RequestedThreads(render_options));
+    }
+}
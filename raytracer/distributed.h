@@ -0,0 +1,302 @@
+#pragma once
+
+#include <raytracer.h>
+#include <tile.h>
+#include <socket_io.h>
+
+#include <deque>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct DistributedOptions {
+    int workers = 4;
+    int tile_size = 32;
+    // How many crashed workers may be replaced by fresh ones over one render.
+    int max_restarts = 4;
+    // Called every time a tile is handed to a worker process.
+    std::function<void(pid_t, const Tile&)> on_tile_assigned;
+};
+
+// Values a worker sends per pixel: the color, then the denoiser's guides
+// (depth, normal, albedo) when the render is denoised.
+inline size_t TilePayloadStride(const RenderOptions& render_options) {
+    return Denoises(render_options) ? 10 : 3;
+}
+
+// Worker side: loads the scene once, then answers tile requests with the raw
+// values of the tile, column by column, until the coordinator closes the
+// socket. With anti-aliasing the tile goes through AntiAliasPixels, which
+// refines the same pixels as a whole-frame render.
+[[noreturn]] inline void RunTileWorker(int fd, const std::string& filename,
+                                       const CameraOptions& camera_options,
+                                       const RenderOptions& render_options) {
+    try {
+        const auto scene = ReadScene(filename);
+        Camera camera{&camera_options};
+        bool anti_aliased = render_options.anti_aliasing.max_samples > 1 and
+                            render_options.mode != RenderMode::kDepth;
+        bool guided = Denoises(render_options);
+        Tile tile;
+        std::vector<double> payload;
+        std::vector<std::vector<Vector>> prepixels;
+        while (ReadAll(fd, &tile, sizeof(tile))) {
+            payload.clear();
+            if (anti_aliased) {
+                AntiAliasPixels(scene, camera_options, render_options, tile, prepixels);
+            }
+            for (int i = tile.x; i < tile.x + tile.width; ++i) {
+                for (int j = tile.y; j < tile.y + tile.height; ++j) {
+                    Vector value;
+                    if (anti_aliased) {
+                        value = prepixels[i - tile.x][j - tile.y];
+                    } else {
+                        Ray ray{camera_options.look_from, camera.GetDirection(i, j)};
+                        value = TracePixel(ray, scene, render_options);
+                    }
+                    payload.insert(payload.end(), {value[0], value[1], value[2]});
+                    if (guided) {
+                        Ray ray{camera_options.look_from, camera.GetDirection(i, j)};
+                        auto guide = TraceGuide(ray, scene);
+                        payload.insert(payload.end(),
+                                       {guide.depth, guide.normal[0], guide.normal[1],
+                                        guide.normal[2], guide.albedo[0], guide.albedo[1],
+                                        guide.albedo[2]});
+                    }
+                }
+            }
+            if (!WriteAll(fd, &tile, sizeof(tile)) or
+                !WriteAll(fd, payload.data(), payload.size() * sizeof(double))) {
+                break;
+            }
+        }
+    } catch (...) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+class TileCoordinator {
+public:
+    TileCoordinator(const std::string& filename, const CameraOptions& camera_options,
+                    const RenderOptions& render_options, const DistributedOptions& options)
+        : filename_{filename},
+          camera_options_{camera_options},
+          render_options_{render_options},
+          options_{options},
+          restarts_left_{options.max_restarts} {
+    }
+
+    TileCoordinator(const TileCoordinator&) = delete;
+    TileCoordinator& operator=(const TileCoordinator&) = delete;
+
+    ~TileCoordinator() {
+        for (auto& worker : workers_) {
+            Stop(worker);
+        }
+    }
+
+    Image Run() {
+        int width = camera_options_.screen_width;
+        int height = camera_options_.screen_height;
+        auto tiles = SplitIntoTiles(width, height, options_.tile_size);
+        pending_.assign(tiles.begin(), tiles.end());
+        prepixels_.assign(width, std::vector<Vector>(height));
+        ArenaScope scope{arena_};
+        guides_.reset();
+        if (Denoises(render_options_)) {
+            guides_.emplace(width, height, arena_);
+        }
+
+        for (int k = 0; k < std::max(options_.workers, 1); ++k) {
+            Spawn();
+        }
+        size_t done = 0;
+        while (done < tiles.size()) {
+            // Assigning can replace a failed worker, so index instead of iterating.
+            for (size_t k = 0; k < workers_.size(); ++k) {
+                if (workers_[k].pid > 0 and !workers_[k].busy) {
+                    Assign(workers_[k]);
+                }
+            }
+            std::vector<pollfd> fds;
+            std::vector<size_t> owners;
+            for (size_t k = 0; k < workers_.size(); ++k) {
+                if (workers_[k].pid > 0 and workers_[k].busy) {
+                    fds.push_back(pollfd{workers_[k].fd, POLLIN, 0});
+                    owners.push_back(k);
+                }
+            }
+            if (fds.empty()) {
+                throw std::runtime_error("All tile workers have failed");
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("poll failed while waiting for tile workers");
+            }
+            for (size_t k = 0; k < fds.size(); ++k) {
+                if (fds[k].revents == 0) {
+                    continue;
+                }
+                auto& worker = workers_[owners[k]];
+                if (Receive(worker)) {
+                    ++done;
+                } else {
+                    Fail(worker);
+                }
+            }
+        }
+
+        Image output{width, height};
+        if (guides_) {
+            ResolveDenoised(output, prepixels_, *guides_, render_options_);
+            guides_.reset();
+        } else {
+            ResolvePixels(output, prepixels_, render_options_.mode, render_options_.tone_mapping,
+                          {}, RequestedThreads(render_options_));
+        }
+        return output;
+    }
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        int fd = -1;
+        bool busy = false;
+        Tile tile{};
+    };
+
+    void Spawn() {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            throw std::runtime_error("Can't create a socket pair for a tile worker");
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            throw std::runtime_error("Can't fork a tile worker");
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            // Other workers must see EOF when the coordinator drops them.
+            for (auto& worker : workers_) {
+                if (worker.fd >= 0) {
+                    close(worker.fd);
+                }
+            }
+            RunTileWorker(fds[1], filename_, camera_options_, render_options_);
+        }
+        close(fds[1]);
+        Worker worker;
+        worker.pid = pid;
+        worker.fd = fds[0];
+        workers_.push_back(worker);
+    }
+
+    void Assign(Worker& worker) {
+        if (pending_.empty()) {
+            return;
+        }
+        worker.tile = pending_.front();
+        pending_.pop_front();
+        worker.busy = true;
+        if (options_.on_tile_assigned) {
+            options_.on_tile_assigned(worker.pid, worker.tile);
+        }
+        if (!WriteAll(worker.fd, &worker.tile, sizeof(Tile))) {
+            Fail(worker);
+        }
+    }
+
+    bool Receive(Worker& worker) {
+        Tile tile;
+        if (!ReadAll(worker.fd, &tile, sizeof(tile)) or tile.x != worker.tile.x or
+            tile.y != worker.tile.y or tile.width != worker.tile.width or
+            tile.height != worker.tile.height) {
+            return false;
+        }
+        auto stride = TilePayloadStride(render_options_);
+        std::vector<double> payload(static_cast<size_t>(tile.width) * tile.height * stride);
+        if (!ReadAll(worker.fd, payload.data(), payload.size() * sizeof(double))) {
+            return false;
+        }
+        const double* value = payload.data();
+        for (int i = tile.x; i < tile.x + tile.width; ++i) {
+            for (int j = tile.y; j < tile.y + tile.height; ++j, value += stride) {
+                prepixels_[i][j] = Vector{value[0], value[1], value[2]};
+                if (guides_) {
+                    guides_->Set(i, j,
+                                 GuideSample{static_cast<float>(value[3]),
+                                             Vector{value[4], value[5], value[6]},
+                                             Vector{value[7], value[8], value[9]}});
+                }
+            }
+        }
+        worker.busy = false;
+        return true;
+    }
+
+    // Puts the lost tile back in front of the queue and replaces the worker
+    // while the restart budget lasts.
+    void Fail(Worker& worker) {
+        if (worker.busy) {
+            pending_.push_front(worker.tile);
+            worker.busy = false;
+        }
+        if (worker.pid > 0) {
+            kill(worker.pid, SIGKILL);
+        }
+        Stop(worker);
+        if (restarts_left_ > 0) {
+            --restarts_left_;
+            Spawn();
+        }
+    }
+
+    void Stop(Worker& worker) {
+        if (worker.fd >= 0) {
+            close(worker.fd);
+            worker.fd = -1;
+        }
+        if (worker.pid > 0) {
+            int status;
+            waitpid(worker.pid, &status, 0);
+            worker.pid = -1;
+        }
+    }
+
+    std::string filename_;
+    CameraOptions camera_options_;
+    RenderOptions render_options_;
+    DistributedOptions options_;
+    int restarts_left_;
+    std::deque<Tile> pending_;
+    std::deque<Worker> workers_;
+    std::vector<std::vector<Vector>> prepixels_;
+    // The denoiser's guides, sent by the workers next to the values.
+    Arena arena_;
+    std::optional<GuideBuffers> guides_;
+};
+
+// Splits the frame into tiles and traces them in forked worker processes, then
+// resolves (tone maps) the reassembled frame globally. With denoise the
+// workers also trace the denoiser's guides, so the coordinator never loads
+// the scene. The image equals RenderScene's, anti-aliased, denoised or not.
+inline Image RenderDistributed(const std::string& filename, const CameraOptions& camera_options,
+                               const RenderOptions& render_options,
+                               const DistributedOptions& options = {}) {
+    TileCoordinator coordinator{filename, camera_options, render_options, options};
+    return coordinator.Run();
+}
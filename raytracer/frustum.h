@@ -0,0 +1,224 @@
+#pragma once
+
+#include <trace.h>
+#include <render_kernels.h>
+#include <camera.h>
+#include <tile.h>
+#include <arena.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <span>
+#include <vector>
+
+// Slack for the plane tests, so that culling stays conservative under rounding.
+const double kFrustumEpsilon = 1e-6;
+
+struct Bounds {
+    Vector min{std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+               std::numeric_limits<double>::max()};
+    Vector max{std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(),
+               std::numeric_limits<double>::lowest()};
+
+    void Extend(const Vector& point) {
+        for (int k = 0; k < 3; ++k) {
+            min[k] = std::min(min[k], point[k]);
+            max[k] = std::max(max[k], point[k]);
+        }
+    }
+
+    bool Empty() const {
+        return min[0] > max[0];
+    }
+};
+
+inline Bounds ComputeSceneBounds(const Scene& scene) {
+    Bounds output;
+    for (const auto& object : scene.GetObjects()) {
+        for (int k = 0; k < 3; ++k) {
+            output.Extend(object.polygon.GetVertex(k));
+        }
+    }
+    for (const auto& object : scene.GetSphereObjects()) {
+        auto radius = object.sphere.GetRadius();
+        output.Extend(object.sphere.GetCenter() - Vector{radius, radius, radius});
+        output.Extend(object.sphere.GetCenter() + Vector{radius, radius, radius});
+    }
+    return output;
+}
+
+// The pyramid spanned by the primary rays of one tile: four planes through
+// the camera position, with normals pointing inside.
+class TileFrustum {
+public:
+    TileFrustum(const Camera& camera, const Vector& origin, const Tile& tile) : origin_{origin} {
+        Vector corners[4] = {
+            camera.GetDirection(tile.x, tile.y, 0, 0),
+            camera.GetDirection(tile.x + tile.width, tile.y, 0, 0),
+            camera.GetDirection(tile.x + tile.width, tile.y + tile.height, 0, 0),
+            camera.GetDirection(tile.x, tile.y + tile.height, 0, 0)};
+        auto center = corners[0] + corners[1] + corners[2] + corners[3];
+        for (int k = 0; k < 4; ++k) {
+            normals_[k] = CrossProduct(corners[k], corners[(k + 1) % 4]);
+            normals_[k].Normalize();
+            if (DotProduct(normals_[k], center) < 0) {
+                normals_[k] = normals_[k] * -1.0;
+            }
+        }
+    }
+
+    // False only if the points are all outside one of the planes.
+    bool MayContain(const Vector* points, int count) const {
+        for (const auto& normal : normals_) {
+            bool outside = true;
+            for (int k = 0; k < count and outside; ++k) {
+                outside = DotProduct(normal, points[k] - origin_) < -kFrustumEpsilon;
+            }
+            if (outside) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool MayContain(const Bounds& bounds) const {
+        if (bounds.Empty()) {
+            return false;
+        }
+        Vector corners[8];
+        for (int k = 0; k < 8; ++k) {
+            corners[k] = Vector{k & 1 ? bounds.max[0] : bounds.min[0],
+                                k & 2 ? bounds.max[1] : bounds.min[1],
+                                k & 4 ? bounds.max[2] : bounds.min[2]};
+        }
+        return MayContain(corners, 8);
+    }
+
+    bool MayContain(const Sphere& sphere) const {
+        for (const auto& normal : normals_) {
+            if (DotProduct(normal, sphere.GetCenter() - origin_) <
+                -sphere.GetRadius() - kFrustumEpsilon) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    Vector origin_;
+    Vector normals_[4];
+};
+
+// The primitives a tile's primary rays can hit, in scene order. The index
+// lists live in the arena and are sized for the whole scene, so one
+// TilePrimitives is refilled for every tile without allocating.
+struct TilePrimitives {
+    TilePrimitives(const Scene& scene, Arena& arena)
+        : triangle_storage_{arena.AllocateArray<int>(scene.GetObjects().size())},
+          sphere_storage_{arena.AllocateArray<int>(scene.GetSphereObjects().size())} {
+        spheres.Reserve(scene.GetSphereObjects().size());
+    }
+
+    std::span<int> triangles;
+    SphereBatch spheres;
+    std::span<int> sphere_ids;
+
+private:
+    friend void CullPrimitives(const Scene&, const TileFrustum&, TilePrimitives&);
+    int* triangle_storage_;
+    int* sphere_storage_;
+};
+
+inline void CullPrimitives(const Scene& scene, const TileFrustum& frustum,
+                           TilePrimitives& output) {
+    size_t triangle_count = 0;
+    const auto& objects = scene.GetObjects();
+    for (size_t i = 0; i < objects.size(); ++i) {
+        Vector vertices[3] = {objects[i].polygon.GetVertex(0), objects[i].polygon.GetVertex(1),
+                              objects[i].polygon.GetVertex(2)};
+        if (frustum.MayContain(vertices, 3)) {
+            output.triangle_storage_[triangle_count++] = static_cast<int>(i);
+        }
+    }
+    output.triangles = std::span<int>{output.triangle_storage_, triangle_count};
+
+    size_t sphere_count = 0;
+    output.spheres.Clear();
+    const auto& spheres = scene.GetSphereObjects();
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        if (frustum.MayContain(spheres[i].sphere)) {
+            output.spheres.Add(spheres[i].sphere);
+            output.sphere_storage_[sphere_count++] = static_cast<int>(i);
+        }
+    }
+    output.sphere_ids = std::span<int>{output.sphere_storage_, sphere_count};
+}
+
+// FindNearestHit restricted to the primitives that survived culling.
+inline std::optional<SurfaceHit> FindNearestHit(const Ray& ray, const Scene& scene,
+                                                const TilePrimitives& primitives) {
+    double min_dist = std::numeric_limits<double>::max();
+    std::optional<SurfaceHit> best;
+    const auto& objects = scene.GetObjects();
+    for (int i : primitives.triangles) {
+        auto inter = GetIntersection(ray, objects[i].polygon);
+        if (inter and inter.value().GetDistance() < min_dist) {
+            min_dist = inter.value().GetDistance();
+            Intersection new_inter{
+                inter.value().GetPosition(),
+                ComputeNormal(objects[i], inter.value().GetPosition(), inter.value().GetNormal()),
+                inter.value().GetDistance()};
+            best.emplace(SurfaceHit{new_inter, objects[i].material_id, i});
+        }
+    }
+    auto sphere_hit = FindNearestSphere(ray, primitives.spheres);
+    if (sphere_hit and sphere_hit.value().distance < min_dist) {
+        int index = primitives.sphere_ids[sphere_hit.value().index];
+        best.emplace(SurfaceHit{MakeSphereIntersection(ray, primitives.spheres, sphere_hit.value()),
+                                scene.GetSphereObjects()[index].material_id,
+                                static_cast<int>(objects.size()) + index});
+    }
+    return best;
+}
+
+// Traces the primary rays of one tile against the primitives inside its
+// frustum and shades the hits with `shade`; secondary rays still see the
+// whole scene. Tiles that miss the scene bounds are filled with the
+// background without tracing. `primitives` is scratch space.
+inline void TraceTile(const Scene& scene, const Bounds& scene_bounds, const Camera& camera,
+                      const Vector& origin, const Tile& tile, const RenderOptions& render_options,
+                      PixelKernel shade, TilePrimitives& primitives, PixelBuffer& prepixels) {
+    TileFrustum frustum{camera, origin, tile};
+    if (!frustum.MayContain(scene_bounds)) {
+        for (int i = tile.x; i < tile.x + tile.width; ++i) {
+            std::fill(prepixels[i] + tile.y, prepixels[i] + tile.y + tile.height, Vector());
+        }
+        return;
+    }
+    // Primary hits first, then shading, so that each phase can be measured
+    // on its own; the tile's rays and hits are scratch in the arena.
+    auto& arena = ThreadArena();
+    ArenaScope scope{arena};
+    size_t size = static_cast<size_t>(tile.width) * tile.height;
+    auto rays = arena.AllocateArray<Ray>(size);
+    auto hits = arena.AllocateArray<std::optional<SurfaceHit>>(size);
+    {
+        StageScope stage{RenderStage::kPrimaryTrace};
+        CullPrimitives(scene, frustum, primitives);
+        size_t k = 0;
+        for (int i = tile.x; i < tile.x + tile.width; ++i) {
+            for (int j = tile.y; j < tile.y + tile.height; ++j, ++k) {
+                std::construct_at(rays + k, origin, camera.GetDirection(i, j));
+                std::construct_at(hits + k, FindNearestHit(rays[k], scene, primitives));
+            }
+        }
+    }
+    StageScope stage{RenderStage::kShading};
+    size_t k = 0;
+    for (int i = tile.x; i < tile.x + tile.width; ++i) {
+        for (int j = tile.y; j < tile.y + tile.height; ++j, ++k) {
+            prepixels[i][j] = shade(rays[k], hits[k], scene, render_options);
+        }
+    }
+}
@@ -2,7 +2,12 @@
 
 #include <png.h>
 #include <jpeglib.h>
+#include <timeline.h>
+#include <perf_counters.h>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 struct RGB {
     int r, g, b;
@@ -39,6 +44,26 @@ public:
         }
     }
 
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    Image(Image&& other) : width_{other.width_}, height_{other.height_}, bytes_{other.bytes_} {
+        other.width_ = other.height_ = 0;
+        other.bytes_ = nullptr;
+    }
+
+    Image& operator=(Image&& other) {
+        if (this != &other) {
+            Release();
+            width_ = other.width_;
+            height_ = other.height_;
+            bytes_ = other.bytes_;
+            other.width_ = other.height_ = 0;
+            other.bytes_ = nullptr;
+        }
+        return *this;
+    }
+
     explicit Image(const std::string& filename) {
         if (filename.find(".png") != std::string::npos) {
             ReadPng(filename);
@@ -161,7 +186,9 @@ public:
         fclose(infile);
     }
 
-    void Write(const std::string& filename) {
+    void Write(const std::string& filename) const {
+        TIMELINE_SCOPE("Image::Write", "encode");
+        StageScope stage{RenderStage::kEncode};
         FILE* fp = fopen(filename.c_str(), "wb");
         if (!fp) {
             throw std::runtime_error("Can't open file " + filename);
@@ -182,21 +209,40 @@ public:
         }
 
         png_init_io(png, fp);
+        WritePng(png, info);
 
-        // Output is 8bit depth, RGBA format.
-        png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-        png_write_info(png, info);
+        fclose(fp);
+        png_destroy_write_struct(&png, &info);
+    }
 
-        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-        // Use png_set_filler().
-        // png_set_filler(png, 0, PNG_FILLER_AFTER);
+    // Same output as Write, kept in memory.
+    std::vector<unsigned char> EncodePng() const {
+        TIMELINE_SCOPE("Image::EncodePng", "encode");
+        StageScope stage{RenderStage::kEncode};
+        std::vector<unsigned char> output;
+        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png) {
+            throw std::runtime_error("Can't create png write struct");
+        }
 
-        png_write_image(png, bytes_);
-        png_write_end(png, nullptr);
+        png_infop info = png_create_info_struct(png);
+        if (!info) {
+            throw std::runtime_error("Can't create png info struct");
+        }
+
+        if (setjmp(png_jmpbuf(png))) {
+            abort();
+        }
+
+        auto append = [](png_structp png, png_bytep data, png_size_t length) {
+            auto buffer = static_cast<std::vector<unsigned char>*>(png_get_io_ptr(png));
+            buffer->insert(buffer->end(), data, data + length);
+        };
+        png_set_write_fn(png, &output, append, nullptr);
+        WritePng(png, info);
 
-        fclose(fp);
         png_destroy_write_struct(&png, &info);
+        return output;
     }
 
     RGB GetPixel(int y, int x) const {
@@ -213,6 +259,11 @@ public:
         px[2] = pixel.b;
     }
 
+    // RGBA bytes of row y.
+    png_bytep GetRow(int y) {
+        return bytes_[y];
+    }
+
     int Height() const {
         return height_;
     }
@@ -222,13 +273,99 @@ public:
     }
 
     ~Image() {
+        Release();
+    }
+
+private:
+    void WritePng(png_structp png, png_infop info) const {
+        // Output is 8bit depth, RGBA format.
+        png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+
+        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
+        // Use png_set_filler().
+        // png_set_filler(png, 0, PNG_FILLER_AFTER);
+
+        png_write_image(png, bytes_);
+        png_write_end(png, nullptr);
+    }
+
+    void Release() {
         for (int i = 0; i < height_; ++i) {
             free(bytes_[i]);
         }
         free(bytes_);
+        bytes_ = nullptr;
     }
 
-private:
     int width_, height_;
     png_bytep* bytes_;
 };
+
+// Writes an RGBA PNG one row at a time, top to bottom, so the image never
+// has to be in memory; the file is the same as Image::Write's.
+class PngRowWriter {
+public:
+    PngRowWriter(const std::string& filename, int width, int height) {
+        file_ = fopen(filename.c_str(), "wb");
+        if (!file_) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png_) {
+            fclose(file_);
+            throw std::runtime_error("Can't create png write struct");
+        }
+        info_ = png_create_info_struct(png_);
+        if (!info_) {
+            png_destroy_write_struct(&png_, nullptr);
+            fclose(file_);
+            throw std::runtime_error("Can't create png info struct");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_init_io(png_, file_);
+        png_set_IHDR(png_, info_, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_, info_);
+    }
+
+    PngRowWriter(const PngRowWriter&) = delete;
+    PngRowWriter& operator=(const PngRowWriter&) = delete;
+
+    // RGBA bytes of the next row.
+    void WriteRow(png_const_bytep row) {
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_row(png_, row);
+    }
+
+    // Call after the last row.
+    void Finish() {
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_end(png_, nullptr);
+        Release();
+    }
+
+    ~PngRowWriter() {
+        Release();
+    }
+
+private:
+    void Release() {
+        if (file_) {
+            png_destroy_write_struct(&png_, &info_);
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+};
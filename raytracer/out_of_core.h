@@ -0,0 +1,698 @@
+#pragma once
+
+#include <trace.h>
+#include <antialiasing.h>
+#include <arena.h>
+#include <camera.h>
+#include <camera_options.h>
+#include <render_options.h>
+#include <render_statistics.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct OutOfCoreOptions {
+    // Where the clustered triangles are written; the file is reused as long
+    // as it was built from the same OBJ file with the same cluster size.
+    std::string cache_path;
+    // Budget for resident clusters, in bytes.
+    size_t memory_budget = 64 << 20;
+    // Maximum number of triangles per cluster.
+    int cluster_size = 256;
+};
+
+// One triangle as stored in the cache file.
+struct TriangleRecord {
+    int32_t id;
+    int32_t material_id;
+    double vertices[9];
+    double normals[9];
+    uint8_t has_normal[3];
+};
+
+struct ClusterRecord {
+    uint64_t offset;
+    uint64_t count;
+};
+
+// Node of the resident top-level hierarchy over the clusters; leaves have
+// cluster >= 0.
+struct ClusterNode {
+    double min[3];
+    double max[3];
+    int32_t left;
+    int32_t right;
+    int32_t cluster;
+};
+
+struct GeometryCacheHeader {
+    char magic[8];
+    uint64_t source_size;
+    int64_t source_time;
+    // Of the material libraries and their material names: the stored
+    // material IDs index the table built from them.
+    uint64_t materials_hash;
+    uint64_t cluster_size;
+    uint64_t triangle_count;
+    uint64_t table_offset;
+    uint64_t cluster_count;
+    uint64_t node_count;
+};
+
+const char kGeometryCacheMagic[8] = {'R', 'T', 'G', 'E', 'O', 'C', '2', '\0'};
+
+// A resident set of triangles.
+struct GeometryCluster {
+    std::vector<Object> objects;
+    // Triangle indices in file order, used as SurfaceHit::object_id.
+    std::vector<int> ids;
+    size_t bytes = 0;
+};
+
+// Clusters paged in from the cache file on demand and evicted in LRU order
+// once the resident ones exceed the memory budget. The cluster just paged in
+// always stays.
+class ClusterCache {
+public:
+    ClusterCache(const std::string& path, size_t memory_budget) : memory_budget_{memory_budget} {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Can't open geometry cache " + path);
+        }
+    }
+
+    ClusterCache(const ClusterCache&) = delete;
+    ClusterCache& operator=(const ClusterCache&) = delete;
+
+    ~ClusterCache() {
+        close(fd_);
+    }
+
+    std::shared_ptr<const GeometryCluster> Get(int index, const ClusterRecord& record,
+                                               const MaterialTable& materials) {
+        std::lock_guard guard{mutex_};
+        ++lookups_;
+        auto it = resident_.find(index);
+        if (it != resident_.end()) {
+            ++hits_;
+            lru_.splice(lru_.begin(), lru_, it->second.position);
+            return it->second.cluster;
+        }
+        auto cluster = PageIn(record, materials);
+        ++page_ins_;
+        lru_.push_front(index);
+        resident_.emplace(index, Entry{cluster, lru_.begin()});
+        resident_bytes_ += cluster->bytes;
+        while (resident_bytes_ > memory_budget_ and lru_.size() > 1) {
+            auto victim = resident_.find(lru_.back());
+            resident_bytes_ -= victim->second.cluster->bytes;
+            resident_.erase(victim);
+            lru_.pop_back();
+        }
+        return cluster;
+    }
+
+    size_t PageIns() const {
+        std::lock_guard guard{mutex_};
+        return page_ins_;
+    }
+
+    size_t Lookups() const {
+        std::lock_guard guard{mutex_};
+        return lookups_;
+    }
+
+    size_t Hits() const {
+        std::lock_guard guard{mutex_};
+        return hits_;
+    }
+
+    size_t ResidentBytes() const {
+        std::lock_guard guard{mutex_};
+        return resident_bytes_;
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const GeometryCluster> cluster;
+        std::list<int>::iterator position;
+    };
+
+    std::shared_ptr<const GeometryCluster> PageIn(const ClusterRecord& record,
+                                                  const MaterialTable& materials) const {
+        std::vector<TriangleRecord> records(record.count);
+        size_t size = records.size() * sizeof(TriangleRecord);
+        auto data = reinterpret_cast<char*>(records.data());
+        for (size_t done = 0; done < size;) {
+            auto n = pread(fd_, data + done, size - done, record.offset + done);
+            if (n <= 0) {
+                throw std::runtime_error("Can't read geometry cluster");
+            }
+            done += n;
+        }
+        auto cluster = std::make_shared<GeometryCluster>();
+        cluster->objects.reserve(records.size());
+        for (const auto& triangle : records) {
+            if (triangle.material_id < 0 or
+                static_cast<size_t>(triangle.material_id) >= materials.Size()) {
+                throw std::runtime_error("Geometry cluster refers to an unknown material");
+            }
+            const auto* v = triangle.vertices;
+            Object obj{triangle.material_id,
+                       Triangle{Vector{v[0], v[1], v[2]}, Vector{v[3], v[4], v[5]},
+                                Vector{v[6], v[7], v[8]}}};
+            for (int k = 0; k < 3; ++k) {
+                if (triangle.has_normal[k]) {
+                    const auto* n = triangle.normals + 3 * k;
+                    obj.SetNormal(k, Vector{n[0], n[1], n[2]});
+                }
+            }
+            cluster->objects.push_back(std::move(obj));
+            cluster->ids.push_back(triangle.id);
+        }
+        cluster->bytes = sizeof(GeometryCluster) +
+                         records.size() * (sizeof(Object) + sizeof(int));
+        return cluster;
+    }
+
+    int fd_;
+    size_t memory_budget_;
+    mutable std::mutex mutex_;
+    std::list<int> lru_;
+    std::unordered_map<int, Entry> resident_;
+    size_t resident_bytes_ = 0;
+    size_t page_ins_ = 0;
+    size_t lookups_ = 0;
+    size_t hits_ = 0;
+};
+
+// Entry distance of the ray into the node box, if it enters before max_distance.
+inline std::optional<double> EnterNode(const Ray& ray, const ClusterNode& node,
+                                       double max_distance) {
+    double t_near = 0, t_far = max_distance;
+    for (int k = 0; k < 3; ++k) {
+        double origin = ray.GetOrigin()[k], direction = ray.GetDirection()[k];
+        if (direction == 0) {
+            if (origin < node.min[k] or origin > node.max[k]) {
+                return {};
+            }
+            continue;
+        }
+        double t0 = (node.min[k] - origin) / direction;
+        double t1 = (node.max[k] - origin) / direction;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_near = std::max(t_near, t0);
+        t_far = std::min(t_far, t1);
+        if (t_near > t_far) {
+            return {};
+        }
+    }
+    return t_near;
+}
+
+// Scene whose triangles live in a clustered cache file. Materials, spheres
+// and lights stay resident, as does the hierarchy over the cluster bounds;
+// triangles are paged in per cluster while rays traverse it.
+class OutOfCoreScene {
+public:
+    OutOfCoreScene(const std::string& filename, const OutOfCoreOptions& options) {
+        if (options.cluster_size < 1) {
+            throw std::runtime_error("Cluster size must be positive");
+        }
+        // The resident part names the material libraries the header covers.
+        ParseObj(filename, nullptr);
+        auto header = ExpectedHeader(filename, options);
+        cache_reused_ = ReadTables(options.cache_path, header);
+        if (!cache_reused_) {
+            resident_ = Scene{};
+            material_libraries_.clear();
+            Build(filename, options, header);
+        }
+        cache_ = std::make_unique<ClusterCache>(options.cache_path, options.memory_budget);
+    }
+
+    const std::vector<Light>& GetLights() const {
+        return resident_.GetLights();
+    }
+
+    const MaterialTable& GetMaterials() const {
+        return resident_.GetMaterials();
+    }
+
+    const Scene& GetResident() const {
+        return resident_;
+    }
+
+    size_t TriangleCount() const {
+        return triangle_count_;
+    }
+
+    size_t ClusterCount() const {
+        return clusters_.size();
+    }
+
+    // Whether the constructor found a valid cache file instead of building it.
+    bool CacheReused() const {
+        return cache_reused_;
+    }
+
+    const ClusterCache& GetCache() const {
+        return *cache_;
+    }
+
+    std::optional<SurfaceHit> FindNearestHit(const Ray& ray) const {
+        double min_dist = std::numeric_limits<double>::max();
+        std::optional<SurfaceHit> best;
+        Traverse(ray, min_dist, [&](const GeometryCluster& cluster) {
+            for (size_t i = 0; i < cluster.objects.size(); ++i) {
+                const auto& obj = cluster.objects[i];
+                auto inter = GetIntersection(ray, obj.polygon);
+                if (inter and inter.value().GetDistance() < min_dist) {
+                    min_dist = inter.value().GetDistance();
+                    Intersection new_inter{
+                        inter.value().GetPosition(),
+                        ComputeNormal(obj, inter.value().GetPosition(), inter.value().GetNormal()),
+                        inter.value().GetDistance()};
+                    best.emplace(SurfaceHit{new_inter, obj.material_id, cluster.ids[i]});
+                }
+            }
+            return false;
+        });
+        const auto& batch = resident_.GetSphereBatch();
+        auto sphere_hit = FindNearestSphere(ray, batch);
+        if (sphere_hit and sphere_hit.value().distance < min_dist) {
+            auto index = sphere_hit.value().index;
+            best.emplace(SurfaceHit{MakeSphereIntersection(ray, batch, sphere_hit.value()),
+                                    resident_.GetSphereObjects()[index].material_id,
+                                    static_cast<int>(triangle_count_ + index)});
+        }
+        return best;
+    }
+
+    bool IsOccluded(const Ray& ray, double length) const {
+        bool occluded = false;
+        Traverse(ray, length, [&](const GeometryCluster& cluster) {
+            for (const auto& obj : cluster.objects) {
+                auto inter = GetIntersection(ray, obj.polygon);
+                if (inter and inter.value().GetDistance() < length) {
+                    occluded = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+        if (occluded) {
+            return true;
+        }
+        auto sphere_hit = FindNearestSphere(ray, resident_.GetSphereBatch());
+        return sphere_hit and sphere_hit.value().distance < length;
+    }
+
+private:
+    static constexpr size_t kMaxTraversalDepth = 64;
+
+    struct Face {
+        int vertices[3];
+        int normals[3];
+        int material_id;
+    };
+
+    // Visits the clusters whose bounds the ray enters before max_distance,
+    // nearer subtrees first; `visit` returns true to stop. max_distance is
+    // re-read after each visit, so hits found so far prune the rest.
+    template <class Visit>
+    void Traverse(const Ray& ray, const double& max_distance, Visit visit) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        // The tree is split at medians, so its depth is logarithmic and at most
+        // one sibling per level waits on the stack.
+        std::array<std::pair<double, int>, kMaxTraversalDepth> stack;
+        size_t size = 0;
+        stack[size++] = {0.0, 0};
+        while (size > 0) {
+            auto [entry, index] = stack[--size];
+            if (entry > max_distance) {
+                continue;
+            }
+            const auto& node = nodes_[index];
+            if (node.cluster >= 0) {
+                auto cluster = cache_->Get(node.cluster, clusters_[node.cluster],
+                                           resident_.GetMaterials());
+                if (visit(*cluster)) {
+                    return;
+                }
+                continue;
+            }
+            auto left = EnterNode(ray, nodes_[node.left], max_distance);
+            auto right = EnterNode(ray, nodes_[node.right], max_distance);
+            if (left and right and left.value() < right.value()) {
+                stack[size++] = {right.value(), node.right};
+                stack[size++] = {left.value(), node.left};
+            } else {
+                if (left) {
+                    stack[size++] = {left.value(), node.left};
+                }
+                if (right) {
+                    stack[size++] = {right.value(), node.right};
+                }
+            }
+        }
+    }
+
+    GeometryCacheHeader ExpectedHeader(const std::string& filename,
+                                       const OutOfCoreOptions& options) const {
+        GeometryCacheHeader header{};
+        std::memcpy(header.magic, kGeometryCacheMagic, sizeof(header.magic));
+        header.source_size = std::filesystem::file_size(filename);
+        header.source_time = std::filesystem::last_write_time(filename).time_since_epoch().count();
+        header.materials_hash = MaterialsHash();
+        header.cluster_size = options.cluster_size;
+        return header;
+    }
+
+    // FNV-1a over the size and modification time of every material library
+    // and the names of the materials in ID order.
+    uint64_t MaterialsHash() const {
+        uint64_t output = 14695981039346656037ull;
+        auto mix = [&output](const void* data, size_t size) {
+            auto bytes = static_cast<const unsigned char*>(data);
+            for (size_t k = 0; k < size; ++k) {
+                output = (output ^ bytes[k]) * 1099511628211ull;
+            }
+        };
+        for (const auto& path : material_libraries_) {
+            uint64_t size = std::filesystem::file_size(path);
+            int64_t time = std::filesystem::last_write_time(path).time_since_epoch().count();
+            mix(&size, sizeof(size));
+            mix(&time, sizeof(time));
+        }
+        const auto& materials = resident_.GetMaterials();
+        for (size_t id = 0; id < materials.Size(); ++id) {
+            const auto& name = materials.GetName(static_cast<int>(id));
+            mix(name.data(), name.size() + 1);
+        }
+        return output;
+    }
+
+    bool ReadTables(const std::string& path, const GeometryCacheHeader& expected) {
+        std::ifstream file{path, std::ios::binary};
+        GeometryCacheHeader header;
+        if (!file or !file.read(reinterpret_cast<char*>(&header), sizeof(header)) or
+            std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 or
+            header.source_size != expected.source_size or
+            header.source_time != expected.source_time or
+            header.materials_hash != expected.materials_hash or
+            header.cluster_size != expected.cluster_size) {
+            return false;
+        }
+        clusters_.resize(header.cluster_count);
+        nodes_.resize(header.node_count);
+        file.seekg(header.table_offset);
+        file.read(reinterpret_cast<char*>(clusters_.data()),
+                  clusters_.size() * sizeof(ClusterRecord));
+        file.read(reinterpret_cast<char*>(nodes_.data()), nodes_.size() * sizeof(ClusterNode));
+        if (!file) {
+            clusters_.clear();
+            nodes_.clear();
+            return false;
+        }
+        triangle_count_ = header.triangle_count;
+        return true;
+    }
+
+    static void RequireMaterial(int material_id, const std::string& filename) {
+        if (material_id < 0) {
+            throw std::runtime_error("Primitive without usemtl in " + filename);
+        }
+    }
+
+    // Same grammar as ReadScene. Faces are only collected when `faces` is set;
+    // otherwise only the resident part of the scene is read.
+    void ParseObj(const std::string& filename, std::vector<Face>* faces,
+                  std::vector<Vector>* vertexes = nullptr, std::vector<Vector>* normals = nullptr) {
+        std::ifstream file{filename};
+        if (!file) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        std::string buffer;
+        int cur_material_id = -1;
+        while (getline(file, buffer)) {
+            if (buffer.empty() or buffer[0] == '#') {
+                continue;
+            }
+            std::istringstream iss(buffer);
+            std::vector<std::string> splitted_line(std::istream_iterator<std::string>{iss},
+                                                   std::istream_iterator<std::string>());
+            if (splitted_line.empty()) {
+                continue;
+            }
+            const auto& keyword = splitted_line[0];
+            if (keyword == "mtllib") {
+                auto path = std::filesystem::path(filename).parent_path() /
+                            std::filesystem::path(splitted_line[1]);
+                resident_.SetMaterials(ReadMaterials(path.string()));
+                material_libraries_.push_back(path.string());
+            } else if (keyword == "usemtl") {
+                cur_material_id = resident_.GetMaterials().GetId(splitted_line[1]);
+            } else if (keyword == "S") {
+                RequireMaterial(cur_material_id, filename);
+                auto center = ParseVector(splitted_line);
+                auto r = std::stod(splitted_line[4]);
+                resident_.AddSphere(SphereObject(cur_material_id, center, r));
+            } else if (keyword == "P") {
+                auto position = ParseVector(splitted_line);
+                Vector intensity{std::stod(splitted_line[4]), std::stod(splitted_line[5]),
+                                 std::stod(splitted_line[6])};
+                resident_.AddLight(Light(position, intensity));
+            } else if (!faces) {
+                continue;
+            } else if (keyword == "v") {
+                vertexes->push_back(ParseVector(splitted_line));
+            } else if (keyword == "vn") {
+                normals->push_back(ParseVector(splitted_line));
+            } else if (keyword == "f") {
+                RequireMaterial(cur_material_id, filename);
+                auto indexes = ParseIndexes(splitted_line);
+                auto normal_index = [&](size_t k) {
+                    return indexes[k].second != 0
+                               ? static_cast<int>(GetIndex(indexes[k].second, *normals))
+                               : -1;
+                };
+                for (size_t i = 1; i + 1 < indexes.size(); ++i) {
+                    Face face;
+                    size_t corners[3] = {0, i, i + 1};
+                    for (int k = 0; k < 3; ++k) {
+                        face.vertices[k] =
+                            static_cast<int>(GetIndex(indexes[corners[k]].first, *vertexes));
+                        face.normals[k] = normal_index(corners[k]);
+                    }
+                    face.material_id = cur_material_id;
+                    faces->push_back(face);
+                }
+            }
+        }
+    }
+
+    // Splits the faces at the centroid median of the longest axis until each
+    // part fits into a cluster, writing the clusters to the cache file as the
+    // leaves are reached. The positions and compact face indices stay in
+    // memory during the build; Objects are never created for them.
+    void Build(const std::string& filename, const OutOfCoreOptions& options,
+               GeometryCacheHeader header) {
+        TIMELINE_SCOPE("OutOfCoreScene::Build", "build");
+        std::vector<Face> faces;
+        std::vector<Vector> vertexes, normals;
+        ParseObj(filename, &faces, &vertexes, &normals);
+        triangle_count_ = faces.size();
+
+        std::vector<Vector> centroids;
+        centroids.reserve(faces.size());
+        for (const auto& face : faces) {
+            centroids.push_back((vertexes[face.vertices[0]] + vertexes[face.vertices[1]] +
+                                 vertexes[face.vertices[2]]) *
+                                (1.0 / 3));
+        }
+        std::vector<int> order(faces.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = static_cast<int>(i);
+        }
+
+        auto temporary = options.cache_path + "." + std::to_string(getpid()) + ".tmp";
+        std::ofstream file{temporary, std::ios::binary | std::ios::trunc};
+        if (!file) {
+            throw std::runtime_error("Can't write geometry cache " + temporary);
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        auto make_node = [&](auto& self, size_t begin, size_t end) -> int {
+            ClusterNode node{};
+            for (int k = 0; k < 3; ++k) {
+                node.min[k] = std::numeric_limits<double>::max();
+                node.max[k] = std::numeric_limits<double>::lowest();
+            }
+            for (size_t i = begin; i < end; ++i) {
+                for (int v : faces[order[i]].vertices) {
+                    for (int k = 0; k < 3; ++k) {
+                        node.min[k] = std::min(node.min[k], vertexes[v][k]);
+                        node.max[k] = std::max(node.max[k], vertexes[v][k]);
+                    }
+                }
+            }
+            int index = static_cast<int>(nodes_.size());
+            nodes_.push_back(node);
+            if (end - begin <= static_cast<size_t>(options.cluster_size)) {
+                nodes_[index].left = nodes_[index].right = -1;
+                nodes_[index].cluster = static_cast<int>(clusters_.size());
+                clusters_.push_back(
+                    ClusterRecord{static_cast<uint64_t>(file.tellp()), end - begin});
+                for (size_t i = begin; i < end; ++i) {
+                    const auto& face = faces[order[i]];
+                    TriangleRecord record{};
+                    record.id = order[i];
+                    record.material_id = face.material_id;
+                    for (int k = 0; k < 3; ++k) {
+                        for (int c = 0; c < 3; ++c) {
+                            record.vertices[3 * k + c] = vertexes[face.vertices[k]][c];
+                        }
+                        if (face.normals[k] >= 0) {
+                            record.has_normal[k] = 1;
+                            for (int c = 0; c < 3; ++c) {
+                                record.normals[3 * k + c] = normals[face.normals[k]][c];
+                            }
+                        }
+                    }
+                    file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+                }
+                return index;
+            }
+            double lo[3], hi[3];
+            for (int k = 0; k < 3; ++k) {
+                lo[k] = std::numeric_limits<double>::max();
+                hi[k] = std::numeric_limits<double>::lowest();
+            }
+            for (size_t i = begin; i < end; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    lo[k] = std::min(lo[k], centroids[order[i]][k]);
+                    hi[k] = std::max(hi[k], centroids[order[i]][k]);
+                }
+            }
+            int axis = 0;
+            for (int k = 1; k < 3; ++k) {
+                if (hi[k] - lo[k] > hi[axis] - lo[axis]) {
+                    axis = k;
+                }
+            }
+            size_t middle = begin + (end - begin) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                             [&](int lhs, int rhs) {
+                                 return centroids[lhs][axis] < centroids[rhs][axis];
+                             });
+            int left = self(self, begin, middle);
+            int right = self(self, middle, end);
+            nodes_[index].left = left;
+            nodes_[index].right = right;
+            nodes_[index].cluster = -1;
+            return index;
+        };
+        if (!faces.empty()) {
+            make_node(make_node, 0, faces.size());
+        }
+
+        header.triangle_count = triangle_count_;
+        header.table_offset = file.tellp();
+        header.cluster_count = clusters_.size();
+        header.node_count = nodes_.size();
+        file.write(reinterpret_cast<const char*>(clusters_.data()),
+                   clusters_.size() * sizeof(ClusterRecord));
+        file.write(reinterpret_cast<const char*>(nodes_.data()),
+                   nodes_.size() * sizeof(ClusterNode));
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+        if (!file) {
+            throw std::runtime_error("Can't write geometry cache " + temporary);
+        }
+        std::filesystem::rename(temporary, options.cache_path);
+    }
+
+    Scene resident_;
+    // Paths of the mtllib files the OBJ names.
+    std::vector<std::string> material_libraries_;
+    size_t triangle_count_ = 0;
+    std::vector<ClusterRecord> clusters_;
+    std::vector<ClusterNode> nodes_;
+    std::unique_ptr<ClusterCache> cache_;
+    bool cache_reused_ = false;
+};
+
+inline std::optional<SurfaceHit> FindNearestHit(const Ray& ray, const OutOfCoreScene& scene) {
+    return scene.FindNearestHit(ray);
+}
+
+inline bool IsVisible(const Light& light, const Vector& position, const OutOfCoreScene& scene) {
+    auto dir = light.position - position;
+    auto length = Length(dir);
+    dir.Normalize();
+    return !scene.IsOccluded(Ray{position, dir}, length);
+}
+
+// RenderScene for a scene paged in from its geometry cache, anti-aliased and
+// denoised alike; rasterize_primary is ignored.
+inline Image RenderOutOfCore(const OutOfCoreScene& scene, const CameraOptions& camera_options,
+                             const RenderOptions& render_options,
+                             RenderStatistics* statistics = nullptr) {
+    const auto& cache = scene.GetCache();
+    auto page_ins = cache.PageIns(), lookups = cache.Lookups(), hits = cache.Hits();
+    Image output{camera_options.screen_width, camera_options.screen_height};
+    size_t samples = static_cast<size_t>(output.Width()) * output.Height();
+    if (render_options.anti_aliasing.max_samples > 1 and
+        render_options.mode != RenderMode::kDepth) {
+        std::vector<std::vector<Vector>> prepixels;
+        samples = AntiAliasPixels(scene, camera_options, render_options,
+                                  Tile{0, 0, output.Width(), output.Height()}, prepixels);
+        ResolveFrame(output, prepixels, scene, camera_options, render_options);
+    } else {
+        Camera camera{&camera_options};
+        auto& arena = ThreadArena();
+        ArenaScope frame{arena};
+        PixelBuffer prepixels{output.Width(), output.Height(), arena};
+        for (int i = 0; i < output.Width(); ++i) {
+            for (int j = 0; j < output.Height(); ++j) {
+                Ray ray{camera_options.look_from, camera.GetDirection(i, j)};
+                prepixels[i][j] =
+                    ShadeSceneHit(ray, FindNearestHit(ray, scene), scene, render_options);
+            }
+        }
+        ResolveFrame(output, prepixels, scene, camera_options, render_options);
+    }
+    if (statistics) {
+        statistics->samples_per_pixel =
+            static_cast<double>(samples) / (output.Width() * output.Height());
+        statistics->cluster_page_ins = cache.PageIns() - page_ins;
+        statistics->cluster_lookups = cache.Lookups() - lookups;
+        statistics->cluster_hit_rate =
+            statistics->cluster_lookups
+                ? static_cast<double>(cache.Hits() - hits) / statistics->cluster_lookups
+                : 1.0;
+    }
+    return output;
+}
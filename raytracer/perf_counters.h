@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum class RenderStage { kLoad, kBuild, kPrimaryTrace, kShading, kToneMapping, kEncode };
+
+const int kRenderStageCount = 6;
+
+inline const char* StageName(RenderStage stage) {
+    switch (stage) {
+        case RenderStage::kLoad:
+            return "load";
+        case RenderStage::kBuild:
+            return "build";
+        case RenderStage::kPrimaryTrace:
+            return "primary trace";
+        case RenderStage::kShading:
+            return "shading";
+        case RenderStage::kToneMapping:
+            return "tone mapping";
+        case RenderStage::kEncode:
+            return "encode";
+    }
+    return "";
+}
+
+struct StageCounters {
+    int64_t wall_ns = 0;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cache_misses = 0;
+    uint64_t branch_misses = 0;
+    // Times the stage was entered.
+    size_t entries = 0;
+
+    double InstructionsPerCycle() const {
+        return cycles == 0 ? 0.0 : static_cast<double>(instructions) / cycles;
+    }
+};
+
+struct HardwareCounterReport {
+    // False if the counters could not be opened, e.g. in a container without
+    // permission; `error` says why. Wall times are filled either way.
+    bool available = false;
+    std::string error;
+    std::array<StageCounters, kRenderStageCount> stages;
+
+    StageCounters& operator[](RenderStage stage) {
+        return stages[static_cast<int>(stage)];
+    }
+
+    const StageCounters& operator[](RenderStage stage) const {
+        return stages[static_cast<int>(stage)];
+    }
+
+    std::string ToString() const {
+        std::ostringstream output;
+        if (!available) {
+            output << "hardware counters unavailable: " << error << "\n";
+        }
+        for (int k = 0; k < kRenderStageCount; ++k) {
+            const auto& stage = stages[k];
+            if (stage.entries == 0) {
+                continue;
+            }
+            output << StageName(static_cast<RenderStage>(k)) << ": " << stage.wall_ns / 1e6
+                   << " ms";
+            if (available) {
+                output << ", " << stage.cycles << " cycles, " << stage.instructions
+                       << " instructions (IPC " << stage.InstructionsPerCycle() << "), "
+                       << stage.cache_misses << " cache misses, " << stage.branch_misses
+                       << " branch misses";
+            }
+            output << "\n";
+        }
+        return output.str();
+    }
+};
+
+// Cycles, instructions, cache misses and branch misses of the calling thread
+// in user space, as one perf_event_open group.
+class PerfCounters {
+public:
+    static constexpr int kCount = 4;
+
+    PerfCounters() {
+        const uint64_t configs[kCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                          PERF_COUNT_HW_CACHE_MISSES,
+                                          PERF_COUNT_HW_BRANCH_MISSES};
+        for (int k = 0; k < kCount; ++k) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[k];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[k] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                               k == 0 ? -1 : fds_[0], 0));
+            if (fds_[k] < 0) {
+                error_ = std::string{"perf_event_open: "} + std::strerror(errno);
+                Close();
+                return;
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+        Close();
+    }
+
+    bool Available() const {
+        return fds_[0] >= 0;
+    }
+
+    const std::string& Error() const {
+        return error_;
+    }
+
+    // Counts so far, scaled up if the group was multiplexed with other
+    // events; zeros if unavailable.
+    std::array<uint64_t, kCount> Read() const {
+        std::array<uint64_t, kCount> output{};
+        struct {
+            uint64_t count;
+            uint64_t time_enabled;
+            uint64_t time_running;
+            uint64_t values[kCount];
+        } data;
+        if (!Available() or read(fds_[0], &data, sizeof(data)) != sizeof(data) or
+            data.time_running == 0) {
+            return output;
+        }
+        double scale = static_cast<double>(data.time_enabled) / data.time_running;
+        for (int k = 0; k < kCount; ++k) {
+            output[k] = static_cast<uint64_t>(data.values[k] * scale);
+        }
+        return output;
+    }
+
+private:
+    void Close() {
+        for (auto& fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = -1;
+        }
+    }
+
+    int fds_[kCount] = {-1, -1, -1, -1};
+    std::string error_;
+};
+
+// Attributes the counters of the calling thread to the innermost StageScope
+// while it is alive; time outside any stage is not counted. Sessions add to
+// the report, so several of them (say, a render and the PNG encode after
+// it) can fill one. A null report makes the session inactive.
+//
+// perf_event groups count one thread, so pool threads join the session with
+// a worker session of their own (see CountOnWorker): its counts and stage
+// entries are added to the report when the session ends. Wall times are
+// those of the thread that opened the session.
+class CounterSession {
+public:
+    explicit CounterSession(HardwareCounterReport* report) : report_{report} {
+        if (!report_) {
+            return;
+        }
+        counters_ = std::make_unique<PerfCounters>();
+        report_->available = counters_->Available();
+        report_->error = counters_->Error();
+        previous_ = active_;
+        active_ = this;
+    }
+
+    // A worker session of `parent` on another thread, starting in `stage`,
+    // the stage the parent's thread was in when it started the worker. A
+    // null parent makes the session inactive.
+    CounterSession(CounterSession* parent, std::optional<RenderStage> stage)
+        : report_{parent ? &local_ : nullptr}, parent_{parent} {
+        if (!report_) {
+            return;
+        }
+        counters_ = std::make_unique<PerfCounters>();
+        previous_ = active_;
+        active_ = this;
+        Sample();
+        if (stage) {
+            stack_[0] = *stage;
+            depth_ = 1;
+        }
+    }
+
+    CounterSession(const CounterSession&) = delete;
+    CounterSession& operator=(const CounterSession&) = delete;
+
+    ~CounterSession() {
+        if (!report_) {
+            return;
+        }
+        active_ = previous_;
+        // Workers have all ended by now: the threads are joined.
+        for (const auto& worker : workers_) {
+            Merge(worker);
+        }
+        if (parent_) {
+            if (depth_ > 0) {
+                Sample();
+            }
+            std::lock_guard lock{parent_->workers_mutex_};
+            parent_->workers_.push_back(local_);
+        }
+    }
+
+    // The session of the calling thread, if any.
+    static CounterSession* Active() {
+        return active_;
+    }
+
+    // The innermost stage of the calling thread, if any; call it from the
+    // thread of the session.
+    std::optional<RenderStage> Stage() const {
+        if (depth_ == 0) {
+            return std::nullopt;
+        }
+        return stack_[std::min(depth_, kMaxDepth) - 1];
+    }
+
+    void Enter(RenderStage stage) {
+        Sample();
+        if (depth_ < kMaxDepth) {
+            stack_[depth_] = stage;
+        }
+        ++depth_;
+        ++(*report_)[stage].entries;
+    }
+
+    void Leave() {
+        Sample();
+        --depth_;
+    }
+
+private:
+    static constexpr int kMaxDepth = 16;
+    static inline thread_local CounterSession* active_ = nullptr;
+
+    // Adds what happened since the last sample to the current stage.
+    void Sample() {
+        auto now = std::chrono::steady_clock::now();
+        auto values = counters_->Read();
+        if (depth_ > 0) {
+            auto& stage = (*report_)[stack_[std::min(depth_, kMaxDepth) - 1]];
+            stage.wall_ns +=
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_time_).count();
+            // Scaled counts of a multiplexed group can step back a little.
+            auto delta = [&](int k) {
+                return values[k] > last_values_[k] ? values[k] - last_values_[k] : 0;
+            };
+            stage.cycles += delta(0);
+            stage.instructions += delta(1);
+            stage.cache_misses += delta(2);
+            stage.branch_misses += delta(3);
+        }
+        last_time_ = now;
+        last_values_ = values;
+    }
+
+    void Merge(const HardwareCounterReport& worker) {
+        for (int k = 0; k < kRenderStageCount; ++k) {
+            auto& stage = report_->stages[k];
+            stage.cycles += worker.stages[k].cycles;
+            stage.instructions += worker.stages[k].instructions;
+            stage.cache_misses += worker.stages[k].cache_misses;
+            stage.branch_misses += worker.stages[k].branch_misses;
+            stage.entries += worker.stages[k].entries;
+        }
+    }
+
+    HardwareCounterReport* report_;
+    std::unique_ptr<PerfCounters> counters_;
+    CounterSession* previous_ = nullptr;
+    std::array<RenderStage, kMaxDepth> stack_;
+    int depth_ = 0;
+    std::chrono::steady_clock::time_point last_time_;
+    std::array<uint64_t, PerfCounters::kCount> last_values_{};
+    // Worker sessions only: the counts of this thread, and whose they are.
+    HardwareCounterReport local_;
+    CounterSession* parent_ = nullptr;
+    // Reports of the worker sessions that have ended.
+    std::mutex workers_mutex_;
+    std::vector<HardwareCounterReport> workers_;
+};
+
+// Wraps body, to be run on a new thread, so that the thread counts into the
+// session of the calling thread, starting in its current stage.
+template <class Body>
+auto CountOnWorker(Body body) {
+    auto parent = CounterSession::Active();
+    auto stage = parent ? parent->Stage() : std::nullopt;
+    return [parent, stage, body](auto... args) mutable {
+        CounterSession session{parent, stage};
+        body(args...);
+    };
+}
+
+// Marks the rest of the block as one render stage for the active session of
+// the calling thread; without one it does nothing.
+class StageScope {
+public:
+    explicit StageScope(RenderStage stage) : session_{CounterSession::Active()} {
+        if (session_) {
+            session_->Enter(stage);
+        }
+    }
+
+    StageScope(const StageScope&) = delete;
+    StageScope& operator=(const StageScope&) = delete;
+
+    ~StageScope() {
+        if (session_) {
+            session_->Leave();
+        }
+    }
+
+private:
+    CounterSession* session_;
+};
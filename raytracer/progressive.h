@@ -0,0 +1,116 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <stop_token>
+
+struct ProgressiveOptions {
+    // Pixel stride of the first pass, rounded up to a power of two. Each next
+    // pass halves it until every pixel is traced.
+    int initial_step = 8;
+    std::chrono::milliseconds preview_interval{100};
+    std::function<void(const Image&)> on_preview;
+};
+
+inline int RoundUpToPowerOfTwo(int value) {
+    int output = 1;
+    while (output < value) {
+        output *= 2;
+    }
+    return output;
+}
+
+inline void EmitPreview(const std::vector<std::vector<Vector>>& prepixels,
+                        const CameraOptions& camera_options, const RenderOptions& render_options,
+                        const ProgressiveOptions& progressive_options) {
+    if (!progressive_options.on_preview) {
+        return;
+    }
+    // Not denoised: the guides would take a full-resolution primary pass.
+    Image preview{camera_options.screen_width, camera_options.screen_height};
+    ResolvePixels(preview, prepixels, render_options.mode, render_options.tone_mapping, {},
+                  RequestedThreads(render_options));
+    progressive_options.on_preview(preview);
+}
+
+// Renders the frame in passes of decreasing stride. A pixel traced with stride
+// s is copied over its s x s block, so the buffer always holds a complete
+// low-resolution image; pixels traced in earlier passes are never traced
+// again and the last pass leaves exactly the values of RenderScene. With
+// anti-aliasing a final pass refines the frame through AntiAliasPixels, as
+// RenderScene does. With render_options.denoise the frame is denoised as
+// well, the previews not.
+// Returns nullopt if a stop was requested before the frame was finished.
+inline std::optional<Image> RenderProgressive(const Scene& scene,
+                                              const CameraOptions& camera_options,
+                                              const RenderOptions& render_options,
+                                              const ProgressiveOptions& progressive_options,
+                                              std::stop_token stop = {}) {
+    using Clock = std::chrono::steady_clock;
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    Camera camera{&camera_options};
+    std::vector<std::vector<Vector>> prepixels(width, std::vector<Vector>(height));
+    auto last_preview = Clock::now();
+
+    int previous_step = 0;
+    for (int step = RoundUpToPowerOfTwo(progressive_options.initial_step); step >= 1;
+         step /= 2) {
+        for (int i = 0; i < width; i += step) {
+            if (stop.stop_requested()) {
+                return {};
+            }
+            for (int j = 0; j < height; j += step) {
+                if (previous_step and i % previous_step == 0 and j % previous_step == 0) {
+                    continue;
+                }
+                Ray ray{camera_options.look_from, camera.GetDirection(i, j)};
+                auto value = TracePixel(ray, scene, render_options);
+                for (int x = i; x < std::min(i + step, width); ++x) {
+                    for (int y = j; y < std::min(j + step, height); ++y) {
+                        prepixels[x][y] = value;
+                    }
+                }
+            }
+            if (step > 1 and Clock::now() - last_preview >= progressive_options.preview_interval) {
+                EmitPreview(prepixels, camera_options, render_options, progressive_options);
+                last_preview = Clock::now();
+            }
+        }
+        if (!previous_step and step > 1) {
+            // The first coarse pass is always shown, whatever the interval.
+            EmitPreview(prepixels, camera_options, render_options, progressive_options);
+            last_preview = Clock::now();
+        }
+        previous_step = step;
+    }
+
+    if (render_options.anti_aliasing.max_samples > 1 and
+        render_options.mode != RenderMode::kDepth) {
+        if (stop.stop_requested()) {
+            return {};
+        }
+        // Refines the edges as RenderScene does; the centers are traced again
+        // for the sample distances and object IDs the refinement compares.
+        AntiAliasPixels(scene, camera_options, render_options, Tile{0, 0, width, height},
+                        prepixels);
+    }
+    if (stop.stop_requested()) {
+        return {};
+    }
+    Image output{width, height};
+    ResolveFrame(output, prepixels, scene, camera_options, render_options);
+    return output;
+}
+
+inline std::optional<Image> RenderProgressive(const std::string& filename,
+                                              const CameraOptions& camera_options,
+                                              const RenderOptions& render_options,
+                                              const ProgressiveOptions& progressive_options,
+                                              std::stop_token stop = {}) {
+    return RenderProgressive(ReadScene(filename), camera_options, render_options,
+                             progressive_options, std::move(stop));
+}
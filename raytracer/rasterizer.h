@@ -0,0 +1,310 @@
+#pragma once
+
+#include <trace.h>
+#include <denoise.h>
+#include <render_kernels.h>
+#include <camera.h>
+#include <camera_options.h>
+#include <tile.h>
+#include <arena.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// Screen-space triangle: raster positions and reciprocal view depths of the
+// vertices, after clipping against the near plane.
+struct RasterTriangle {
+    int object_id;
+    double x[3];
+    double y[3];
+    double inv_depth[3];
+};
+
+struct RasterBounds {
+    int min_x, min_y, max_x, max_y;
+};
+
+const double kNearPlane = 1e-6;
+
+// Sutherland-Hodgman against the plane z = -kNearPlane.
+inline std::vector<Vector> ClipToNearPlane(const std::vector<Vector>& polygon) {
+    std::vector<Vector> output;
+    for (size_t k = 0; k < polygon.size(); ++k) {
+        const auto& a = polygon[k];
+        const auto& b = polygon[(k + 1) % polygon.size()];
+        bool a_inside = a[2] <= -kNearPlane;
+        bool b_inside = b[2] <= -kNearPlane;
+        if (a_inside) {
+            output.push_back(a);
+        }
+        if (a_inside != b_inside) {
+            double t = (-kNearPlane - a[2]) / (b[2] - a[2]);
+            output.push_back(a + (b - a) * t);
+        }
+    }
+    return output;
+}
+
+inline RasterBounds PixelBounds(double min_x, double min_y, double max_x, double max_y,
+                                int width, int height) {
+    // Pixel i is sampled at i + 0.5.
+    return RasterBounds{std::max(0, static_cast<int>(std::ceil(min_x - 0.5))),
+                        std::max(0, static_cast<int>(std::ceil(min_y - 0.5))),
+                        std::min(width - 1, static_cast<int>(std::floor(max_x - 0.5))),
+                        std::min(height - 1, static_cast<int>(std::floor(max_y - 0.5)))};
+}
+
+// Raster bounds of a sphere, or the whole screen when it reaches behind the
+// near plane and cannot be bounded by projection.
+inline RasterBounds SphereBounds(const Camera& camera, const Vector& center, double radius,
+                                 int width, int height) {
+    double min_x = std::numeric_limits<double>::max(), min_y = min_x;
+    double max_x = std::numeric_limits<double>::lowest(), max_y = max_x;
+    for (int corner = 0; corner < 8; ++corner) {
+        Vector offset{corner & 1 ? radius : -radius, corner & 2 ? radius : -radius,
+                      corner & 4 ? radius : -radius};
+        auto point = camera.ToCameraSpace(center + offset);
+        if (point[2] > -kNearPlane) {
+            return RasterBounds{0, 0, width - 1, height - 1};
+        }
+        auto [x, y] = camera.ToRaster(point);
+        min_x = std::min(min_x, x);
+        min_y = std::min(min_y, y);
+        max_x = std::max(max_x, x);
+        max_y = std::max(max_y, y);
+    }
+    return PixelBounds(min_x, min_y, max_x, max_y, width, height);
+}
+
+class PrimaryRasterizer {
+public:
+    PrimaryRasterizer(const Scene& scene, const CameraOptions& camera_options,
+                      int tile_size = kRasterTileSize)
+        : scene_{scene},
+          camera_options_{camera_options},
+          camera_{&camera_options_},
+          width_{camera_options.screen_width},
+          height_{camera_options.screen_height},
+          tile_size_{tile_size},
+          tiles_{SplitIntoTiles(width_, height_, tile_size)},
+          tiles_x_{(width_ + tile_size - 1) / tile_size},
+          triangle_bins_(tiles_.size()),
+          sphere_bins_(tiles_.size()) {
+        TIMELINE_SCOPE("RasterSetup", "build");
+        StageScope stage{RenderStage::kBuild};
+        SetupTriangles();
+        SetupSpheres();
+    }
+
+    // Fills prepixels with ShadeHit of every primary hit; threads as in
+    // TuningParameters.
+    void Render(const RenderOptions& render_options, PixelBuffer& prepixels,
+                int threads = 0) const {
+        std::atomic<size_t> next_tile = 0;
+        auto shade = SelectKernel(scene_, render_options);
+        RunOnThreads(std::min(ThreadCount(threads), tiles_.size()), [&] {
+            for (size_t k = next_tile++; k < tiles_.size(); k = next_tile++) {
+                RenderTile(k, render_options, shade, prepixels);
+            }
+        });
+    }
+
+private:
+    void Bin(std::vector<std::vector<int>>& bins, int item, const RasterBounds& bounds) {
+        if (bounds.min_x > bounds.max_x or bounds.min_y > bounds.max_y) {
+            return;
+        }
+        for (int ty = bounds.min_y / tile_size_; ty <= bounds.max_y / tile_size_; ++ty) {
+            for (int tx = bounds.min_x / tile_size_; tx <= bounds.max_x / tile_size_; ++tx) {
+                bins[ty * tiles_x_ + tx].push_back(item);
+            }
+        }
+    }
+
+    void SetupTriangles() {
+        const auto& objects = scene_.GetObjects();
+        for (size_t id = 0; id < objects.size(); ++id) {
+            std::vector<Vector> polygon;
+            for (int k = 0; k < 3; ++k) {
+                polygon.push_back(camera_.ToCameraSpace(objects[id].polygon.GetVertex(k)));
+            }
+            polygon = ClipToNearPlane(polygon);
+            for (size_t k = 1; k + 1 < polygon.size(); ++k) {
+                RasterTriangle triangle{static_cast<int>(id), {}, {}, {}};
+                const Vector* vertices[3] = {&polygon[0], &polygon[k], &polygon[k + 1]};
+                double min_x = std::numeric_limits<double>::max(), min_y = min_x;
+                double max_x = std::numeric_limits<double>::lowest(), max_y = max_x;
+                for (int v = 0; v < 3; ++v) {
+                    auto [x, y] = camera_.ToRaster(*vertices[v]);
+                    triangle.x[v] = x;
+                    triangle.y[v] = y;
+                    triangle.inv_depth[v] = 1 / -(*vertices[v])[2];
+                    min_x = std::min(min_x, x);
+                    min_y = std::min(min_y, y);
+                    max_x = std::max(max_x, x);
+                    max_y = std::max(max_y, y);
+                }
+                Bin(triangle_bins_, static_cast<int>(triangles_.size()),
+                    PixelBounds(min_x, min_y, max_x, max_y, width_, height_));
+                triangles_.push_back(triangle);
+            }
+        }
+    }
+
+    void SetupSpheres() {
+        const auto& spheres = scene_.GetSphereObjects();
+        for (size_t index = 0; index < spheres.size(); ++index) {
+            const auto& sphere = spheres[index].sphere;
+            Bin(sphere_bins_, static_cast<int>(index),
+                SphereBounds(camera_, sphere.GetCenter(), sphere.GetRadius(), width_, height_));
+        }
+    }
+
+    void RenderTile(size_t tile_index, const RenderOptions& render_options, PixelKernel shade,
+                    PixelBuffer& prepixels) const {
+        TIMELINE_SCOPE("RasterTile", "trace", tile_index);
+        const auto& tile = tiles_[tile_index];
+        auto at = [&tile](int i, int j) {
+            return static_cast<size_t>(j - tile.y) * tile.width + (i - tile.x);
+        };
+        // The tile buffers are scratch in the worker's arena.
+        auto& arena = ThreadArena();
+        ArenaScope scope{arena};
+        size_t size = static_cast<size_t>(tile.width) * tile.height;
+        auto depth = arena.AllocateArray<double>(size);
+        std::fill_n(depth, size, std::numeric_limits<double>::infinity());
+        // Object IDs as in SurfaceHit; for spheres the distance is kept too.
+        auto ids = arena.AllocateArray<int>(size);
+        std::fill_n(ids, size, -1);
+        auto sphere_distance = arena.AllocateArray<double>(size);
+        const auto& batch = scene_.GetSphereBatch();
+        int sphere_base = static_cast<int>(scene_.GetObjects().size());
+
+        {
+            StageScope stage{RenderStage::kPrimaryTrace};
+            for (int index : triangle_bins_[tile_index]) {
+                const auto& triangle = triangles_[index];
+                double area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0]) -
+                              (triangle.x[2] - triangle.x[0]) * (triangle.y[1] - triangle.y[0]);
+                if (std::fabs(area) < 1e-12) {
+                    continue;
+                }
+                auto bounds = PixelBounds(*std::min_element(triangle.x, triangle.x + 3),
+                                          *std::min_element(triangle.y, triangle.y + 3),
+                                          *std::max_element(triangle.x, triangle.x + 3),
+                                          *std::max_element(triangle.y, triangle.y + 3), width_,
+                                          height_);
+                for (int j = std::max(bounds.min_y, tile.y);
+                     j <= std::min(bounds.max_y, tile.y + tile.height - 1); ++j) {
+                    for (int i = std::max(bounds.min_x, tile.x);
+                         i <= std::min(bounds.max_x, tile.x + tile.width - 1); ++i) {
+                        double px = i + 0.5, py = j + 0.5;
+                        double weights[3];
+                        bool inside = true;
+                        for (int v = 0; v < 3; ++v) {
+                            int a = (v + 1) % 3, b = (v + 2) % 3;
+                            weights[v] = ((triangle.x[b] - triangle.x[a]) * (py - triangle.y[a]) -
+                                          (px - triangle.x[a]) * (triangle.y[b] - triangle.y[a])) /
+                                         area;
+                            inside = inside and weights[v] >= 0;
+                        }
+                        if (!inside) {
+                            continue;
+                        }
+                        double inv_depth = weights[0] * triangle.inv_depth[0] +
+                                           weights[1] * triangle.inv_depth[1] +
+                                           weights[2] * triangle.inv_depth[2];
+                        double view_depth = 1 / inv_depth;
+                        if (view_depth < depth[at(i, j)]) {
+                            depth[at(i, j)] = view_depth;
+                            ids[at(i, j)] = triangle.object_id;
+                        }
+                    }
+                }
+            }
+
+            for (int index : sphere_bins_[tile_index]) {
+                const auto& sphere = scene_.GetSphereObjects()[index].sphere;
+                auto bounds =
+                    SphereBounds(camera_, sphere.GetCenter(), sphere.GetRadius(), width_, height_);
+                for (int j = std::max(bounds.min_y, tile.y);
+                     j <= std::min(bounds.max_y, tile.y + tile.height - 1); ++j) {
+                    for (int i = std::max(bounds.min_x, tile.x);
+                         i <= std::min(bounds.max_x, tile.x + tile.width - 1); ++i) {
+                        auto direction = camera_.GetDirection(i, j);
+                        Ray ray{camera_options_.look_from, direction};
+                        auto t = IntersectSphere(ray, batch, index);
+                        if (!t) {
+                            continue;
+                        }
+                        double view_depth = t.value() * -camera_.ToCameraDirection(direction)[2];
+                        if (view_depth < depth[at(i, j)]) {
+                            depth[at(i, j)] = view_depth;
+                            ids[at(i, j)] = sphere_base + index;
+                            sphere_distance[at(i, j)] = t.value();
+                        }
+                    }
+                }
+            }
+        }
+
+        StageScope stage{RenderStage::kShading};
+        const auto& objects = scene_.GetObjects();
+        for (int i = tile.x; i < tile.x + tile.width; ++i) {
+            for (int j = tile.y; j < tile.y + tile.height; ++j) {
+                Ray ray{camera_options_.look_from, camera_.GetDirection(i, j)};
+                int id = ids[at(i, j)];
+                std::optional<SurfaceHit> hit;
+                if (id >= sphere_base) {
+                    SphereHit sphere_hit{sphere_distance[at(i, j)],
+                                         static_cast<size_t>(id - sphere_base)};
+                    hit = SurfaceHit{MakeSphereIntersection(ray, batch, sphere_hit),
+                                     scene_.GetSphereObjects()[id - sphere_base].material_id, id};
+                } else if (id >= 0) {
+                    // The exact hit comes from the one visible triangle; pixels
+                    // on its very edge that miss it fall back to a full cast.
+                    auto inter = GetIntersection(ray, objects[id].polygon);
+                    if (inter) {
+                        Intersection exact{inter.value().GetPosition(),
+                                           ComputeNormal(objects[id], inter.value().GetPosition(),
+                                                         inter.value().GetNormal()),
+                                           inter.value().GetDistance()};
+                        hit = SurfaceHit{exact, objects[id].material_id, id};
+                    } else {
+                        hit = FindNearestHit(ray, scene_);
+                    }
+                }
+                prepixels[i][j] = shade(ray, hit, scene_, render_options);
+            }
+        }
+    }
+
+    const Scene& scene_;
+    CameraOptions camera_options_;
+    Camera camera_;
+    int width_;
+    int height_;
+    int tile_size_;
+    std::vector<Tile> tiles_;
+    int tiles_x_;
+    std::vector<RasterTriangle> triangles_;
+    std::vector<std::vector<int>> triangle_bins_;
+    std::vector<std::vector<int>> sphere_bins_;
+};
+
+inline Image RenderRasterized(const Scene& scene, const CameraOptions& camera_options,
+                              const RenderOptions& render_options) {
+    auto& arena = ThreadArena();
+    ArenaScope frame{arena};
+    PixelBuffer prepixels{camera_options.screen_width, camera_options.screen_height, arena};
+    auto tuning = render_options.tuning.value_or(TuningParameters{});
+    PrimaryRasterizer rasterizer{scene, camera_options, tuning.raster_tile_size};
+    rasterizer.Render(render_options, prepixels, tuning.threads);
+    Image output{camera_options.screen_width, camera_options.screen_height};
+    ResolveFrame(output, prepixels, scene, camera_options, render_options);
+    return output;
+}
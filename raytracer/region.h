@@ -0,0 +1,236 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// What kDepth and kReinhardExtended normalize a frame by: its largest
+// distance or color channel.
+template <class Buffer>
+double FrameMaxValue(const Buffer& prepixels, int width, int height, RenderMode mode) {
+    double output = mode == RenderMode::kDepth ? -1.0 : 0.0;
+    int channels = mode == RenderMode::kDepth ? 1 : 3;
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            for (int c = 0; c < channels; ++c) {
+                output = std::max(output, prepixels[i][j][c]);
+            }
+        }
+    }
+    return output;
+}
+
+// Renders the pixels of `window`, a rectangle of the frame camera_options
+// describes, into an image of the window's size; nothing outside it is
+// traced. Each pixel sees through the full-frame camera, so for kNormal and
+// for kFull with an operator without image statistics the window equals the
+// same rectangle of RenderScene. kDepth and kReinhardExtended normalize by
+// `frame_max_value`, the frame's FrameMaxValue, so that the window can be
+// pasted into the frame; without it, by the maximum over the window. The
+// denoiser stops at the window's edges. rasterize_primary is ignored: the
+// window is traced.
+inline Image RenderRegion(const Scene& scene, const CameraOptions& camera_options,
+                          const RenderOptions& render_options, const Tile& window,
+                          std::optional<double> frame_max_value = {},
+                          RenderStatistics* statistics = nullptr) {
+    if (window.width <= 0 or window.height <= 0 or window.x < 0 or window.y < 0 or
+        window.x + window.width > camera_options.screen_width or
+        window.y + window.height > camera_options.screen_height) {
+        throw std::runtime_error("Render window must be a non-empty part of the frame");
+    }
+    CounterSession session{CountersFor(render_options, statistics)};
+    Image output{window.width, window.height};
+    if (render_options.anti_aliasing.max_samples > 1 and
+        render_options.mode != RenderMode::kDepth) {
+        std::vector<std::vector<Vector>> prepixels;
+        auto samples = AntiAliasPixels(scene, camera_options, render_options, window, prepixels);
+        ResolveFrame(output, prepixels, scene, camera_options, render_options, window.x,
+                     window.y, frame_max_value);
+        if (statistics) {
+            statistics->samples_per_pixel =
+                static_cast<double>(samples) / (window.width * window.height);
+        }
+        return output;
+    }
+    auto& arena = ThreadArena();
+    ArenaScope frame{arena};
+    PixelBuffer prepixels{window.width, window.height, arena};
+    TraceFrame(scene, PrepareTrace(scene, render_options),
+               Camera{&camera_options, window.x, window.y}, camera_options, render_options,
+               prepixels);
+    ResolveFrame(output, prepixels, scene, camera_options, render_options, window.x, window.y,
+                 frame_max_value);
+    if (statistics) {
+        statistics->samples_per_pixel = 1.0;
+    }
+    return output;
+}
+
+struct DynamicResolutionOptions {
+    // Wall time a frame should take, upsampling and tone mapping included.
+    double budget_seconds = 1.0 / 30;
+    // Bounds of the scale of each side of the traced image.
+    double min_scale = 0.25;
+    double max_scale = 1.0;
+};
+
+// The largest scale of each side of a width x height frame whose trace, at
+// `seconds_per_pixel`, fits what is left of the budget after `spent` seconds
+// and a resolve of `resolve_seconds`, within the bounds of options.
+inline double ChooseResolutionScale(const DynamicResolutionOptions& options, int width,
+                                    int height, double spent, double seconds_per_pixel,
+                                    double resolve_seconds) {
+    double left = options.budget_seconds - spent - resolve_seconds;
+    double pixels = left / seconds_per_pixel;
+    double scale = std::sqrt(std::max(pixels, 0.0) / (static_cast<double>(width) * height));
+    return std::clamp(scale, options.min_scale, options.max_scale);
+}
+
+// Upsamples the prepixels of a smaller image of the same view to the size of
+// output: bilinear for kNormal and kFull, nearest for kDepth, whose misses
+// must not blend with the distances around them.
+inline void UpsamplePixels(const PixelBuffer& input, PixelBuffer& output, RenderMode mode,
+                           int threads = 0) {
+    int width = input.Width(), height = input.Height();
+    double scale_x = static_cast<double>(width) / output.Width();
+    double scale_y = static_cast<double>(height) / output.Height();
+    ParallelRows(output.Height(), threads, [&](int begin, int end) {
+        for (int j = begin; j < end; ++j) {
+            // Pixel centers in input coordinates.
+            double y = std::clamp((j + 0.5) * scale_y - 0.5, 0.0, height - 1.0);
+            for (int i = 0; i < output.Width(); ++i) {
+                double x = std::clamp((i + 0.5) * scale_x - 0.5, 0.0, width - 1.0);
+                if (mode == RenderMode::kDepth) {
+                    output[i][j] = input[static_cast<int>(std::lround(x))]
+                                        [static_cast<int>(std::lround(y))];
+                    continue;
+                }
+                int x1 = static_cast<int>(x), y1 = static_cast<int>(y);
+                int x2 = std::min(x1 + 1, width - 1), y2 = std::min(y1 + 1, height - 1);
+                double u = x - x1, v = y - y1;
+                output[i][j] = (input[x1][y1] * (1 - u) + input[x2][y1] * u) * (1 - v) +
+                               (input[x1][y2] * (1 - u) + input[x2][y2] * u) * v;
+            }
+        }
+    });
+}
+
+// Renders frames at the resolution that fits a time budget and upsamples
+// them to the requested size. The scale of each frame comes from the trace
+// time per pixel and the resolve time of the frames before it; the first
+// frame is probed at min_scale and traced again larger if the budget allows.
+// Takes one sample per traced pixel: anti_aliasing and rasterize_primary are
+// ignored. At a scale of 1 the image equals RenderScene's.
+class DynamicResolutionRenderer {
+public:
+    explicit DynamicResolutionRenderer(DynamicResolutionOptions options = {})
+        : options_{options} {
+        if (!(options.min_scale > 0 and options.min_scale <= options.max_scale and
+              options.max_scale <= 1)) {
+            throw std::runtime_error("Dynamic resolution scales must satisfy 0 < min <= max <= 1");
+        }
+    }
+
+    // Forgets the measured costs, e.g. for another scene.
+    void Reset() {
+        seconds_per_pixel_ = 0.0;
+        resolve_seconds_ = 0.0;
+    }
+
+    Image Render(const Scene& scene, const CameraOptions& camera_options,
+                 const RenderOptions& render_options) {
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        int width = camera_options.screen_width;
+        int height = camera_options.screen_height;
+        auto setup = PrepareTrace(scene, render_options);
+        auto& arena = ThreadArena();
+        ArenaScope frame{arena};
+
+        double spent = 0.0;
+        if (seconds_per_pixel_ == 0.0) {
+            scale_ = options_.min_scale;
+            auto probe = Trace(scene, setup, camera_options, render_options, arena);
+            spent = std::chrono::duration<double>(Clock::now() - start).count();
+            // Keep the probe unless a larger image still fits.
+            if (ChooseScale(width, height, spent) <= scale_) {
+                return Resolve(scene, camera_options, render_options, probe, start);
+            }
+        }
+        scale_ = ChooseScale(width, height, spent);
+        auto traced = Trace(scene, setup, camera_options, render_options, arena);
+        return Resolve(scene, camera_options, render_options, traced, start);
+    }
+
+    // The scale of each side of the last frame's traced image.
+    double Scale() const {
+        return scale_;
+    }
+
+    // Wall time of the last frame.
+    double LastSeconds() const {
+        return last_seconds_;
+    }
+
+private:
+    // The scale that fits the rest of the budget at the measured costs.
+    double ChooseScale(int width, int height, double spent) const {
+        return ChooseResolutionScale(options_, width, height, spent, seconds_per_pixel_,
+                                     resolve_seconds_);
+    }
+
+    PixelBuffer Trace(const Scene& scene, const TraceSetup& setup,
+                      const CameraOptions& camera_options, const RenderOptions& render_options,
+                      Arena& arena) {
+        auto start = std::chrono::steady_clock::now();
+        auto scaled = camera_options;
+        scaled.screen_width = std::max(1, static_cast<int>(std::lround(
+                                              camera_options.screen_width * scale_)));
+        scaled.screen_height = std::max(1, static_cast<int>(std::lround(
+                                               camera_options.screen_height * scale_)));
+        PixelBuffer prepixels{scaled.screen_width, scaled.screen_height, arena};
+        TraceFrame(scene, setup, scaled, render_options, prepixels);
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double measured = seconds / (static_cast<double>(scaled.screen_width) *
+                                     scaled.screen_height);
+        seconds_per_pixel_ =
+            seconds_per_pixel_ == 0.0 ? measured : (seconds_per_pixel_ + measured) / 2;
+        return prepixels;
+    }
+
+    Image Resolve(const Scene& scene, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, const PixelBuffer& traced,
+                  std::chrono::steady_clock::time_point frame_start) {
+        auto start = std::chrono::steady_clock::now();
+        int width = camera_options.screen_width;
+        int height = camera_options.screen_height;
+        Image output{width, height};
+        if (traced.Width() == width and traced.Height() == height) {
+            ResolveFrame(output, traced, scene, camera_options, render_options);
+        } else {
+            auto& arena = ThreadArena();
+            ArenaScope scope{arena};
+            PixelBuffer prepixels{width, height, arena};
+            UpsamplePixels(traced, prepixels, render_options.mode,
+                           RequestedThreads(render_options));
+            ResolveFrame(output, prepixels, scene, camera_options, render_options);
+        }
+        auto end = std::chrono::steady_clock::now();
+        resolve_seconds_ = std::chrono::duration<double>(end - start).count();
+        last_seconds_ = std::chrono::duration<double>(end - frame_start).count();
+        return output;
+    }
+
+    DynamicResolutionOptions options_;
+    double scale_ = 1.0;
+    // Zero until the first frame measures it.
+    double seconds_per_pixel_ = 0.0;
+    double resolve_seconds_ = 0.0;
+    double last_seconds_ = 0.0;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <trace.h>
+
+#include <algorithm>
+
+// Which parts of ComputeColor a scene can reach, from a scan of its materials.
+struct ShadingFeatures {
+    // Some material has al[1] > 0.
+    bool reflection = false;
+    // Some material has al[2] > 0.
+    bool refraction = false;
+    // The direct light term (and its shadow rays) can be non-zero: there are
+    // lights and some material has al[0] and a diffuse or specular color.
+    bool shadows = false;
+};
+
+inline ShadingFeatures ScanShadingFeatures(const Scene& scene) {
+    ShadingFeatures output;
+    bool lit = false;
+    const auto& materials = scene.GetMaterials();
+    for (size_t id = 0; id < materials.Size(); ++id) {
+        const auto& constants = materials.GetConstants(id);
+        output.reflection = output.reflection or constants.reflects;
+        output.refraction = output.refraction or constants.refracts;
+        lit = lit or constants.lit;
+    }
+    output.shadows = lit and !scene.GetLights().empty();
+    return output;
+}
+
+// ComputeColor with the depth, the inside flag and the scene features fixed
+// at compile time. Branches that a feature turns off are compiled out; the
+// remaining arithmetic is the same, so the results are identical.
+template <int Depth, bool Reflection, bool Refraction, bool Shadows, bool Inside>
+Vector ComputeColorKernel(int material_id, const Ray& ray, const Intersection& inter,
+                          const Scene& scene) {
+    if constexpr (Depth < 1) {
+        return Vector();
+    } else {
+        double eps = 10e-5;
+        const auto* material = &scene.GetMaterials().Get(material_id);
+        const auto& constants = scene.GetMaterials().GetConstants(material_id);
+        Vector output = constants.emission;
+        if constexpr (Shadows) {
+            output =
+                output + material->albedo[0] * ComputeLightedColor(material, inter, ray, scene);
+        }
+        if constexpr (Reflection and Depth > 1 and !Inside) {
+            if (constants.reflects) {
+                auto reflect = Reflect(ray.GetDirection(), inter.GetNormal());
+                Ray reflect_ray{inter.GetPosition(), reflect};
+                auto reflect_hit = FindNearestHit(reflect_ray, scene);
+                if (reflect_hit) {
+                    output = output + material->albedo[1] *
+                                          ComputeColorKernel<Depth - 1, Reflection, Refraction,
+                                                             Shadows, Inside>(
+                                              reflect_hit->material_id, reflect_ray,
+                                              reflect_hit->intersection, scene);
+                }
+            }
+        }
+        if constexpr (Refraction and Depth > 1) {
+            if (constants.refracts) {
+                auto eta = Inside ? material->refraction_index : 1 / material->refraction_index;
+                auto refract = Refract(ray.GetDirection(), inter.GetNormal(), eta);
+                if (refract) {
+                    double a = Inside ? 1.0 : -1.0;
+                    Ray refract_ray{inter.GetPosition() + a * eps * inter.GetNormal(),
+                                    refract.value()};
+                    auto refract_hit = FindNearestHit(refract_ray, scene);
+                    if (refract_hit) {
+                        auto alb = Inside ? 1 : material->albedo[2];
+                        output = output + alb * ComputeColorKernel<Depth - 1, Reflection,
+                                                                   Refraction, Shadows, !Inside>(
+                                                    refract_hit->material_id, refract_ray,
+                                                    refract_hit->intersection, scene);
+                    }
+                }
+            }
+        }
+        return output;
+    }
+}
+
+// Same contract as ShadeHit; the specialized kernels ignore render_options.
+using PixelKernel = Vector (*)(const Ray&, const std::optional<SurfaceHit>&, const Scene&,
+                               const RenderOptions&);
+
+template <RenderMode Mode, int Depth, bool Reflection, bool Refraction, bool Shadows>
+Vector ShadeHitKernel(const Ray& ray, const std::optional<SurfaceHit>& hit, const Scene& scene,
+                      const RenderOptions&) {
+    if (!hit) {
+        return Vector();
+    }
+    const auto& inter = hit.value().intersection;
+    if constexpr (Mode == RenderMode::kDepth) {
+        auto value = inter.GetDistance();
+        return Vector{value, value, value};
+    } else if constexpr (Mode == RenderMode::kNormal) {
+        return inter.GetNormal() * 0.5 + 0.5;
+    } else {
+        return ComputeColorKernel<Depth, Reflection, Refraction, Shadows, false>(
+            hit.value().material_id, ray, inter, scene);
+    }
+}
+
+// Deeper renders fall back to the generic ShadeHit.
+const int kMaxKernelDepth = 10;
+
+template <int Depth, bool Reflection, bool Refraction, bool Shadows>
+PixelKernel SelectFullKernel(int depth) {
+    if constexpr (Depth > kMaxKernelDepth) {
+        return &ShadeHit;
+    } else {
+        if (depth == Depth) {
+            return &ShadeHitKernel<RenderMode::kFull, Depth, Reflection, Refraction, Shadows>;
+        }
+        return SelectFullKernel<Depth + 1, Reflection, Refraction, Shadows>(depth);
+    }
+}
+
+template <bool Reflection, bool Refraction, bool Shadows>
+PixelKernel SelectFullKernel(int depth) {
+    depth = std::max(depth, 0);
+    if constexpr (!Reflection and !Refraction) {
+        // Without secondary rays every depth from 1 up shades the same.
+        return depth == 0 ? &ShadeHitKernel<RenderMode::kFull, 0, false, false, Shadows>
+                          : &ShadeHitKernel<RenderMode::kFull, 1, false, false, Shadows>;
+    } else {
+        return SelectFullKernel<0, Reflection, Refraction, Shadows>(depth);
+    }
+}
+
+template <bool Reflection, bool Refraction>
+PixelKernel SelectFullKernel(int depth, bool shadows) {
+    return shadows ? SelectFullKernel<Reflection, Refraction, true>(depth)
+                   : SelectFullKernel<Reflection, Refraction, false>(depth);
+}
+
+inline PixelKernel SelectKernel(const ShadingFeatures& features,
+                                const RenderOptions& render_options) {
+    switch (render_options.mode) {
+        case RenderMode::kDepth:
+            return &ShadeHitKernel<RenderMode::kDepth, 0, false, false, false>;
+        case RenderMode::kNormal:
+            return &ShadeHitKernel<RenderMode::kNormal, 0, false, false, false>;
+        case RenderMode::kFull:
+            break;
+    }
+    int depth = render_options.depth;
+    if (features.reflection and features.refraction) {
+        return SelectFullKernel<true, true>(depth, features.shadows);
+    } else if (features.reflection) {
+        return SelectFullKernel<true, false>(depth, features.shadows);
+    } else if (features.refraction) {
+        return SelectFullKernel<false, true>(depth, features.shadows);
+    }
+    return SelectFullKernel<false, false>(depth, features.shadows);
+}
+
+inline PixelKernel SelectKernel(const Scene& scene, const RenderOptions& render_options) {
+    return SelectKernel(ScanShadingFeatures(scene), render_options);
+}
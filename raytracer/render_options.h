@@ -1,8 +1,85 @@
 #pragma once
 
+#include <optional>
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
+struct AntiAliasingOptions {
+    // Per-pixel sample cap; 1 disables anti-aliasing. Refined pixels are split
+    // into n x n strata with n = floor(sqrt(max_samples)).
+    int max_samples = 1;
+    // A pixel is refined if a neighbor differs by more than these thresholds:
+    // in tone-compressed color (x / (1 + x), per channel) and in relative depth.
+    double color_threshold = 0.05;
+    double depth_threshold = 0.05;
+};
+
+enum class ToneOperator {
+    // x (1 + x / w^2) / (1 + x) with the white point w at the brightest
+    // channel value of the image.
+    kReinhardExtended,
+    // x / (1 + x).
+    kReinhard,
+    // Narkowicz's fit of the ACES filmic curve.
+    kAces,
+    // min(x, 1).
+    kClamp,
+};
+
+struct ToneMappingOptions {
+    ToneOperator tone_operator = ToneOperator::kReinhardExtended;
+    // Linear scale applied to the colors before the operator.
+    double exposure = 1.0;
+};
+
+// Edge-aware à-trous filter over the HDR colors; see denoise.h. A tap's
+// weight is exp(-sum of its differences to the center over these scales).
+struct DenoiseOptions {
+    // Pass k spaces its taps 2^k pixels apart, so 3 passes span 29 pixels.
+    // More passes smooth noise further but start to blur lighting gradients.
+    int iterations = 3;
+    // Relative depth difference; grows with the tap spacing.
+    double sigma_depth = 0.1;
+    // Multiplies 1 - cos of the angle between normals.
+    double sigma_normal = 64.0;
+    // Euclidean distance between albedos.
+    double sigma_albedo = 0.1;
+    // Luminance difference relative to the sum of the two luminances, so
+    // that shadow edges stop the blur as well as bright ones.
+    double sigma_color = 0.3;
+};
+
+const int kFrustumTileSize = 16;
+const int kRasterTileSize = 32;
+
+// Performance settings. Every choice renders the same image.
+struct TuningParameters {
+    // Side of the frustum-culled tiles RenderScene traces.
+    int tile_size = kFrustumTileSize;
+    // Threads that trace tiles and resolve the frame; 0 is one per hardware
+    // thread.
+    int threads = 0;
+    // Side of the screen bins of the rasterizer (rasterize_primary).
+    int raster_tile_size = kRasterTileSize;
+
+    bool operator==(const TuningParameters&) const = default;
+};
+
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    AntiAliasingOptions anti_aliasing = {};
+    // Resolve primary visibility with the tiled z-buffer rasterizer; rays are
+    // then traced only for shadows, reflections and refractions.
+    bool rasterize_primary = false;
+    // Only used in kFull mode.
+    ToneMappingOptions tone_mapping = {};
+    // Only used in kFull mode.
+    std::optional<DenoiseOptions> denoise = std::nullopt;
+    // Record per-stage hardware counters of the calling thread and the pool
+    // threads it starts into RenderStatistics. Does not change the image.
+    bool hardware_counters = false;
+    // Unset: the scene's tuning profile when Render finds one (see
+    // tuning_profile.h), otherwise the defaults.
+    std::optional<TuningParameters> tuning = std::nullopt;
 };
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <raytracer.h>
+#include <scene_cache.h>
+#include <socket_io.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct RenderJob {
+    std::string scene_path;
+    CameraOptions camera_options;
+    RenderOptions render_options;
+};
+
+enum class RequestType : uint32_t { kRender = 1, kShutdown = 2 };
+
+// Fixed-size wire image of the job options; the scene path follows it.
+struct RenderJobHeader {
+    uint32_t path_length;
+    int32_t screen_width;
+    int32_t screen_height;
+    double fov;
+    double look_from[3];
+    double look_to[3];
+    int32_t depth;
+    int32_t mode;
+    int32_t max_samples;
+    double color_threshold;
+    double depth_threshold;
+    int32_t rasterize_primary;
+    int32_t tone_operator;
+    double exposure;
+    // Nonzero if the DenoiseOptions that follow are set.
+    int32_t denoise;
+    int32_t denoise_iterations;
+    double sigma_depth;
+    double sigma_normal;
+    double sigma_albedo;
+    double sigma_color;
+};
+
+struct RenderResponseHeader {
+    // 0 on success, then the payload is the PNG; otherwise an error message.
+    int32_t status;
+    uint64_t size;
+};
+
+inline bool SendJob(int fd, const RenderJob& job) {
+    const auto& camera = job.camera_options;
+    const auto& render = job.render_options;
+    auto denoise = render.denoise.value_or(DenoiseOptions{});
+    RenderJobHeader header{static_cast<uint32_t>(job.scene_path.size()),
+                           camera.screen_width,
+                           camera.screen_height,
+                           camera.fov,
+                           {camera.look_from[0], camera.look_from[1], camera.look_from[2]},
+                           {camera.look_to[0], camera.look_to[1], camera.look_to[2]},
+                           render.depth,
+                           static_cast<int32_t>(render.mode),
+                           render.anti_aliasing.max_samples,
+                           render.anti_aliasing.color_threshold,
+                           render.anti_aliasing.depth_threshold,
+                           render.rasterize_primary,
+                           static_cast<int32_t>(render.tone_mapping.tone_operator),
+                           render.tone_mapping.exposure,
+                           render.denoise.has_value(),
+                           denoise.iterations,
+                           denoise.sigma_depth,
+                           denoise.sigma_normal,
+                           denoise.sigma_albedo,
+                           denoise.sigma_color};
+    auto type = RequestType::kRender;
+    return WriteAll(fd, &type, sizeof(type)) and WriteAll(fd, &header, sizeof(header)) and
+           WriteAll(fd, job.scene_path.data(), job.scene_path.size());
+}
+
+// Empty if the connection closed; throws for a job with out-of-range
+// options, which are read in full first so the connection stays usable. A
+// scene path longer than PATH_MAX is not read: that throws std::length_error
+// and the connection can't be used any more.
+inline std::optional<RenderJob> ReceiveJob(int fd) {
+    RenderJobHeader header;
+    if (!ReadAll(fd, &header, sizeof(header))) {
+        return {};
+    }
+    if (header.path_length > PATH_MAX) {
+        throw std::length_error("Scene path is too long: " + std::to_string(header.path_length));
+    }
+    std::string path(header.path_length, '\0');
+    if (!ReadAll(fd, path.data(), path.size())) {
+        return {};
+    }
+    if (header.mode < static_cast<int32_t>(RenderMode::kDepth) or
+        header.mode > static_cast<int32_t>(RenderMode::kFull)) {
+        throw std::runtime_error("Unknown render mode " + std::to_string(header.mode));
+    }
+    if (header.tone_operator < static_cast<int32_t>(ToneOperator::kReinhardExtended) or
+        header.tone_operator > static_cast<int32_t>(ToneOperator::kClamp)) {
+        throw std::runtime_error("Unknown tone operator " + std::to_string(header.tone_operator));
+    }
+    if (header.screen_width <= 0 or header.screen_height <= 0) {
+        throw std::runtime_error("Bad screen size " + std::to_string(header.screen_width) + "x" +
+                                 std::to_string(header.screen_height));
+    }
+    if (header.depth < 0) {
+        throw std::runtime_error("Negative depth " + std::to_string(header.depth));
+    }
+    if (header.max_samples < 0) {
+        throw std::runtime_error("Negative max_samples " + std::to_string(header.max_samples));
+    }
+    CameraOptions camera{header.screen_width, header.screen_height, header.fov};
+    camera.look_from = Vector{header.look_from[0], header.look_from[1], header.look_from[2]};
+    camera.look_to = Vector{header.look_to[0], header.look_to[1], header.look_to[2]};
+    RenderOptions render{header.depth, static_cast<RenderMode>(header.mode)};
+    render.anti_aliasing.max_samples = header.max_samples;
+    render.anti_aliasing.color_threshold = header.color_threshold;
+    render.anti_aliasing.depth_threshold = header.depth_threshold;
+    render.rasterize_primary = header.rasterize_primary != 0;
+    render.tone_mapping.tone_operator = static_cast<ToneOperator>(header.tone_operator);
+    render.tone_mapping.exposure = header.exposure;
+    if (header.denoise) {
+        render.denoise = DenoiseOptions{header.denoise_iterations, header.sigma_depth,
+                                        header.sigma_normal, header.sigma_albedo,
+                                        header.sigma_color};
+    }
+    return RenderJob{path, camera, render};
+}
+
+// Long-running renderer listening on a Unix domain socket. Connections are
+// served one at a time and may carry any number of jobs; parsed scenes stay
+// resident in a SceneCache between jobs.
+class RenderServer {
+public:
+    RenderServer(const std::string& socket_path, size_t cache_budget)
+        : socket_path_{socket_path}, cache_{cache_budget} {
+        sockaddr_un address{};
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long: " + socket_path);
+        }
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, socket_path.c_str());
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            throw std::runtime_error("Can't create a server socket");
+        }
+        unlink(socket_path.c_str());
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 or
+            listen(listen_fd_, 16) < 0) {
+            close(listen_fd_);
+            throw std::runtime_error("Can't listen on " + socket_path);
+        }
+    }
+
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator=(const RenderServer&) = delete;
+
+    ~RenderServer() {
+        close(listen_fd_);
+        unlink(socket_path_.c_str());
+    }
+
+    // Returns after a shutdown request or a Stop() call from another thread.
+    // Stop() takes effect within kStopPollMs, even with an idle client
+    // connected; a job being rendered is finished first.
+    void Serve() {
+        while (!stopped_) {
+            pollfd listener{listen_fd_, POLLIN, 0};
+            if (poll(&listener, 1, kStopPollMs) <= 0) {
+                continue;
+            }
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            ServeConnection(fd);
+            close(fd);
+        }
+    }
+
+    void Stop() {
+        stopped_ = true;
+    }
+
+    const SceneCache& GetCache() const {
+        return cache_;
+    }
+
+    size_t JobsDone() const {
+        return jobs_done_;
+    }
+
+private:
+    static constexpr int kStopPollMs = 100;
+
+    // Waits for the next request, checking for Stop() meanwhile.
+    bool WaitForRequest(int fd) const {
+        while (!stopped_) {
+            pollfd connection{fd, POLLIN, 0};
+            if (poll(&connection, 1, kStopPollMs) > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void ServeConnection(int fd) {
+        RequestType type;
+        while (WaitForRequest(fd) and ReadAll(fd, &type, sizeof(type))) {
+            if (type == RequestType::kShutdown) {
+                stopped_ = true;
+                return;
+            }
+            RenderResponseHeader header{0, 0};
+            std::vector<unsigned char> payload;
+            bool in_sync = true;
+            try {
+                auto job = ReceiveJob(fd);
+                if (!job) {
+                    return;
+                }
+                auto scene = cache_.Get(job->scene_path);
+                payload = RenderScene(*scene, job->camera_options, job->render_options).EncodePng();
+                ++jobs_done_;
+            } catch (const std::length_error& error) {
+                // The rest of the job was not read, so the stream is lost.
+                in_sync = false;
+                header.status = 1;
+                payload.assign(error.what(), error.what() + std::strlen(error.what()));
+            } catch (const std::exception& error) {
+                header.status = 1;
+                payload.assign(error.what(), error.what() + std::strlen(error.what()));
+            }
+            header.size = payload.size();
+            if (!WriteAll(fd, &header, sizeof(header)) or
+                !WriteAll(fd, payload.data(), payload.size()) or !in_sync) {
+                return;
+            }
+        }
+    }
+
+    std::string socket_path_;
+    SceneCache cache_;
+    int listen_fd_ = -1;
+    std::atomic<bool> stopped_ = false;
+    std::atomic<size_t> jobs_done_ = 0;
+};
+
+class RenderClient {
+public:
+    explicit RenderClient(const std::string& socket_path) {
+        sockaddr_un address{};
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long: " + socket_path);
+        }
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, socket_path.c_str());
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0 or connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+            throw std::runtime_error("Can't connect to render server at " + socket_path);
+        }
+    }
+
+    RenderClient(const RenderClient&) = delete;
+    RenderClient& operator=(const RenderClient&) = delete;
+
+    ~RenderClient() {
+        close(fd_);
+    }
+
+    // Returns the PNG bytes of the rendered frame.
+    std::vector<unsigned char> Submit(const RenderJob& job) {
+        if (!SendJob(fd_, job)) {
+            throw std::runtime_error("Can't send a job to the render server");
+        }
+        RenderResponseHeader header;
+        if (!ReadAll(fd_, &header, sizeof(header))) {
+            throw std::runtime_error("Render server closed the connection");
+        }
+        std::vector<unsigned char> payload(header.size);
+        if (!ReadAll(fd_, payload.data(), payload.size())) {
+            throw std::runtime_error("Render server closed the connection");
+        }
+        if (header.status != 0) {
+            throw std::runtime_error("Render job failed: " +
+                                     std::string(payload.begin(), payload.end()));
+        }
+        return payload;
+    }
+
+    void Shutdown() {
+        auto type = RequestType::kShutdown;
+        WriteAll(fd_, &type, sizeof(type));
+    }
+
+private:
+    int fd_ = -1;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <vector>
+
+enum class SceneChange { kMaterials, kLightIntensities, kLightPositions, kGeometry, kCamera };
+
+// Primary hit of one pixel.
+struct GBufferSample {
+    bool hit = false;
+    int object_id = -1;
+    // Only meaningful for triangles.
+    Vector barycentrics;
+    Vector position;
+    Vector normal;
+    double distance = 0;
+    // Camera direction, before Ray normalizes it once more.
+    Vector direction;
+};
+
+// Per pixel and light: whether the light is visible from the primary hit and
+// the clamped cosines of the diffuse and specular Phong terms.
+struct LightTerm {
+    bool visible = false;
+    double diffuse = 0;
+    double specular = 0;
+};
+
+// Keeps the primary hits and their light terms between renders of the same
+// scene and camera. After material or light intensity edits, pixels whose
+// material is purely local (no reflection or refraction at this depth) are
+// re-shaded from the buffers without tracing; only the others go through
+// ComputeColor again. Edit through GetScene()/GetCameraOptions() and report
+// each edit with Invalidate. Frames are tone mapped with `tone_mapping`.
+class RenderSession {
+public:
+    RenderSession(Scene scene, const CameraOptions& camera_options, int depth,
+                  const ToneMappingOptions& tone_mapping = {})
+        : scene_{std::move(scene)},
+          camera_options_{camera_options},
+          depth_{depth},
+          tone_mapping_{tone_mapping} {
+    }
+
+    Scene& GetScene() {
+        return scene_;
+    }
+
+    const Scene& GetScene() const {
+        return scene_;
+    }
+
+    CameraOptions& GetCameraOptions() {
+        return camera_options_;
+    }
+
+    void Invalidate(SceneChange change) {
+        switch (change) {
+            case SceneChange::kMaterials:
+                scene_.RefreshMaterials();
+                break;
+            case SceneChange::kLightIntensities:
+                break;
+            case SceneChange::kLightPositions:
+                light_terms_valid_ = false;
+                break;
+            case SceneChange::kGeometry:
+            case SceneChange::kCamera:
+                gbuffer_valid_ = false;
+                light_terms_valid_ = false;
+                break;
+        }
+    }
+
+    Image Render() {
+        traced_pixels_ = 0;
+        if (!gbuffer_valid_) {
+            TracePrimary();
+        }
+        if (!light_terms_valid_) {
+            ComputeLightTerms();
+        }
+        int width = camera_options_.screen_width;
+        int height = camera_options_.screen_height;
+        std::vector<std::vector<Vector>> prepixels(width, std::vector<Vector>(height));
+        for (int i = 0; i < width; ++i) {
+            for (int j = 0; j < height; ++j) {
+                prepixels[i][j] = Shade(static_cast<size_t>(i) * height + j);
+            }
+        }
+        Image output{width, height};
+        ToneMapping(output, prepixels, tone_mapping_);
+        return output;
+    }
+
+    const std::vector<GBufferSample>& GetGBuffer() const {
+        return gbuffer_;
+    }
+
+    // Pixels that needed any ray tracing during the last Render.
+    size_t TracedPixels() const {
+        return traced_pixels_;
+    }
+
+private:
+    int MaterialOf(int object_id) const {
+        const auto& objects = scene_.GetObjects();
+        if (static_cast<size_t>(object_id) < objects.size()) {
+            return objects[object_id].material_id;
+        }
+        return scene_.GetSphereObjects()[object_id - objects.size()].material_id;
+    }
+
+    void TracePrimary() {
+        int width = camera_options_.screen_width;
+        int height = camera_options_.screen_height;
+        gbuffer_.assign(static_cast<size_t>(width) * height, GBufferSample{});
+        Camera camera{&camera_options_};
+        const auto& objects = scene_.GetObjects();
+        for (int i = 0; i < width; ++i) {
+            for (int j = 0; j < height; ++j) {
+                auto& sample = gbuffer_[static_cast<size_t>(i) * height + j];
+                sample.direction = camera.GetDirection(i, j);
+                auto hit = FindNearestHit(Ray{camera_options_.look_from, sample.direction}, scene_);
+                if (!hit) {
+                    continue;
+                }
+                const auto& inter = hit.value().intersection;
+                sample.hit = true;
+                sample.object_id = hit.value().object_id;
+                sample.position = inter.GetPosition();
+                sample.normal = inter.GetNormal();
+                sample.distance = inter.GetDistance();
+                if (static_cast<size_t>(sample.object_id) < objects.size()) {
+                    sample.barycentrics =
+                        GetBarycentricCoords(objects[sample.object_id].polygon, sample.position);
+                }
+                ++traced_pixels_;
+            }
+        }
+        gbuffer_valid_ = true;
+    }
+
+    // Mirrors the per-light geometry of ComputeLightedColor.
+    void ComputeLightTerms() {
+        const auto& lights = scene_.GetLights();
+        light_terms_.assign(gbuffer_.size() * lights.size(), LightTerm{});
+        for (size_t pixel = 0; pixel < gbuffer_.size(); ++pixel) {
+            const auto& sample = gbuffer_[pixel];
+            if (!sample.hit) {
+                continue;
+            }
+            Ray ray{camera_options_.look_from, sample.direction};
+            for (size_t k = 0; k < lights.size(); ++k) {
+                if (!IsVisible(lights[k], sample.position, scene_)) {
+                    continue;
+                }
+                auto vl = lights[k].position - sample.position;
+                vl.Normalize();
+                auto normal_x_vl = DotProduct(sample.normal, vl);
+                auto vr = 2 * normal_x_vl * sample.normal - vl;
+                auto ve = -1 * ray.GetDirection();
+                light_terms_[pixel * lights.size() + k] =
+                    LightTerm{true, std::max(0.0, normal_x_vl), std::max(0.0, DotProduct(ve, vr))};
+            }
+        }
+        light_terms_valid_ = true;
+    }
+
+    Vector Shade(size_t pixel) {
+        const auto& sample = gbuffer_[pixel];
+        if (!sample.hit or depth_ < 1) {
+            return Vector();
+        }
+        auto material_id = MaterialOf(sample.object_id);
+        const auto* material = &scene_.GetMaterials().Get(material_id);
+        const auto& constants = scene_.GetMaterials().GetConstants(material_id);
+        if (depth_ > 1 and (constants.reflects or constants.refracts)) {
+            ++traced_pixels_;
+            Ray ray{camera_options_.look_from, sample.direction};
+            Intersection inter{sample.position, sample.normal, sample.distance};
+            return ComputeColor(material_id, ray, inter, depth_, scene_, false);
+        }
+        const auto& lights = scene_.GetLights();
+        Vector lighted;
+        for (size_t k = 0; k < lights.size(); ++k) {
+            const auto& term = light_terms_[pixel * lights.size() + k];
+            if (!term.visible) {
+                continue;
+            }
+            lighted = lighted + material->diffuse_color * lights[k].intensity * term.diffuse;
+            lighted = lighted + material->specular_color * lights[k].intensity *
+                                    pow(term.specular, material->specular_exponent);
+        }
+        return constants.emission + material->albedo[0] * lighted;
+    }
+
+    Scene scene_;
+    CameraOptions camera_options_;
+    int depth_;
+    ToneMappingOptions tone_mapping_;
+    bool gbuffer_valid_ = false;
+    bool light_terms_valid_ = false;
+    size_t traced_pixels_ = 0;
+    std::vector<GBufferSample> gbuffer_;
+    std::vector<LightTerm> light_terms_;
+};
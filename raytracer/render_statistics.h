@@ -0,0 +1,17 @@
+#pragma once
+
+#include <perf_counters.h>
+
+#include <cstddef>
+
+struct RenderStatistics {
+    double samples_per_pixel = 0.0;
+    // Out-of-core geometry: clusters read from the cache file, cluster
+    // requests made by traversal and the share of them served from memory.
+    size_t cluster_page_ins = 0;
+    size_t cluster_lookups = 0;
+    double cluster_hit_rate = 0.0;
+    // Per-stage wall time and hardware counters, when
+    // RenderOptions::hardware_counters is set.
+    HardwareCounterReport hardware_counters;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+// Part of every result cache key; bump it whenever a change to the renderer
+// alters its output for the same inputs.
+const int kRendererVersion = 2;
+
+// 128-bit FNV-1a.
+class ContentHasher {
+public:
+    void Update(const void* data, size_t size) {
+        const unsigned __int128 prime =
+            (static_cast<unsigned __int128>(1) << 88) + (1 << 8) + 0x3b;
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            state_ ^= bytes[i];
+            state_ *= prime;
+        }
+    }
+
+    template <class T>
+    void UpdateValue(const T& value) {
+        Update(&value, sizeof(value));
+    }
+
+    void UpdateString(const std::string& value) {
+        UpdateValue(value.size());
+        Update(value.data(), value.size());
+    }
+
+    std::string HexDigest() const {
+        static const char kDigits[] = "0123456789abcdef";
+        std::string output;
+        for (int shift = 124; shift >= 0; shift -= 4) {
+            output += kDigits[static_cast<int>(state_ >> shift) & 0xf];
+        }
+        return output;
+    }
+
+private:
+    unsigned __int128 state_ = (static_cast<unsigned __int128>(0x6c62272e07bb0142ULL) << 64) |
+                               0x62b821756295c58dULL;
+};
+
+inline std::string ReadFileContents(const std::filesystem::path& path) {
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        throw std::runtime_error("Can't open file " + path.string());
+    }
+    return std::string(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+}
+
+// Hashes the OBJ contents, the contents of every mtllib it references
+// (resolved like ReadScene does), all camera and render options and
+// kRendererVersion.
+inline std::string ComputeResultKey(const std::string& filename,
+                                    const CameraOptions& camera_options,
+                                    const RenderOptions& render_options) {
+    ContentHasher hasher;
+    hasher.UpdateValue(kRendererVersion);
+    auto obj = ReadFileContents(filename);
+    hasher.UpdateString(obj);
+
+    std::istringstream lines{obj};
+    std::string line;
+    while (getline(lines, line)) {
+        std::istringstream iss{line};
+        std::string keyword, mtl;
+        if (iss >> keyword >> mtl and keyword == "mtllib") {
+            auto path = std::filesystem::path(filename).parent_path() / std::filesystem::path(mtl);
+            hasher.UpdateString(mtl);
+            hasher.UpdateString(ReadFileContents(path));
+        }
+    }
+
+    hasher.UpdateValue(camera_options.screen_width);
+    hasher.UpdateValue(camera_options.screen_height);
+    hasher.UpdateValue(camera_options.fov);
+    for (int k = 0; k < 3; ++k) {
+        hasher.UpdateValue(camera_options.look_from[k]);
+        hasher.UpdateValue(camera_options.look_to[k]);
+    }
+    hasher.UpdateValue(render_options.depth);
+    hasher.UpdateValue(render_options.mode);
+    hasher.UpdateValue(render_options.anti_aliasing.max_samples);
+    hasher.UpdateValue(render_options.anti_aliasing.color_threshold);
+    hasher.UpdateValue(render_options.anti_aliasing.depth_threshold);
+    hasher.UpdateValue(render_options.rasterize_primary);
+    hasher.UpdateValue(render_options.tone_mapping.tone_operator);
+    hasher.UpdateValue(render_options.tone_mapping.exposure);
+    hasher.UpdateValue(render_options.denoise.has_value());
+    if (render_options.denoise) {
+        hasher.UpdateValue(render_options.denoise->iterations);
+        hasher.UpdateValue(render_options.denoise->sigma_depth);
+        hasher.UpdateValue(render_options.denoise->sigma_normal);
+        hasher.UpdateValue(render_options.denoise->sigma_albedo);
+        hasher.UpdateValue(render_options.denoise->sigma_color);
+    }
+    // tuning and hardware_counters do not change the image.
+    return hasher.HexDigest();
+}
+
+// Rendered images stored as PNG files named by their result key. A hit
+// refreshes the file's modification time; once the directory grows past
+// max_bytes the least recently used entries are removed.
+class ResultCache {
+public:
+    ResultCache(std::filesystem::path directory, uintmax_t max_bytes)
+        : directory_{std::move(directory)}, max_bytes_{max_bytes} {
+        std::filesystem::create_directories(directory_);
+    }
+
+    Image GetOrRender(const std::string& filename, const CameraOptions& camera_options,
+                      const RenderOptions& render_options) {
+        auto key = ComputeResultKey(filename, camera_options, render_options);
+        if (auto image = Lookup(key)) {
+            return std::move(*image);
+        }
+        auto image = Render(filename, camera_options, render_options);
+        Store(key, image);
+        return image;
+    }
+
+    std::optional<Image> Lookup(const std::string& key) {
+        auto path = PathFor(key);
+        std::error_code error;
+        if (!std::filesystem::exists(path, error)) {
+            ++misses_;
+            return {};
+        }
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(),
+                                         error);
+        ++hits_;
+        return Image{path.string()};
+    }
+
+    void Store(const std::string& key, Image& image) {
+        // Write under a private name first, so concurrent readers never see a
+        // partial file.
+        auto temporary = directory_ / (key + "." + std::to_string(getpid()) + ".tmp");
+        image.Write(temporary.string());
+        std::filesystem::rename(temporary, PathFor(key));
+        Evict();
+    }
+
+    size_t Hits() const {
+        return hits_;
+    }
+
+    size_t Misses() const {
+        return misses_;
+    }
+
+    uintmax_t SizeInBytes() const {
+        uintmax_t output = 0;
+        for (const auto& entry : std::filesystem::directory_iterator{directory_}) {
+            if (entry.path().extension() == ".png") {
+                output += entry.file_size();
+            }
+        }
+        return output;
+    }
+
+private:
+    std::filesystem::path PathFor(const std::string& key) const {
+        return directory_ / (key + ".png");
+    }
+
+    void Evict() {
+        std::vector<std::filesystem::directory_entry> entries;
+        uintmax_t total = 0;
+        for (const auto& entry : std::filesystem::directory_iterator{directory_}) {
+            if (entry.path().extension() == ".png") {
+                entries.push_back(entry);
+                total += entry.file_size();
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.last_write_time() < rhs.last_write_time();
+        });
+        std::error_code error;
+        for (size_t i = 0; total > max_bytes_ and i + 1 < entries.size(); ++i) {
+            total -= entries[i].file_size();
+            std::filesystem::remove(entries[i].path(), error);
+        }
+    }
+
+    std::filesystem::path directory_;
+    uintmax_t max_bytes_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
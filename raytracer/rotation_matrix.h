@@ -1,13 +1,12 @@
 #pragma once
 
-#include <vector>
+#include <array>
 #include <vector.h>
 
 class RotationMatrix {
 public:
     RotationMatrix(const Vector& from, const Vector& to) {
         Vector direction = to - from;
-        columns_.reserve(3);
         direction.Normalize();
         Vector forward = -1 * direction;
         Vector right{0, 1, 0};
@@ -19,14 +18,14 @@ public:
         }
         auto up = CrossProduct(forward, right);
         up.Normalize();
-        columns_.push_back(Vector({right[0], up[0], forward[0]}));
-        columns_.push_back(Vector({right[1], up[1], forward[1]}));
-        columns_.push_back(Vector({right[2], up[2], forward[2]}));
+        columns_ = {Vector{right[0], up[0], forward[0]}, Vector{right[1], up[1], forward[1]},
+                    Vector{right[2], up[2], forward[2]}};
     }
 
 private:
     friend Vector operator*(const RotationMatrix&, const Vector&);
-    std::vector<Vector> columns_;
+    friend Vector TransposedProduct(const RotationMatrix&, const Vector&);
+    std::array<Vector, 3> columns_;
 };
 
 Vector operator*(const RotationMatrix& matrix, const Vector& vector) {
@@ -35,4 +34,10 @@ Vector operator*(const RotationMatrix& matrix, const Vector& vector) {
     data[1] = DotProduct(matrix.columns_[1], vector);
     data[2] = DotProduct(matrix.columns_[2], vector);
     return Vector(data);
-}
\ No newline at end of file
+}
+
+// The matrix is orthonormal, so this is the inverse rotation.
+Vector TransposedProduct(const RotationMatrix& matrix, const Vector& vector) {
+    return matrix.columns_[0] * vector[0] + matrix.columns_[1] * vector[1] +
+           matrix.columns_[2] * vector[2];
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <scene.h>
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+inline size_t EstimateSceneFootprint(const Scene& scene) {
+    size_t output = sizeof(Scene);
+    output += scene.GetObjects().size() * sizeof(Object);
+    output += scene.GetSphereObjects().size() * (sizeof(SphereObject) + 4 * sizeof(double));
+    output += scene.GetLights().size() * sizeof(Light);
+    const auto& materials = scene.GetMaterials();
+    for (size_t id = 0; id < materials.Size(); ++id) {
+        output += sizeof(Material) + sizeof(MaterialConstants) +
+                  2 * materials.GetName(static_cast<int>(id)).capacity();
+    }
+    return output;
+}
+
+// Modification times of an OBJ file and of the material libraries it names.
+// Throws if the OBJ file is missing; a missing library has no time and never
+// matches.
+using SceneVersion = std::vector<std::pair<std::string, std::filesystem::file_time_type>>;
+
+inline SceneVersion ReadSceneVersion(const std::string& path) {
+    SceneVersion output{{path, std::filesystem::last_write_time(path)}};
+    std::ifstream file{path};
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss{line};
+        std::string keyword, library;
+        if (iss >> keyword >> library and keyword == "mtllib") {
+            auto mtl = (std::filesystem::path(path).parent_path() / library).string();
+            std::error_code error;
+            auto time = std::filesystem::last_write_time(mtl, error);
+            output.emplace_back(mtl, error ? std::filesystem::file_time_type::min() : time);
+        }
+    }
+    return output;
+}
+
+// Whether none of the files changed since `version` was read.
+inline bool IsCurrent(const SceneVersion& version) {
+    for (const auto& [file, time] : version) {
+        std::error_code error;
+        if (std::filesystem::last_write_time(file, error) != time or error) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parsed scenes keyed by path and evicted in LRU order once their estimated
+// footprint exceeds the memory budget. An entry is reloaded when the OBJ file
+// or one of its material libraries was modified. The most recently used
+// scene always stays, even if it alone is over budget.
+class SceneCache {
+public:
+    explicit SceneCache(size_t memory_budget) : memory_budget_{memory_budget} {
+    }
+
+    std::shared_ptr<const Scene> Get(const std::string& path) {
+        std::lock_guard guard{mutex_};
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            if (IsCurrent(it->second->version)) {
+                ++hits_;
+                entries_.splice(entries_.begin(), entries_, it->second);
+                return it->second->scene;
+            }
+            memory_usage_ -= it->second->footprint;
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+        // Read before the scene, so that an edit during the load reloads it
+        // next time.
+        auto version = ReadSceneVersion(path);
+        ++misses_;
+        auto scene = std::make_shared<const Scene>(ReadScene(path));
+        auto footprint = EstimateSceneFootprint(*scene);
+        entries_.push_front(Entry{path, std::move(version), scene, footprint});
+        index_[path] = entries_.begin();
+        memory_usage_ += footprint;
+        while (memory_usage_ > memory_budget_ and entries_.size() > 1) {
+            auto& last = entries_.back();
+            memory_usage_ -= last.footprint;
+            index_.erase(last.path);
+            entries_.pop_back();
+        }
+        return scene;
+    }
+
+    size_t Hits() const {
+        std::lock_guard guard{mutex_};
+        return hits_;
+    }
+
+    size_t Misses() const {
+        std::lock_guard guard{mutex_};
+        return misses_;
+    }
+
+    size_t Size() const {
+        std::lock_guard guard{mutex_};
+        return entries_.size();
+    }
+
+    size_t MemoryUsage() const {
+        std::lock_guard guard{mutex_};
+        return memory_usage_;
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        SceneVersion version;
+        std::shared_ptr<const Scene> scene;
+        size_t footprint;
+    };
+
+    size_t memory_budget_;
+    size_t memory_usage_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    std::list<Entry> entries_;
+    std::map<std::string, std::list<Entry>::iterator> index_;
+    mutable std::mutex mutex_;
+};
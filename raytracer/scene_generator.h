@@ -0,0 +1,227 @@
+#pragma once
+
+#include <camera_options.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class SceneDistribution {
+    // Triangle and sphere centers uniform in the scene cube.
+    kUniform,
+    // Gaussian clumps around a few random centers: empty space between dense
+    // regions.
+    kClustered,
+    // Uniform centers, but triangles are long slivers crossing much of the
+    // scene, the worst case for bounding volumes.
+    kLongThin,
+};
+
+struct SceneGeneratorOptions {
+    size_t triangles = 1000;
+    size_t spheres = 0;
+    size_t lights = 1;
+    // Shares of primitives with the mirror and the glass material; the rest
+    // are diffuse.
+    double mirror_fraction = 0.0;
+    double glass_fraction = 0.0;
+    SceneDistribution distribution = SceneDistribution::kUniform;
+    uint32_t seed = 1;
+    // Primitives fill [-extent, extent]^3; lights sit above it.
+    double extent = 10.0;
+};
+
+// Writes an OBJ scene with triangles (f), spheres (S) and point lights (P)
+// and its MTL library next to it, in the dialect ReadScene reads. The same
+// options and seed always give the same files.
+class SceneGenerator {
+public:
+    explicit SceneGenerator(const SceneGeneratorOptions& options)
+        : options_{options}, generator_{options.seed} {
+        if (options.mirror_fraction < 0 or options.glass_fraction < 0 or
+            options.mirror_fraction + options.glass_fraction > 1) {
+            throw std::runtime_error("Material fractions must be in [0, 1] and sum to at most 1");
+        }
+        int clusters = std::max(1, static_cast<int>(std::cbrt(options.triangles + options.spheres)));
+        for (int k = 0; k < clusters; ++k) {
+            cluster_centers_.push_back(UniformPoint(0.8));
+        }
+    }
+
+    void Write(const std::string& obj_filename) {
+        std::filesystem::path obj_path{obj_filename};
+        auto mtl_name = obj_path.stem().string() + ".mtl";
+        WriteMaterials((obj_path.parent_path() / mtl_name).string());
+
+        std::ofstream file{obj_filename};
+        if (!file) {
+            throw std::runtime_error("Can't open file " + obj_filename);
+        }
+        file << "mtllib " << mtl_name << "\n";
+        auto counts = SplitByMaterial(options_.triangles);
+        // Typical primitive size: the primitives together stay about as
+        // dense as the scene grows.
+        double size = options_.extent * 2 /
+                      std::cbrt(static_cast<double>(std::max<size_t>(1, options_.triangles)));
+        size_t vertex = 1;
+        for (int material = 0; material < kMaterialCount; ++material) {
+            if (counts[material] == 0) {
+                continue;
+            }
+            file << "usemtl " << kMaterialNames[material] << "\n";
+            for (size_t k = 0; k < counts[material]; ++k) {
+                for (const auto& point : Triangle(size)) {
+                    file << "v " << point[0] << " " << point[1] << " " << point[2] << "\n";
+                }
+                file << "f " << vertex << " " << vertex + 1 << " " << vertex + 2 << "\n";
+                vertex += 3;
+            }
+        }
+
+        counts = SplitByMaterial(options_.spheres);
+        double radius = options_.extent * 0.5 /
+                        std::cbrt(static_cast<double>(std::max<size_t>(1, options_.spheres)));
+        for (int material = 0; material < kMaterialCount; ++material) {
+            if (counts[material] == 0) {
+                continue;
+            }
+            file << "usemtl " << kMaterialNames[material] << "\n";
+            for (size_t k = 0; k < counts[material]; ++k) {
+                auto center = Center();
+                file << "S " << center[0] << " " << center[1] << " " << center[2] << " "
+                     << radius * (0.5 + Uniform()) << "\n";
+            }
+        }
+
+        // The light intensities add up to about that of one unit light.
+        double intensity = 1.0 / std::max<size_t>(1, options_.lights);
+        for (size_t k = 0; k < options_.lights; ++k) {
+            auto position = UniformPoint(1.0);
+            position[1] = options_.extent * (1.5 + Uniform());
+            file << "P " << position[0] << " " << position[1] << " " << position[2] << " "
+                 << intensity << " " << intensity << " " << intensity << "\n";
+        }
+        if (!file) {
+            throw std::runtime_error("Can't write file " + obj_filename);
+        }
+    }
+
+private:
+    using Point = std::array<double, 3>;
+
+    static constexpr int kMaterialCount = 6;
+    static constexpr const char* kMaterialNames[kMaterialCount] = {
+        "diffuse_red", "diffuse_green", "diffuse_blue", "diffuse_white", "mirror", "glass"};
+
+    void WriteMaterials(const std::string& filename) const {
+        std::ofstream file{filename};
+        if (!file) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        const char* diffuse[] = {"0.7 0.1 0.1", "0.1 0.7 0.1", "0.1 0.1 0.7", "0.7 0.7 0.7"};
+        for (int k = 0; k < 4; ++k) {
+            file << "newmtl " << kMaterialNames[k] << "\n"
+                 << "Ka 0.02 0.02 0.02\nKd " << diffuse[k] << "\nKs 0.1 0.1 0.1\nNs 10\n\n";
+        }
+        file << "newmtl mirror\nKs 0.9 0.9 0.9\nNs 1024\nal 0.1 0.9 0.0\n\n";
+        file << "newmtl glass\nKs 0.5 0.5 0.5\nNs 125\nNi 1.5\nal 0.0 0.3 0.7\n";
+    }
+
+    // Counts per material, diffuse ones spread evenly over the four colors.
+    std::array<size_t, kMaterialCount> SplitByMaterial(size_t total) const {
+        std::array<size_t, kMaterialCount> output{};
+        output[4] = std::llround(total * options_.mirror_fraction);
+        output[5] = std::min(total - output[4],
+                             static_cast<size_t>(std::llround(total * options_.glass_fraction)));
+        size_t diffuse = total - output[4] - output[5];
+        for (int k = 0; k < 4; ++k) {
+            output[k] = diffuse / 4 + (static_cast<size_t>(k) < diffuse % 4);
+        }
+        return output;
+    }
+
+    double Uniform() {
+        return std::uniform_real_distribution<double>{0.0, 1.0}(generator_);
+    }
+
+    Point UniformPoint(double scale) {
+        Point output;
+        for (auto& value : output) {
+            value = options_.extent * scale * (2 * Uniform() - 1);
+        }
+        return output;
+    }
+
+    Point RandomDirection() {
+        std::normal_distribution<double> normal;
+        Point output{normal(generator_), normal(generator_), normal(generator_)};
+        double length = std::sqrt(output[0] * output[0] + output[1] * output[1] +
+                                  output[2] * output[2]);
+        for (auto& value : output) {
+            value /= std::max(length, 1e-12);
+        }
+        return output;
+    }
+
+    Point Center() {
+        if (options_.distribution != SceneDistribution::kClustered) {
+            return UniformPoint(1.0);
+        }
+        std::uniform_int_distribution<size_t> pick{0, cluster_centers_.size() - 1};
+        std::normal_distribution<double> spread{0.0, options_.extent * 0.05};
+        auto output = cluster_centers_[pick(generator_)];
+        for (auto& value : output) {
+            value = std::clamp(value + spread(generator_), -options_.extent, options_.extent);
+        }
+        return output;
+    }
+
+    std::array<Point, 3> Triangle(double size) {
+        auto center = Center();
+        std::array<Point, 3> output;
+        if (options_.distribution == SceneDistribution::kLongThin) {
+            // A sliver about a third of the scene long and 1/1000 as wide.
+            auto axis = RandomDirection();
+            auto across = RandomDirection();
+            double length = options_.extent * 0.3;
+            for (int k = 0; k < 3; ++k) {
+                output[0][k] = center[k] - axis[k] * length;
+                output[1][k] = center[k] + axis[k] * length;
+                output[2][k] = center[k] + across[k] * length * 1e-3;
+            }
+            return output;
+        }
+        for (auto& point : output) {
+            auto offset = RandomDirection();
+            for (int k = 0; k < 3; ++k) {
+                point[k] = center[k] + offset[k] * size * 0.5;
+            }
+        }
+        return output;
+    }
+
+    SceneGeneratorOptions options_;
+    std::mt19937 generator_;
+    std::vector<Point> cluster_centers_;
+};
+
+inline void GenerateScene(const std::string& obj_filename, const SceneGeneratorOptions& options) {
+    SceneGenerator{options}.Write(obj_filename);
+}
+
+// A camera outside the generated cube, looking at its center.
+inline CameraOptions GeneratedSceneCamera(const SceneGeneratorOptions& options, int width,
+                                          int height) {
+    CameraOptions output(width, height);
+    output.look_from =
+        std::array<double, 3>{options.extent * 1.6, options.extent * 1.2, options.extent * 2.4};
+    output.look_to = std::array<double, 3>{0.0, 0.0, 0.0};
+    return output;
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <raytracer.h>
+#include <temporal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct CameraKeyframe {
+    // Seconds from the start of the path.
+    double time;
+    Vector look_from;
+    Vector look_to;
+    double fov = M_PI / 2;
+};
+
+enum class PathInterpolation {
+    kLinear,
+    // Uniform Catmull-Rom splines through the positions and targets, which
+    // keep the velocity continuous at the keyframes. The field of view is
+    // always interpolated linearly.
+    kCatmullRom,
+};
+
+class CameraPath {
+public:
+    explicit CameraPath(std::vector<CameraKeyframe> keyframes,
+                        PathInterpolation interpolation = PathInterpolation::kCatmullRom)
+        : keyframes_{std::move(keyframes)}, interpolation_{interpolation} {
+        if (keyframes_.empty()) {
+            throw std::runtime_error("Camera path needs at least one keyframe");
+        }
+        for (size_t k = 1; k < keyframes_.size(); ++k) {
+            if (!(keyframes_[k].time > keyframes_[k - 1].time)) {
+                throw std::runtime_error("Camera keyframe times must increase");
+            }
+        }
+    }
+
+    double StartTime() const {
+        return keyframes_.front().time;
+    }
+
+    double Duration() const {
+        return keyframes_.back().time - keyframes_.front().time;
+    }
+
+    // The camera at `time`, clamped to the path.
+    CameraOptions At(double time, int width, int height) const {
+        CameraOptions output(width, height);
+        if (keyframes_.size() == 1 or time <= keyframes_.front().time) {
+            return ToOptions(keyframes_.front(), width, height);
+        }
+        if (time >= keyframes_.back().time) {
+            return ToOptions(keyframes_.back(), width, height);
+        }
+        auto next = std::upper_bound(
+            keyframes_.begin(), keyframes_.end(), time,
+            [](double value, const CameraKeyframe& keyframe) { return value < keyframe.time; });
+        size_t k = next - keyframes_.begin() - 1;
+        const auto& from = keyframes_[k];
+        const auto& to = keyframes_[k + 1];
+        double u = (time - from.time) / (to.time - from.time);
+        output.fov = from.fov + (to.fov - from.fov) * u;
+        output.look_from = Interpolate(k, u, &CameraKeyframe::look_from);
+        output.look_to = Interpolate(k, u, &CameraKeyframe::look_to);
+        return output;
+    }
+
+private:
+    static CameraOptions ToOptions(const CameraKeyframe& keyframe, int width, int height) {
+        CameraOptions output(width, height, keyframe.fov);
+        output.look_from = keyframe.look_from;
+        output.look_to = keyframe.look_to;
+        return output;
+    }
+
+    // Between keyframes k and k + 1; the ends of the path are extended by
+    // mirroring their neighbours.
+    Vector Interpolate(size_t k, double u, Vector CameraKeyframe::*member) const {
+        const auto& p1 = keyframes_[k].*member;
+        const auto& p2 = keyframes_[k + 1].*member;
+        if (interpolation_ == PathInterpolation::kLinear) {
+            return p1 + (p2 - p1) * u;
+        }
+        auto p0 = k > 0 ? keyframes_[k - 1].*member : p1 * 2.0 - p2;
+        auto p3 = k + 2 < keyframes_.size() ? keyframes_[k + 2].*member : p2 * 2.0 - p1;
+        return 0.5 * (p1 * 2.0 + (p2 - p0) * u + (p0 * 2.0 - p1 * 5.0 + p2 * 4.0 - p3) * (u * u) +
+                      (p1 * 3.0 - p0 - p2 * 3.0 + p3) * (u * u * u));
+    }
+
+    std::vector<CameraKeyframe> keyframes_;
+    PathInterpolation interpolation_;
+};
+
+struct SequenceOptions {
+    int width;
+    int height;
+    // Frames per second of path time; frame k shows the path at
+    // StartTime() + k / frame_rate, up to and including the end.
+    double frame_rate = 24.0;
+    // Frame k goes to output_prefix + k padded to `digits` + ".png"; an empty
+    // prefix writes nothing.
+    std::string output_prefix;
+    int digits = 4;
+    // Reuse each frame's primary hits in the next one; see temporal.h.
+    std::optional<TemporalOptions> temporal = std::nullopt;
+};
+
+struct SequenceReport {
+    size_t frames = 0;
+    // Wall time of the whole sequence, the last encode included.
+    double seconds = 0.0;
+    // Time between the starts of consecutive traces, per frame.
+    std::vector<double> frame_seconds;
+    // With SequenceOptions::temporal: the share of each frame's pixels taken
+    // from the previous frame.
+    std::vector<double> reuse_ratios;
+
+    double FramesPerSecond() const {
+        return seconds > 0 ? frames / seconds : 0.0;
+    }
+
+    std::string ToString() const {
+        std::ostringstream output;
+        output << frames << " frames in " << seconds << " s, " << FramesPerSecond() << " fps";
+        if (!reuse_ratios.empty()) {
+            double sum = 0;
+            for (auto ratio : reuse_ratios) {
+                sum += ratio;
+            }
+            output << ", " << 100 * sum / reuse_ratios.size() << "% of pixels reused";
+        }
+        return output.str();
+    }
+};
+
+inline std::string FrameFilename(const std::string& prefix, size_t index, int digits) {
+    auto number = std::to_string(index);
+    if (static_cast<int>(number.size()) < digits) {
+        number.insert(0, digits - number.size(), '0');
+    }
+    return prefix + number + ".png";
+}
+
+inline size_t FrameCount(const CameraPath& path, double frame_rate) {
+    if (!(frame_rate > 0)) {
+        throw std::runtime_error("Frame rate must be positive");
+    }
+    // The tolerance keeps a last frame that lands on the end of the path.
+    return static_cast<size_t>(std::floor(path.Duration() * frame_rate + 1e-9)) + 1;
+}
+
+// Per-frame work that does not need the previous frame: the camera and, for
+// rasterize_primary, the screen bins.
+struct FrameSetup {
+    CameraOptions camera_options;
+    std::unique_ptr<PrimaryRasterizer> rasterizer;
+};
+
+inline bool AntiAliased(const RenderOptions& render_options) {
+    return render_options.anti_aliasing.max_samples > 1 and
+           render_options.mode != RenderMode::kDepth;
+}
+
+inline std::unique_ptr<FrameSetup> SetupFrame(const Scene& scene, const CameraPath& path,
+                                              size_t index, const SequenceOptions& options,
+                                              const RenderOptions& render_options) {
+    TIMELINE_SCOPE("FrameSetup", "build", index);
+    auto output = std::make_unique<FrameSetup>(FrameSetup{
+        path.At(path.StartTime() + index / options.frame_rate, options.width, options.height),
+        nullptr});
+    if (render_options.rasterize_primary and !AntiAliased(render_options) and
+        !options.temporal) {
+        auto tuning = render_options.tuning.value_or(TuningParameters{});
+        output->rasterizer = std::make_unique<PrimaryRasterizer>(scene, output->camera_options,
+                                                                 tuning.raster_tile_size);
+    }
+    return output;
+}
+
+// The same image as RenderScene with frame.camera_options.
+inline Image RenderFrame(const Scene& scene, const TraceSetup& trace_setup,
+                         const FrameSetup& frame, const RenderOptions& render_options) {
+    const auto& camera_options = frame.camera_options;
+    if (AntiAliased(render_options)) {
+        return RenderAntiAliased(scene, camera_options, render_options);
+    }
+    Image output{camera_options.screen_width, camera_options.screen_height};
+    auto& arena = ThreadArena();
+    ArenaScope scope{arena};
+    PixelBuffer prepixels{output.Width(), output.Height(), arena};
+    if (frame.rasterizer) {
+        auto tuning = render_options.tuning.value_or(TuningParameters{});
+        frame.rasterizer->Render(render_options, prepixels, tuning.threads);
+    } else {
+        TraceFrame(scene, trace_setup, camera_options, render_options, prepixels);
+    }
+    ResolveFrame(output, prepixels, scene, camera_options, render_options);
+    return output;
+}
+
+// Renders the path frame by frame against one loaded scene. While frame N is
+// traced, frame N + 1 is set up and frame N - 1 is encoded and written on
+// other threads; at most one frame waits for its encode. With
+// options.temporal the frames go through a TemporalRenderer instead.
+inline SequenceReport RenderSequence(const Scene& scene, const CameraPath& path,
+                                     const SequenceOptions& options,
+                                     const RenderOptions& render_options) {
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto frames = FrameCount(path, options.frame_rate);
+    auto trace_setup = PrepareTrace(scene, render_options);
+    auto setup = [&](size_t index) {
+        return SetupFrame(scene, path, index, options, render_options);
+    };
+
+    SequenceReport report;
+    std::optional<TemporalRenderer> temporal;
+    if (options.temporal) {
+        temporal.emplace(*options.temporal);
+    }
+    auto next = std::async(std::launch::async, setup, 0);
+    std::future<void> encoding;
+    auto frame_start = Clock::now();
+    for (size_t k = 0; k < frames; ++k) {
+        auto frame = next.get();
+        if (k + 1 < frames) {
+            next = std::async(std::launch::async, setup, k + 1);
+        }
+        auto image = [&] {
+            TIMELINE_SCOPE("SequenceFrame", "trace", k);
+            if (temporal) {
+                auto output = temporal->Render(scene, frame->camera_options, render_options);
+                report.reuse_ratios.push_back(temporal->ReuseRatio());
+                return output;
+            }
+            return RenderFrame(scene, trace_setup, *frame, render_options);
+        }();
+        // Rethrows a failed write of the previous frame.
+        if (encoding.valid()) {
+            encoding.get();
+        }
+        if (!options.output_prefix.empty()) {
+            encoding = std::async(std::launch::async,
+                                  [image = std::move(image),
+                                   filename = FrameFilename(options.output_prefix, k,
+                                                            options.digits)] {
+                                      image.Write(filename);
+                                  });
+        }
+        auto now = Clock::now();
+        report.frame_seconds.push_back(std::chrono::duration<double>(now - frame_start).count());
+        frame_start = now;
+    }
+    if (encoding.valid()) {
+        encoding.get();
+    }
+    report.frames = frames;
+    report.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return report;
+}
+
+inline SequenceReport RenderSequence(const std::string& filename, const CameraPath& path,
+                                     const SequenceOptions& options,
+                                     const RenderOptions& render_options) {
+    return RenderSequence(ReadScene(filename), path, options, render_options);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+inline bool WriteAll(int fd, const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        auto written = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (written < 0 and errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+inline bool ReadAll(int fd, void* data, size_t size) {
+    auto bytes = static_cast<char*>(data);
+    while (size > 0) {
+        auto count = read(fd, bytes, size);
+        if (count < 0 and errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
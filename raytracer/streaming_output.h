@@ -0,0 +1,247 @@
+#pragma once
+
+#include <raytracer.h>
+#include <tone_mapping.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct StreamingOutputOptions {
+    // Where the float tiles are spilled; empty picks a file in the temporary
+    // directory. The file is removed when the render ends.
+    std::string scratch_path;
+};
+
+struct StreamingOutputReport {
+    // Size of the scratch file: 12 bytes per pixel.
+    size_t scratch_bytes = 0;
+    // Memory the render held for pixels, measured: the arenas of the tracing
+    // threads, which hold one tile each, and the buffers of the tile row
+    // being encoded. Independent of the image height.
+    size_t buffer_bytes = 0;
+};
+
+// A file of RGB floats addressed by pixel index, removed on destruction.
+class ScratchImage {
+public:
+    ScratchImage(const std::string& path, size_t pixels) : path_{path}, pixels_{pixels} {
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd_ < 0) {
+            throw std::runtime_error("Can't open scratch file " + path + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    ScratchImage(const ScratchImage&) = delete;
+    ScratchImage& operator=(const ScratchImage&) = delete;
+
+    ~ScratchImage() {
+        close(fd_);
+        unlink(path_.c_str());
+    }
+
+    size_t Bytes() const {
+        return pixels_ * 3 * sizeof(float);
+    }
+
+    // `count` pixels from pixel `index` on; safe from several threads.
+    void Write(size_t index, const float* data, size_t count) {
+        Transfer(index, const_cast<float*>(data), count, true);
+    }
+
+    void Read(size_t index, float* data, size_t count) const {
+        Transfer(index, data, count, false);
+    }
+
+private:
+    void Transfer(size_t index, float* data, size_t count, bool write) const {
+        auto offset = static_cast<off_t>(index * 3 * sizeof(float));
+        auto bytes = count * 3 * sizeof(float);
+        auto buffer = reinterpret_cast<char*>(data);
+        while (bytes > 0) {
+            auto done = write ? pwrite(fd_, buffer, bytes, offset) : pread(fd_, buffer, bytes, offset);
+            if (done <= 0) {
+                if (done < 0 and errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Can't " + std::string{write ? "write" : "read"} +
+                                         " scratch file " + path_);
+            }
+            buffer += done;
+            bytes -= done;
+            offset += done;
+        }
+    }
+
+    std::string path_;
+    size_t pixels_;
+    int fd_;
+};
+
+inline std::string ScratchPath(const StreamingOutputOptions& options) {
+    if (!options.scratch_path.empty()) {
+        return options.scratch_path;
+    }
+    static std::atomic<int> counter = 0;
+    auto name = "raytracer_scratch_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// The encode of one row of raw values into RGBA bytes, as ResolvePixels
+// does for a whole frame; `max_value` is the global statistic the mode
+// needs (largest distance for kDepth, largest channel for kFull).
+inline void ResolveRow(const float* input, png_bytep output, int width, RenderMode mode,
+                       const ToneMappingOptions& tone_mapping, float max_value) {
+    switch (mode) {
+        case RenderMode::kDepth:
+            for (int x = 0; x < width; ++x) {
+                int level = input[3 * x] == 0 ? 255 : std::round(255 * input[3 * x] / max_value);
+                output[4 * x] = output[4 * x + 1] = output[4 * x + 2] =
+                    static_cast<png_byte>(level);
+            }
+            break;
+        case RenderMode::kNormal:
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < 3; ++c) {
+                    output[4 * x + c] = static_cast<png_byte>(static_cast<int>(255 * input[3 * x + c]));
+                }
+            }
+            break;
+        case RenderMode::kFull:
+            ToneMapRow(input, output, width, tone_mapping.tone_operator,
+                       MakeToneParameters(tone_mapping, max_value));
+            break;
+    }
+}
+
+// Renders straight into a PNG at `filename` without holding the frame in
+// memory, for images too large for Image. Tiles are traced in parallel, in
+// tile rows, and spilled as floats to a scratch file; the statistic the
+// resolve needs is reduced over the tiles as they are spilled, and the PNG
+// is then encoded from the file a tile row at a time. The file holds the
+// frame tile row by tile row, and each tile row tile by tile, row-major, so
+// that a tile is one write and a tile row one read. The PNG equals
+// RenderScene's written with Image::Write, up to float rounding in kDepth
+// and kNormal. Takes one sample per pixel: anti_aliasing and
+// rasterize_primary are ignored. The denoiser needs the whole frame, so
+// denoise in kFull throws.
+inline StreamingOutputReport RenderStreaming(const Scene& scene,
+                                             const CameraOptions& camera_options,
+                                             const RenderOptions& render_options,
+                                             const std::string& filename,
+                                             const StreamingOutputOptions& options = {}) {
+    if (Denoises(render_options)) {
+        throw std::runtime_error("Streaming output can't denoise");
+    }
+    auto tuning = render_options.tuning.value_or(TuningParameters{});
+    int tile_size = tuning.tile_size;
+    CheckTileSize(tile_size);
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    ScratchImage scratch{ScratchPath(options), static_cast<size_t>(width) * height};
+    auto setup = PrepareTrace(scene, render_options);
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    size_t tiles = static_cast<size_t>(tiles_x) * ((height + tile_size - 1) / tile_size);
+    auto threads = std::min(ThreadCount(tuning.threads), tiles);
+    // The first pixel of a tile in the file.
+    auto tile_index = [&](const Tile& tile) {
+        return static_cast<size_t>(tile.y) * width + static_cast<size_t>(tile.x) * tile.height;
+    };
+
+    // Only kReinhardExtended and kDepth need the maximum.
+    float max_value = render_options.mode == RenderMode::kDepth ? -1.0f : 0.0f;
+    bool need_max = render_options.mode == RenderMode::kDepth or
+                    (render_options.mode == RenderMode::kFull and
+                     render_options.tone_mapping.tone_operator == ToneOperator::kReinhardExtended);
+    size_t held_bytes = 0;
+    std::mutex mutex;
+    std::atomic<size_t> next_tile = 0;
+    RunOnThreads(threads, [&] {
+        auto& thread_arena = ThreadArena();
+        ArenaScope scope{thread_arena};
+        TilePrimitives primitives{scene, thread_arena};
+        // The tile's pixels, in an arena of their own to measure them.
+        size_t tile_pixels = static_cast<size_t>(tile_size) * tile_size;
+        Arena arena{tile_pixels * (sizeof(Vector) + 3 * sizeof(float)) + 2 * Arena::kAlignment};
+        PixelBuffer prepixels{tile_size, tile_size, arena};
+        auto block = arena.AllocateArray<float>(tile_pixels * 3);
+        float local_max = max_value;
+        for (size_t k = next_tile++; k < tiles; k = next_tile++) {
+            TIMELINE_SCOPE("TraceTile", "trace", k);
+            int x0 = static_cast<int>(k % tiles_x) * tile_size;
+            int y0 = static_cast<int>(k / tiles_x) * tile_size;
+            Tile tile{0, 0, std::min(tile_size, width - x0), std::min(tile_size, height - y0)};
+            TraceTile(scene, setup.bounds, Camera{&camera_options, x0, y0},
+                      camera_options.look_from, tile, render_options, setup.shade, primitives,
+                      prepixels);
+            size_t count = static_cast<size_t>(tile.width) * tile.height;
+            for (int j = 0; j < tile.height; ++j) {
+                auto row = block + 3 * j * tile.width;
+                for (int i = 0; i < tile.width; ++i) {
+                    for (int c = 0; c < 3; ++c) {
+                        row[3 * i + c] = static_cast<float>(prepixels[i][j][c]);
+                    }
+                }
+            }
+            if (need_max) {
+                local_max = std::max(local_max, MaxChannel(block, count * 3));
+            }
+            scratch.Write(tile_index(Tile{x0, y0, tile.width, tile.height}), block, count);
+        }
+        std::lock_guard lock{mutex};
+        max_value = std::max(max_value, local_max);
+        held_bytes += arena.Capacity();
+    });
+
+    {
+        TIMELINE_SCOPE("EncodeRows", "encode");
+        StageScope stage{RenderStage::kEncode};
+        PngRowWriter writer{filename, width, height};
+        std::vector<float> band(static_cast<size_t>(width) * tile_size * 3);
+        std::vector<float> input(static_cast<size_t>(width) * 3);
+        std::vector<png_byte> output(static_cast<size_t>(width) * 4, 255);
+        for (int y0 = 0; y0 < height; y0 += tile_size) {
+            int band_height = std::min(tile_size, height - y0);
+            scratch.Read(tile_index(Tile{0, y0, width, band_height}), band.data(),
+                         static_cast<size_t>(width) * band_height);
+            for (int j = 0; j < band_height; ++j) {
+                for (int x0 = 0; x0 < width; x0 += tile_size) {
+                    int tile_width = std::min(tile_size, width - x0);
+                    auto row = band.data() +
+                               3 * (static_cast<size_t>(x0) * band_height + j * tile_width);
+                    std::copy(row, row + 3 * tile_width, input.data() + 3 * x0);
+                }
+                ResolveRow(input.data(), output.data(), width, render_options.mode,
+                           render_options.tone_mapping, max_value);
+                writer.WriteRow(output.data());
+            }
+        }
+        writer.Finish();
+        held_bytes += (band.capacity() + input.capacity()) * sizeof(float) + output.capacity();
+    }
+
+    StreamingOutputReport report;
+    report.scratch_bytes = scratch.Bytes();
+    report.buffer_bytes = held_bytes;
+    return report;
+}
+
+inline StreamingOutputReport RenderStreaming(const std::string& scene_filename,
+                                             const CameraOptions& camera_options,
+                                             const RenderOptions& render_options,
+                                             const std::string& filename,
+                                             const StreamingOutputOptions& options = {}) {
+    return RenderStreaming(ReadScene(scene_filename), camera_options, render_options, filename,
+                           options);
+}
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+struct TemporalOptions {
+    // A reprojected pixel whose depth differs from a 4-neighbour's by more
+    // than this (relative) sits on an edge, where a subpixel shift changes
+    // what the pixel sees; it is traced again.
+    double depth_threshold = 0.05;
+    // Also trace the primary ray of every reprojected pixel and keep its
+    // value only if the ray hits the same object at about the reprojected
+    // distance. This catches surfaces that enter the view from outside the
+    // previous frame, which reprojection alone cannot see, and still skips
+    // all the shading rays.
+    bool verify_visibility = false;
+};
+
+// What a pixel saw: its primary hit in world space and the value it was
+// shaded with.
+struct TemporalSample {
+    bool hit = false;
+    // Whether the value holds from any viewpoint: always for kNormal, for
+    // purely diffuse materials in kFull. kDepth recomputes the distance.
+    bool reusable = false;
+    int object_id = -1;
+    Vector position;
+    // Faces the camera that traced the sample.
+    Vector normal;
+    Vector value;
+};
+
+// Renders consecutive frames of a static scene, reusing the previous frame
+// where the camera moved little. The previous frame's primary hits are
+// projected into the new camera (nearest wins); a pixel is traced again if
+// no hit lands in it (disocclusion), if the hit's material is view-dependent
+// (specular, reflective or refractive), or if it fails validation: back
+// facing, on a depth edge, or, with verify_visibility, seen differently by
+// its primary ray. Reused pixels keep the world position they were first
+// traced at, so the error of a reused pixel stays under one pixel of shift
+// however many frames it lives.
+//
+// Renders one sample per pixel: anti_aliasing and rasterize_primary are
+// ignored. Changing the scene, the frame size or the render options
+// requires Reset().
+class TemporalRenderer {
+public:
+    explicit TemporalRenderer(TemporalOptions options = {}) : options_{options} {
+    }
+
+    void Reset() {
+        history_.clear();
+    }
+
+    Image Render(const Scene& scene, const CameraOptions& camera_options,
+                 const RenderOptions& render_options) {
+        int width = camera_options.screen_width;
+        int height = camera_options.screen_height;
+        size_t pixels = static_cast<size_t>(width) * height;
+        if (history_.size() != pixels or width != width_ or render_options.mode != mode_) {
+            history_.assign(pixels, TemporalSample{});
+            width_ = width;
+            mode_ = render_options.mode;
+            first_frame_ = true;
+        }
+        Camera camera{&camera_options};
+        std::vector<TemporalSample> current(pixels);
+        std::vector<size_t> retrace;
+        if (first_frame_) {
+            retrace.resize(pixels);
+            for (size_t k = 0; k < pixels; ++k) {
+                retrace[k] = k;
+            }
+        } else {
+            Reproject(camera, camera_options, current, retrace);
+        }
+        auto setup = PrepareTrace(scene, render_options);
+        if (options_.verify_visibility and !first_frame_) {
+            Verify(scene, setup, camera, camera_options, render_options, current, retrace);
+        }
+        Trace(scene, setup, camera, camera_options, render_options, current, retrace);
+        traced_pixels_ = retrace.size();
+        reused_pixels_ = pixels - traced_pixels_;
+        first_frame_ = false;
+
+        Image output{width, height};
+        auto& arena = ThreadArena();
+        ArenaScope scope{arena};
+        PixelBuffer prepixels{width, height, arena};
+        for (int i = 0; i < width; ++i) {
+            for (int j = 0; j < height; ++j) {
+                const auto& sample = current[Index(i, j)];
+                if (sample.hit and mode_ == RenderMode::kDepth) {
+                    auto distance = Length(sample.position - camera_options.look_from);
+                    prepixels[i][j] = Vector{distance, distance, distance};
+                } else {
+                    prepixels[i][j] = sample.value;
+                }
+            }
+        }
+        history_ = std::move(current);
+        ResolveFrame(output, prepixels, scene, camera_options, render_options);
+        return output;
+    }
+
+    // Pixels taken from the previous frame and traced in the last Render.
+    size_t ReusedPixels() const {
+        return reused_pixels_;
+    }
+
+    size_t TracedPixels() const {
+        return traced_pixels_;
+    }
+
+    double ReuseRatio() const {
+        auto total = reused_pixels_ + traced_pixels_;
+        return total == 0 ? 0.0 : static_cast<double>(reused_pixels_) / total;
+    }
+
+private:
+    size_t Index(int i, int j) const {
+        return static_cast<size_t>(j) * width_ + i;
+    }
+
+    // Projects the reusable history into the new camera; pixels without a
+    // valid projection go to retrace.
+    void Reproject(const Camera& camera, const CameraOptions& camera_options,
+                   std::vector<TemporalSample>& current, std::vector<size_t>& retrace) const {
+        int width = camera_options.screen_width;
+        int height = camera_options.screen_height;
+        std::vector<double> depth(current.size(), std::numeric_limits<double>::infinity());
+        std::vector<int> source(current.size(), -1);
+        for (size_t k = 0; k < history_.size(); ++k) {
+            const auto& sample = history_[k];
+            if (!sample.reusable) {
+                continue;
+            }
+            auto view = sample.position - camera_options.look_from;
+            // The surface must still face the camera.
+            if (DotProduct(sample.normal, view) >= 0) {
+                continue;
+            }
+            auto point = camera.ToCameraSpace(sample.position);
+            if (point[2] >= 0) {
+                continue;
+            }
+            auto [x, y] = camera.ToRaster(point);
+            if (!(x >= 0 and x < width and y >= 0 and y < height)) {
+                continue;
+            }
+            auto index = Index(static_cast<int>(x), static_cast<int>(y));
+            double distance = Length(view);
+            if (distance < depth[index]) {
+                depth[index] = distance;
+                source[index] = static_cast<int>(k);
+            }
+        }
+        auto differs = [&](size_t index, int i, int j) {
+            if (i < 0 or i >= width or j < 0 or j >= height) {
+                return false;
+            }
+            auto other = depth[Index(i, j)];
+            return !(std::fabs(depth[index] - other) <=
+                     options_.depth_threshold * std::min(depth[index], other));
+        };
+        for (int j = 0; j < height; ++j) {
+            for (int i = 0; i < width; ++i) {
+                auto index = Index(i, j);
+                if (source[index] < 0 or differs(index, i - 1, j) or differs(index, i + 1, j) or
+                    differs(index, i, j - 1) or differs(index, i, j + 1)) {
+                    retrace.push_back(index);
+                } else {
+                    current[index] = history_[source[index]];
+                }
+            }
+        }
+    }
+
+    Ray PrimaryRay(const Camera& camera, const CameraOptions& camera_options,
+                   size_t index) const {
+        return Ray{camera_options.look_from,
+                   camera.GetDirection(static_cast<int>(index % width_),
+                                       static_cast<int>(index / width_))};
+    }
+
+    // Calls visit(index, ray, hit) with the primary hit of every listed
+    // pixel. The pixels are grouped by frustum-culled tiles, as in
+    // RenderScene, and the tiles run in parallel.
+    template <class Visit>
+    void ForEachPrimaryHit(const Scene& scene, const TraceSetup& setup, const Camera& camera,
+                           const CameraOptions& camera_options, const RenderOptions& render_options,
+                           const std::vector<size_t>& indexes, Visit visit) const {
+        auto tuning = render_options.tuning.value_or(TuningParameters{});
+        int tile_size = tuning.tile_size;
+        auto tiles = SplitIntoTiles(camera_options.screen_width, camera_options.screen_height,
+                                    tile_size);
+        int tiles_x = (camera_options.screen_width + tile_size - 1) / tile_size;
+        std::vector<std::vector<size_t>> pixels(tiles.size());
+        for (auto index : indexes) {
+            int i = static_cast<int>(index % width_);
+            int j = static_cast<int>(index / width_);
+            pixels[(j / tile_size) * tiles_x + i / tile_size].push_back(index);
+        }
+        std::atomic<size_t> next_tile = 0;
+        RunOnThreads(std::min(ThreadCount(tuning.threads), tiles.size()), [&] {
+            auto& thread_arena = ThreadArena();
+            ArenaScope scope{thread_arena};
+            TilePrimitives primitives{scene, thread_arena};
+            for (size_t k = next_tile++; k < tiles.size(); k = next_tile++) {
+                if (pixels[k].empty()) {
+                    continue;
+                }
+                TileFrustum frustum{camera, camera_options.look_from, tiles[k]};
+                bool empty = !frustum.MayContain(setup.bounds);
+                if (!empty) {
+                    CullPrimitives(scene, frustum, primitives);
+                }
+                for (auto index : pixels[k]) {
+                    auto ray = PrimaryRay(camera, camera_options, index);
+                    visit(index, ray,
+                          empty ? std::optional<SurfaceHit>{}
+                                : FindNearestHit(ray, scene, primitives));
+                }
+            }
+        });
+    }
+
+    // Moves reprojected pixels whose primary ray disagrees to retrace.
+    void Verify(const Scene& scene, const TraceSetup& setup, const Camera& camera,
+                const CameraOptions& camera_options,
+                const RenderOptions& render_options, std::vector<TemporalSample>& current,
+                std::vector<size_t>& retrace) const {
+        std::vector<size_t> reused;
+        std::vector<char> listed(current.size());
+        for (auto index : retrace) {
+            listed[index] = true;
+        }
+        for (size_t index = 0; index < current.size(); ++index) {
+            if (!listed[index]) {
+                reused.push_back(index);
+            }
+        }
+        std::vector<char> failed(current.size());
+        ForEachPrimaryHit(scene, setup, camera, camera_options, render_options, reused,
+                          [&](size_t index, const Ray&, const std::optional<SurfaceHit>& hit) {
+            const auto& sample = current[index];
+            double distance = Length(sample.position - camera_options.look_from);
+            failed[index] = !hit or hit->object_id != sample.object_id or
+                            !(std::fabs(hit->intersection.GetDistance() - distance) <=
+                              options_.depth_threshold * distance);
+        });
+        for (auto index : reused) {
+            if (failed[index]) {
+                retrace.push_back(index);
+            }
+        }
+    }
+
+    void Trace(const Scene& scene, const TraceSetup& setup, const Camera& camera,
+               const CameraOptions& camera_options, const RenderOptions& render_options,
+               std::vector<TemporalSample>& current, const std::vector<size_t>& retrace) const {
+        ForEachPrimaryHit(scene, setup, camera, camera_options, render_options, retrace,
+                          [&](size_t index, const Ray& ray, const std::optional<SurfaceHit>& hit) {
+            TemporalSample sample;
+            sample.value = setup.shade(ray, hit, scene, render_options);
+            if (hit) {
+                const auto& inter = hit->intersection;
+                sample.hit = true;
+                sample.object_id = hit->object_id;
+                sample.position = inter.GetPosition();
+                sample.normal = inter.GetNormal();
+                // Ray-facing, whatever side of a triangle was hit.
+                if (DotProduct(sample.normal, ray.GetDirection()) > 0) {
+                    sample.normal = sample.normal * -1.0;
+                }
+                sample.reusable =
+                    mode_ != RenderMode::kFull or
+                    scene.GetMaterials().GetConstants(hit->material_id).purely_diffuse;
+            }
+            current[index] = sample;
+        });
+    }
+
+    TemporalOptions options_;
+    std::vector<TemporalSample> history_;
+    int width_ = 0;
+    RenderMode mode_ = RenderMode::kFull;
+    bool first_frame_ = true;
+    size_t reused_pixels_ = 0;
+    size_t traced_pixels_ = 0;
+};
@@ -1,13 +1,102 @@
 #include <catch.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <string>
 #include <optional>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <iostream>
+#include <random>
+#include <map>
+#include <set>
+#include <filesystem>
+#include <atomic>
+#include <cstdlib>
+#include <limits>
+#include <new>
 
 #include <camera_options.h>
 #include <render_options.h>
 #include <commons.hpp>
 #include <raytracer.h>
+#include <progressive.h>
+#include <distributed.h>
+#include <render_server.h>
+#include <result_cache.h>
+#include <aov.h>
+#include <render_session.h>
+#include <out_of_core.h>
+#include <auto_tune.h>
+#include <scene_generator.h>
+#include <denoise.h>
+#include <sequence.h>
+#include <region.h>
+#include <streaming_output.h>
+
+// Counts heap allocations, for the allocation-free render loop test.
+std::atomic<size_t> allocation_count = 0;
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    if (auto data = std::malloc(size == 0 ? 1 : size)) {
+        return data;
+    }
+    throw std::bad_alloc();
+}
+
+// Catch and the standard library also take the nothrow forms, which must
+// pair with the deletes below.
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++allocation_count;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+// The deletes stay out of line, or GCC takes the inlined free() for a
+// mismatch with operator new.
+__attribute__((noinline)) void operator delete(void* data) noexcept {
+    std::free(data);
+}
+
+__attribute__((noinline)) void operator delete(void* data, size_t) noexcept {
+    std::free(data);
+}
+
+__attribute__((noinline)) void operator delete(void* data, const std::nothrow_t&) noexcept {
+    std::free(data);
+}
+
+// Over-aligned types such as Vector take these; the array forms forward here.
+void* operator new(size_t size, std::align_val_t alignment) {
+    ++allocation_count;
+    auto align = static_cast<size_t>(alignment);
+    size = (std::max<size_t>(size, 1) + align - 1) / align * align;
+    if (auto data = std::aligned_alloc(align, size)) {
+        return data;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    ++allocation_count;
+    auto align = static_cast<size_t>(alignment);
+    size = (std::max<size_t>(size, 1) + align - 1) / align * align;
+    return std::aligned_alloc(align, size);
+}
+
+__attribute__((noinline)) void operator delete(void* data, std::align_val_t) noexcept {
+    std::free(data);
+}
+
+__attribute__((noinline)) void operator delete(void* data, size_t, std::align_val_t) noexcept {
+    std::free(data);
+}
+
+__attribute__((noinline)) void operator delete(void* data, std::align_val_t,
+                                               const std::nothrow_t&) noexcept {
+    std::free(data);
+}
 
 int artifact_index = 0;
 #ifdef SHAD_ARTIFACTS_DIR
@@ -101,3 +190,1442 @@ TEST_CASE("Deer", "[raytracer]") {
     RenderOptions render_opts{1};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, render_opts, PATH + "deer.png");
 }
+
+TEST_CASE("Progressive", "[raytracer]") {
+    auto camera_opts = BoxCamera(160, 120);
+    RenderOptions render_opts{4};
+    const auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+
+    int previews = 0;
+    ProgressiveOptions progressive_opts;
+    progressive_opts.preview_interval = std::chrono::milliseconds{0};
+    progressive_opts.on_preview = [&](const Image& preview) {
+        REQUIRE(preview.Width() == camera_opts.screen_width);
+        ++previews;
+    };
+    auto image = RenderProgressive(scene, camera_opts, render_opts, progressive_opts);
+    REQUIRE(image);
+    REQUIRE(previews > 1);
+    RequireEqual(*image, RenderScene(scene, camera_opts, render_opts));
+
+    // The last pass refines the edges as RenderScene does.
+    auto smooth_opts = render_opts;
+    smooth_opts.anti_aliasing.max_samples = 9;
+    RequireEqual(*RenderProgressive(scene, camera_opts, smooth_opts, progressive_opts),
+                 RenderScene(scene, camera_opts, smooth_opts));
+
+    std::stop_source stop;
+    previews = 0;
+    progressive_opts.on_preview = [&](const Image&) {
+        ++previews;
+        stop.request_stop();
+    };
+    REQUIRE(!RenderProgressive(scene, camera_opts, render_opts, progressive_opts,
+                               stop.get_token()));
+    REQUIRE(previews == 1);
+}
+
+TEST_CASE("Adaptive anti-aliasing", "[raytracer]") {
+    auto camera_opts = BoxCamera(160, 120);
+    RenderOptions render_opts{4};
+    const auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+
+    RenderStatistics statistics;
+    auto aliased = RenderScene(scene, camera_opts, render_opts, &statistics);
+    REQUIRE(statistics.samples_per_pixel == 1.0);
+
+    render_opts.anti_aliasing.max_samples = 16;
+    auto smooth = RenderScene(scene, camera_opts, render_opts, &statistics);
+    REQUIRE(statistics.samples_per_pixel > 1.0);
+    REQUIRE(statistics.samples_per_pixel < 8.0);
+
+    int changed = 0;
+    for (int y = 0; y < smooth.Height(); ++y) {
+        for (int x = 0; x < smooth.Width(); ++x) {
+            changed += !(smooth.GetPixel(y, x) == aliased.GetPixel(y, x));
+        }
+    }
+    REQUIRE(changed > 0);
+    REQUIRE(changed < smooth.Width() * smooth.Height() / 2);
+}
+
+TEST_CASE("Distributed tiles", "[raytracer]") {
+    auto camera_opts = BoxCamera(160, 120);
+    RenderOptions render_opts{4};
+    const std::string filename = kBasePath + "tests/box/cube.obj";
+    auto reference = Render(filename, camera_opts, render_opts);
+
+    DistributedOptions options;
+    options.workers = 3;
+    options.tile_size = 24;
+    RequireEqual(RenderDistributed(filename, camera_opts, render_opts, options), reference);
+
+    int assigned = 0;
+    int killed = 0;
+    options.on_tile_assigned = [&](pid_t pid, const Tile&) {
+        if (++assigned % 5 == 0 and killed < 2) {
+            kill(pid, SIGKILL);
+            ++killed;
+        }
+    };
+    RequireEqual(RenderDistributed(filename, camera_opts, render_opts, options), reference);
+    REQUIRE(killed == 2);
+
+    // Workers refine the same pixels as a whole-frame render.
+    auto smooth_opts = render_opts;
+    smooth_opts.anti_aliasing.max_samples = 9;
+    options.on_tile_assigned = nullptr;
+    RequireEqual(RenderDistributed(filename, camera_opts, smooth_opts, options),
+                 Render(filename, camera_opts, smooth_opts));
+
+    options.max_restarts = 0;
+    options.on_tile_assigned = [](pid_t pid, const Tile&) { kill(pid, SIGKILL); };
+    REQUIRE_THROWS(RenderDistributed(filename, camera_opts, render_opts, options));
+}
+
+TEST_CASE("Render server", "[raytracer]") {
+    const std::string socket_path = "/tmp/raytracer-test-" + std::to_string(getpid()) + ".sock";
+    RenderServer server{socket_path, 64 << 20};
+    std::thread serving{[&server] { server.Serve(); }};
+
+    auto camera_opts = BoxCamera(64, 48);
+    RenderJob job{kBasePath + "tests/box/cube.obj", camera_opts, RenderOptions{4}};
+    {
+        RenderClient client{socket_path};
+        auto first = client.Submit(job);
+        job.render_options.mode = RenderMode::kNormal;
+        auto second = client.Submit(job);
+
+        const std::string png_path = socket_path + ".png";
+        std::ofstream{png_path, std::ios::binary}.write(reinterpret_cast<const char*>(second.data()),
+                                                         second.size());
+        RequireEqual(Image{png_path}, Render(job.scene_path, camera_opts, job.render_options));
+
+        // Denoise options travel with the job.
+        job.render_options.mode = RenderMode::kFull;
+        job.render_options.tone_mapping.tone_operator = ToneOperator::kReinhard;
+        job.render_options.denoise = DenoiseOptions{2, 0.2, 32.0, 0.2, 0.5};
+        auto third = client.Submit(job);
+        std::ofstream{png_path, std::ios::binary}.write(reinterpret_cast<const char*>(third.data()),
+                                                         third.size());
+        RequireEqual(Image{png_path}, Render(job.scene_path, camera_opts, job.render_options));
+        std::remove(png_path.c_str());
+        job.render_options.denoise.reset();
+        job.render_options.mode = RenderMode::kNormal;
+        job.render_options.tone_mapping.tone_operator = ToneOperator::kReinhardExtended;
+
+        job.scene_path = kBasePath + "tests/missing.obj";
+        REQUIRE_THROWS(client.Submit(job));
+        // Enums out of range are rejected, and the connection stays usable.
+        job.render_options.mode = static_cast<RenderMode>(7);
+        REQUIRE_THROWS(client.Submit(job));
+        job.render_options.mode = RenderMode::kNormal;
+        job.render_options.tone_mapping.tone_operator = static_cast<ToneOperator>(-1);
+        REQUIRE_THROWS(client.Submit(job));
+        job.render_options.tone_mapping.tone_operator = ToneOperator::kReinhardExtended;
+        // So are sizes, depths and sample counts out of range.
+        job.scene_path = kBasePath + "tests/box/cube.obj";
+        job.camera_options.screen_width = 0;
+        REQUIRE_THROWS(client.Submit(job));
+        job.camera_options = camera_opts;
+        job.render_options.depth = -1;
+        REQUIRE_THROWS(client.Submit(job));
+        job.render_options.depth = 4;
+        job.render_options.anti_aliasing.max_samples = -1;
+        REQUIRE_THROWS(client.Submit(job));
+        job.render_options.anti_aliasing.max_samples = 1;
+        client.Submit(job);
+    }
+    {
+        // An oversized scene path is refused without reading it.
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, socket_path.c_str());
+        REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+        auto type = RequestType::kRender;
+        RenderJobHeader header{};
+        header.path_length = std::numeric_limits<uint32_t>::max();
+        REQUIRE(WriteAll(fd, &type, sizeof(type)));
+        REQUIRE(WriteAll(fd, &header, sizeof(header)));
+        RenderResponseHeader response;
+        REQUIRE(ReadAll(fd, &response, sizeof(response)));
+        REQUIRE(response.status == 1);
+        std::string message(response.size, '\0');
+        REQUIRE(ReadAll(fd, message.data(), message.size()));
+        REQUIRE(message.starts_with("Scene path is too long"));
+        char byte;
+        REQUIRE(read(fd, &byte, 1) == 0);
+        close(fd);
+    }
+    {
+        RenderClient client{socket_path};
+        client.Shutdown();
+    }
+    serving.join();
+    REQUIRE(server.JobsDone() == 4);
+    REQUIRE(server.GetCache().Misses() == 1);
+    REQUIRE(server.GetCache().Hits() == 3);
+
+    // Stop() ends Serve() while a client is connected but idle.
+    RenderServer stopping{socket_path, 64 << 20};
+    std::thread stopped_serving{[&stopping] { stopping.Serve(); }};
+    RenderClient idle{socket_path};
+    idle.Submit(job);
+    stopping.Stop();
+    stopped_serving.join();
+}
+
+TEST_CASE("Scene cache", "[raytracer]") {
+    auto directory = std::filesystem::temp_directory_path() /
+                     ("raytracer-scenes-" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto obj = (directory / "cube.obj").string();
+    auto mtl = directory / "CornellBox-Sphere.mtl";
+    std::filesystem::copy_file(kBasePath + "tests/box/cube.obj", obj);
+    std::filesystem::copy_file(kBasePath + "tests/box/CornellBox-Sphere.mtl", mtl);
+
+    SceneCache cache{64 << 20};
+    auto first = cache.Get(obj);
+    REQUIRE(cache.Get(obj) == first);
+    REQUIRE(cache.Hits() == 1);
+
+    // Editing only the material library reloads the scene.
+    {
+        std::ofstream file{mtl, std::ios::app};
+        file << "\nnewmtl extra\nKd 1 0 0\n";
+    }
+    std::filesystem::last_write_time(mtl, std::filesystem::last_write_time(mtl) +
+                                              std::chrono::seconds(1));
+    auto second = cache.Get(obj);
+    REQUIRE(second != first);
+    REQUIRE(second->GetMaterials().Size() == first->GetMaterials().Size() + 1);
+    REQUIRE(cache.Misses() == 2);
+    REQUIRE(cache.Size() == 1);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Render server throughput", "[.][benchmark]") {
+    using Clock = std::chrono::steady_clock;
+    const int jobs = 20;
+    // Small frames, so that per-job setup rather than tracing dominates.
+    CameraOptions camera_opts(16, 16);
+    camera_opts.look_from = std::array<double, 3>{100, 200, 150};
+    camera_opts.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    RenderJob job{kBasePath + "tests/deer/CERF_Free.obj", camera_opts,
+                  RenderOptions{1, RenderMode::kDepth}};
+
+    // Cold: one process per frame, each parsing the scene again.
+    auto start = Clock::now();
+    for (int k = 0; k < jobs; ++k) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            Render(job.scene_path, job.camera_options, job.render_options).EncodePng();
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    double cold = jobs / std::chrono::duration<double>(Clock::now() - start).count();
+
+    const std::string socket_path = "/tmp/raytracer-bench-" + std::to_string(getpid()) + ".sock";
+    RenderServer server{socket_path, 256 << 20};
+    std::thread serving{[&server] { server.Serve(); }};
+    double warm;
+    {
+        RenderClient client{socket_path};
+        client.Submit(job);
+        start = Clock::now();
+        for (int k = 0; k < jobs; ++k) {
+            client.Submit(job);
+        }
+        warm = jobs / std::chrono::duration<double>(Clock::now() - start).count();
+        client.Shutdown();
+    }
+    serving.join();
+    std::cout << "cold runs: " << cold << " jobs/s, render server: " << warm << " jobs/s"
+              << std::endl;
+}
+
+TEST_CASE("Result cache", "[raytracer]") {
+    auto directory = std::filesystem::temp_directory_path() /
+                     ("raytracer-cache-" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    const std::string filename = kBasePath + "tests/box/cube.obj";
+    auto camera_opts = BoxCamera(64, 48);
+    RenderOptions render_opts{4};
+
+    ResultCache cache{directory, 1 << 20};
+    auto first = cache.GetOrRender(filename, camera_opts, render_opts);
+    auto second = cache.GetOrRender(filename, camera_opts, render_opts);
+    REQUIRE(cache.Misses() == 1);
+    REQUIRE(cache.Hits() == 1);
+    RequireEqual(second, first);
+
+    camera_opts.fov = M_PI / 4;
+    cache.GetOrRender(filename, camera_opts, render_opts);
+    REQUIRE(cache.Misses() == 2);
+    REQUIRE(ComputeResultKey(filename, camera_opts, render_opts) !=
+            ComputeResultKey(filename, camera_opts, RenderOptions{3}));
+
+    ResultCache small{directory, 1};
+    small.GetOrRender(filename, camera_opts, RenderOptions{1, RenderMode::kNormal});
+    REQUIRE(small.Misses() == 1);
+    int entries = 0;
+    for (const auto& entry : std::filesystem::directory_iterator{directory}) {
+        entries += entry.path().extension() == ".png";
+    }
+    REQUIRE(entries == 1);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Single-pass AOVs", "[raytracer]") {
+    auto camera_opts = BoxCamera();
+    const auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+
+    auto images = RenderAovs(scene, camera_opts, 4,
+                             {Aov::kDepth, Aov::kNormal, Aov::kObjectId, Aov::kMaterialId,
+                              Aov::kAlbedo, Aov::kColor});
+    REQUIRE(images.size() == 6);
+    RequireEqual(images.at(Aov::kDepth),
+                 RenderScene(scene, camera_opts, RenderOptions{4, RenderMode::kDepth}));
+    RequireEqual(images.at(Aov::kNormal),
+                 RenderScene(scene, camera_opts, RenderOptions{4, RenderMode::kNormal}));
+    RequireEqual(images.at(Aov::kColor), RenderScene(scene, camera_opts, RenderOptions{4}));
+    RenderOptions aces_opts{4};
+    aces_opts.tone_mapping = ToneMappingOptions{ToneOperator::kAces, 1.5};
+    RequireEqual(RenderAovs(scene, camera_opts, 4, {Aov::kColor}, aces_opts.tone_mapping)
+                     .at(Aov::kColor),
+                 RenderScene(scene, camera_opts, aces_opts));
+
+    // The back wall is a single material made of two triangles.
+    const auto& object_ids = images.at(Aov::kObjectId);
+    const auto& material_ids = images.at(Aov::kMaterialId);
+    REQUIRE(material_ids.GetPixel(10, 40) == material_ids.GetPixel(10, 55));
+    REQUIRE(!(object_ids.GetPixel(0, 0) == RGB{0, 0, 0}));
+
+    auto prefix = (std::filesystem::temp_directory_path() /
+                   ("raytracer-aov-" + std::to_string(getpid())))
+                      .string();
+    WriteAovs(images, prefix);
+    RequireEqual(Image{prefix + "_albedo.png"}, images.at(Aov::kAlbedo));
+    for (const auto& [aov, image] : images) {
+        std::filesystem::remove(prefix + "_" + AovName(aov) + ".png");
+    }
+}
+
+TEST_CASE("Render session re-shading", "[raytracer]") {
+    auto camera_opts = BoxCamera();
+    RenderSession session{ReadScene(kBasePath + "tests/box/cube.obj"), camera_opts, 4};
+    const size_t pixels =
+        static_cast<size_t>(camera_opts.screen_width) * camera_opts.screen_height;
+
+    RequireEqual(session.Render(), RenderScene(session.GetScene(), camera_opts, RenderOptions{4}));
+    REQUIRE(session.TracedPixels() > 0);
+
+    session.GetScene().GetMaterial("backWall").diffuse_color = Vector{0.9, 0.1, 0.1};
+    session.GetScene().GetMaterial("floor").specular_exponent = 64;
+    session.Invalidate(SceneChange::kMaterials);
+    auto reshaded = session.Render();
+    // Only the mirror and glass spheres need tracing again.
+    REQUIRE(session.TracedPixels() > 0);
+    REQUIRE(session.TracedPixels() < pixels / 4);
+    RequireEqual(reshaded, RenderScene(session.GetScene(), camera_opts, RenderOptions{4}));
+
+    session.GetScene().GetLight(0).intensity = Vector{0.3, 0.3, 0.6};
+    session.Invalidate(SceneChange::kLightIntensities);
+    RequireEqual(session.Render(), RenderScene(session.GetScene(), camera_opts, RenderOptions{4}));
+
+    session.GetCameraOptions().look_from = Vector{0.2, 0.7, 1.75};
+    session.Invalidate(SceneChange::kCamera);
+    RequireEqual(session.Render(), RenderScene(session.GetScene(), session.GetCameraOptions(),
+                                               RenderOptions{4}));
+
+    RenderOptions aces_opts{4};
+    aces_opts.tone_mapping = ToneMappingOptions{ToneOperator::kAces, 1.5};
+    RenderSession aces_session{session.GetScene(), camera_opts, 4, aces_opts.tone_mapping};
+    RequireEqual(aces_session.Render(), RenderScene(session.GetScene(), camera_opts, aces_opts));
+}
+
+TEST_CASE("Rasterized primary visibility", "[raytracer]") {
+    RenderOptions render_opts{4};
+    render_opts.rasterize_primary = true;
+    auto camera_opts = BoxCamera(640, 480);
+    CheckImage("box/cube.obj", "box/cube.png", camera_opts, render_opts);
+
+    CameraOptions classic_opts(500, 500);
+    classic_opts.look_from = std::array<double, 3>{-0.5, 1.5, 0.98};
+    classic_opts.look_to = std::array<double, 3>{0.0, 1.0, 0.0};
+    CheckImage("classic_box/CornellBox-Original.obj", "classic_box/first.png", classic_opts,
+               render_opts);
+
+    CameraOptions triangle_opts(640, 480);
+    triangle_opts.look_from = std::array<double, 3>{0.0, 2.0, 0.0};
+    triangle_opts.look_to = std::array<double, 3>{0.0, 0.0, 0.0};
+    CheckImage("triangle/scene.obj", "triangle/scene.png", triangle_opts, render_opts);
+
+    CameraOptions deer_opts(500, 500);
+    deer_opts.look_from = std::array<double, 3>{100, 200, 150};
+    deer_opts.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    RenderOptions deer_render{1};
+    deer_render.rasterize_primary = true;
+    CheckImage("deer/CERF_Free.obj", "deer/result.png", deer_opts, deer_render);
+
+    // The camera sits inside the box, so walls cross the near plane.
+    auto scene = ReadScene(kBasePath + "tests/distorted_box/CornellBox-Original.obj");
+    CameraOptions inside_opts(120, 120);
+    inside_opts.look_from = std::array<double, 3>{-0.5, 1.5, 0.5};
+    inside_opts.look_to = std::array<double, 3>{0.0, 1.0, 0.0};
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions traced{4, mode};
+        RenderOptions rasterized{4, mode};
+        rasterized.rasterize_primary = true;
+        Compare(RenderScene(scene, inside_opts, rasterized),
+                RenderScene(scene, inside_opts, traced));
+    }
+}
+
+TEST_CASE("Rasterized primary visibility speed", "[.][benchmark]") {
+    auto scene = ReadScene(kBasePath + "tests/deer/CERF_Free.obj");
+    CameraOptions camera_opts(500, 500);
+    camera_opts.look_from = std::array<double, 3>{100, 200, 150};
+    camera_opts.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    RenderOptions traced{1};
+    RenderOptions rasterized{1};
+    rasterized.rasterize_primary = true;
+
+    auto start = std::chrono::steady_clock::now();
+    RenderScene(scene, camera_opts, traced);
+    auto middle = std::chrono::steady_clock::now();
+    RenderScene(scene, camera_opts, rasterized);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> traced_time = middle - start, rasterized_time = end - middle;
+    WARN("traced " << traced_time.count() << "s, rasterized " << rasterized_time.count() << "s");
+}
+
+TEST_CASE("Tile frustum culling", "[raytracer]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    CameraOptions camera_opts(96, 72, M_PI / 3);
+    // Half of the view looks past the box.
+    camera_opts.look_from = std::array<double, 3>{0.6, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{2.0, 0.7, 0.0};
+    Camera camera{&camera_opts};
+    auto bounds = ComputeSceneBounds(scene);
+
+    size_t empty_tiles = 0;
+    ArenaScope scope{ThreadArena()};
+    TilePrimitives primitives{scene, ThreadArena()};
+    for (const auto& tile : SplitIntoTiles(96, 72, kFrustumTileSize)) {
+        TileFrustum frustum{camera, camera_opts.look_from, tile};
+        if (!frustum.MayContain(bounds)) {
+            ++empty_tiles;
+            continue;
+        }
+        CullPrimitives(scene, frustum, primitives);
+        REQUIRE(primitives.triangles.size() <= scene.GetObjects().size());
+        for (int i = tile.x; i < tile.x + tile.width; ++i) {
+            for (int j = tile.y; j < tile.y + tile.height; ++j) {
+                Ray ray{camera_opts.look_from, camera.GetDirection(i, j)};
+                auto culled = FindNearestHit(ray, scene, primitives);
+                auto full = FindNearestHit(ray, scene);
+                REQUIRE(culled.has_value() == full.has_value());
+                if (full) {
+                    REQUIRE(culled.value().object_id == full.value().object_id);
+                }
+            }
+        }
+    }
+    REQUIRE(empty_tiles > 0);
+    REQUIRE(empty_tiles < SplitIntoTiles(96, 72, kFrustumTileSize).size());
+
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions render_opts{4, mode};
+        Image reference{camera_opts.screen_width, camera_opts.screen_height};
+        std::vector<std::vector<Vector>> prepixels(96, std::vector<Vector>(72));
+        for (int i = 0; i < 96; ++i) {
+            for (int j = 0; j < 72; ++j) {
+                Ray ray{camera_opts.look_from, camera.GetDirection(i, j)};
+                prepixels[i][j] = TracePixel(ray, scene, render_opts);
+            }
+        }
+        ResolvePixels(reference, prepixels, mode);
+        RequireEqual(RenderScene(scene, camera_opts, render_opts), reference);
+    }
+}
+
+TEST_CASE("Arena trace loop", "[raytracer]") {
+    Arena arena{1 << 12};
+    auto mark = arena.GetMark();
+    auto first = arena.AllocateArray<double>(100);
+    arena.AllocateArray<int>(2000);
+    auto capacity = arena.Capacity();
+    arena.Rewind(mark);
+    REQUIRE(arena.AllocateArray<double>(100) == first);
+    arena.AllocateArray<int>(2000);
+    REQUIRE(arena.Capacity() == capacity);
+
+    // The counter must see over-aligned allocations too.
+    auto counted = allocation_count.load();
+    std::vector<Vector> vectors(4);
+    REQUIRE(allocation_count.load() == counted + 1);
+
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto camera_opts = BoxCamera();
+    Camera camera{&camera_opts};
+    auto bounds = ComputeSceneBounds(scene);
+    auto tiles = SplitIntoTiles(96, 72, kFrustumTileSize);
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions render_opts{4, mode};
+        auto shade = SelectKernel(scene, render_opts);
+        ArenaScope scope{arena};
+        PixelBuffer prepixels{96, 72, arena};
+        TilePrimitives primitives{scene, arena};
+        auto trace = [&] {
+            for (const auto& tile : tiles) {
+                TraceTile(scene, bounds, camera, camera_opts.look_from, tile, render_opts, shade,
+                          primitives, prepixels);
+            }
+        };
+        trace();
+        auto before = allocation_count.load();
+        trace();
+        REQUIRE(allocation_count.load() == before);
+    }
+}
+
+TEST_CASE("Specialized render kernels", "[raytracer]") {
+    auto box = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto features = ScanShadingFeatures(box);
+    REQUIRE(features.reflection);
+    REQUIRE(features.refraction);
+    REQUIRE(features.shadows);
+    auto classic = ReadScene(kBasePath + "tests/classic_box/CornellBox-Original.obj");
+    REQUIRE(ScanShadingFeatures(classic).reflection);
+    REQUIRE_FALSE(ScanShadingFeatures(classic).refraction);
+    auto plain = ReadScene(kBasePath + "tests/shading_parts/scene.obj");
+    REQUIRE_FALSE(ScanShadingFeatures(plain).reflection);
+    REQUIRE_FALSE(ScanShadingFeatures(plain).refraction);
+
+    REQUIRE(SelectKernel(box, RenderOptions{4}) != SelectKernel(classic, RenderOptions{4}));
+    REQUIRE(SelectKernel(box, RenderOptions{kMaxKernelDepth + 1}) == &ShadeHit);
+    REQUIRE(SelectKernel(plain, RenderOptions{2}) == SelectKernel(plain, RenderOptions{7}));
+
+    auto camera_opts = BoxCamera(64, 48);
+    Camera camera{&camera_opts};
+    for (const Scene* scene : {&box, &classic, &plain}) {
+        for (int depth : {0, 1, 3, 6, kMaxKernelDepth + 2}) {
+            for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+                RenderOptions render_opts{depth, mode};
+                auto kernel = SelectKernel(*scene, render_opts);
+                for (int i = 0; i < 64; i += 3) {
+                    for (int j = 0; j < 48; j += 3) {
+                        Ray ray{camera_opts.look_from, camera.GetDirection(i, j)};
+                        auto hit = FindNearestHit(ray, *scene);
+                        auto expected = ShadeHit(ray, hit, *scene, render_opts);
+                        auto value = kernel(ray, hit, *scene, render_opts);
+                        for (int k = 0; k < 3; ++k) {
+                            REQUIRE(value[k] == expected[k]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Out-of-core geometry", "[raytracer]") {
+    auto directory = std::filesystem::temp_directory_path() /
+                     ("raytracer_ooc_" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto obj = kBasePath + "tests/deer/CERF_Free.obj";
+    OutOfCoreOptions options;
+    options.cache_path = (directory / "deer.geometry").string();
+    options.cluster_size = 32;
+    // Room for a handful of clusters only.
+    options.memory_budget = 4 * 32 * (sizeof(Object) + sizeof(int));
+
+    CameraOptions camera_opts(160, 160);
+    camera_opts.look_from = std::array<double, 3>{100, 200, 150};
+    camera_opts.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    auto in_memory = ReadScene(obj);
+    {
+        OutOfCoreScene scene{obj, options};
+        REQUIRE_FALSE(scene.CacheReused());
+        REQUIRE(scene.TriangleCount() == in_memory.GetObjects().size());
+        REQUIRE(scene.ClusterCount() * 32 >= scene.TriangleCount());
+
+        for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+            RenderStatistics statistics;
+            auto image = RenderOutOfCore(scene, camera_opts, RenderOptions{1, mode}, &statistics);
+            Compare(image, RenderScene(in_memory, camera_opts, RenderOptions{1, mode}));
+            REQUIRE(statistics.cluster_page_ins > scene.ClusterCount());
+            REQUIRE(statistics.cluster_lookups > statistics.cluster_page_ins);
+            REQUIRE(statistics.cluster_hit_rate > 0.0);
+            REQUIRE(statistics.cluster_hit_rate < 1.0);
+            REQUIRE(scene.GetCache().ResidentBytes() <= options.memory_budget);
+        }
+    }
+    {
+        OutOfCoreScene scene{obj, options};
+        REQUIRE(scene.CacheReused());
+        Compare(RenderOutOfCore(scene, camera_opts, RenderOptions{1}),
+                RenderScene(in_memory, camera_opts, RenderOptions{1}));
+    }
+
+    // Spheres, lights and reflections come from the resident part.
+    auto box = kBasePath + "tests/box/cube.obj";
+    options.cache_path = (directory / "box.geometry").string();
+    options.cluster_size = 2;
+    OutOfCoreScene scene{box, options};
+    auto box_opts = BoxCamera();
+    Compare(RenderOutOfCore(scene, box_opts, RenderOptions{4}),
+            RenderScene(ReadScene(box), box_opts, RenderOptions{4}));
+    RenderOptions smooth_opts{4};
+    smooth_opts.anti_aliasing.max_samples = 9;
+    RenderStatistics smooth_statistics;
+    Compare(RenderOutOfCore(scene, box_opts, smooth_opts, &smooth_statistics),
+            RenderScene(ReadScene(box), box_opts, smooth_opts));
+    REQUIRE(smooth_statistics.samples_per_pixel > 1.0);
+
+    // Editing the material library shifts the material IDs the clusters
+    // store, so the cache is rebuilt.
+    auto copy = directory / "cube.obj";
+    std::filesystem::copy_file(box, copy);
+    std::filesystem::copy_file(kBasePath + "tests/box/CornellBox-Sphere.mtl",
+                               directory / "CornellBox-Sphere.mtl");
+    REQUIRE_FALSE(OutOfCoreScene(copy.string(), options).CacheReused());
+    REQUIRE(OutOfCoreScene(copy.string(), options).CacheReused());
+    {
+        std::ofstream mtl{directory / "CornellBox-Sphere.mtl", std::ios::app};
+        mtl << "\nnewmtl aaaFirst\nKd 1 0 0\n";
+    }
+    OutOfCoreScene edited{copy.string(), options};
+    REQUIRE_FALSE(edited.CacheReused());
+    Compare(RenderOutOfCore(edited, box_opts, RenderOptions{4}),
+            RenderScene(ReadScene(copy.string()), box_opts, RenderOptions{4}));
+
+    // Primitives need a material.
+    auto bare = (directory / "bare.obj").string();
+    std::ofstream{bare} << "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n";
+    REQUIRE_THROWS(OutOfCoreScene{bare, options});
+    std::filesystem::remove_all(directory);
+}
+
+namespace {
+
+// The double-precision curve ToneMapping used before the float pipeline.
+Image LegacyToneMapping(const std::vector<std::vector<Vector>>& prepixels) {
+    int width = prepixels.size(), height = prepixels[0].size();
+    Image output{width, height};
+    double max = -1;
+    for (const auto& column : prepixels) {
+        for (const auto& pixel : column) {
+            max = std::max({max, pixel[0], pixel[1], pixel[2]});
+        }
+    }
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            int levels[3];
+            for (int k = 0; k < 3; ++k) {
+                double x = prepixels[i][j][k];
+                levels[k] = round(255 * pow(x * (1 + x / max / max) / (1 + x), 1 / 2.2));
+            }
+            output.SetPixel(RGB{levels[0], levels[1], levels[2]}, j, i);
+        }
+    }
+    return output;
+}
+
+std::vector<std::vector<Vector>> RandomHdrPixels(int width, int height) {
+    std::mt19937 generator{7};
+    std::exponential_distribution<double> distribution{2.0};
+    std::vector<std::vector<Vector>> output(width, std::vector<Vector>(height));
+    for (auto& column : output) {
+        for (auto& pixel : column) {
+            pixel = Vector{distribution(generator), distribution(generator),
+                           distribution(generator)};
+        }
+    }
+    return output;
+}
+
+// The dispatched (SIMD where available) kernel agrees with the scalar one.
+template <ToneOperator Op>
+void RequireKernelsAgree(const HdrBuffer& hdr) {
+    auto parameters = MakeToneParameters(ToneMappingOptions{Op, 1.0}, MaxChannel(hdr));
+    int count = hdr.Width() * 3;
+    std::vector<int> scalar(count), dispatched(count);
+    for (int y = 0; y < hdr.Height(); ++y) {
+        ToneMapBlockScalar<Op>(hdr.GetRow(y), scalar.data(), count, parameters);
+        ToneMapBlock<Op>(hdr.GetRow(y), dispatched.data(), count, parameters);
+        for (int k = 0; k < count; ++k) {
+            REQUIRE(std::abs(scalar[k] - dispatched[k]) <= 1);
+        }
+    }
+}
+
+}  // namespace
+
+TEST_CASE("Tone mapping", "[raytracer]") {
+    for (int k = 0; k <= 100000; ++k) {
+        float x = 1.1f * k / 100000;
+        int exact = std::round(255 * std::pow(std::min(x, 1.0f), 1 / 2.2));
+        REQUIRE(std::abs(EncodeGamma(x) - exact) <= 1);
+    }
+    // Every octave of the table, near and between the segment ends.
+    for (float x = kGammaMin; x < 1.0f; x *= 1.0137f) {
+        REQUIRE(std::abs(GammaLevel(x) - 255 * std::pow(x, 1 / 2.2)) <= 0.003);
+    }
+    REQUIRE(EncodeGamma(0.0f) == 0);
+    REQUIRE(EncodeGamma(-1.0f) == 0);
+    REQUIRE(EncodeGamma(1.0f) == 255);
+    REQUIRE(EncodeGamma(std::numeric_limits<float>::quiet_NaN()) == 0);
+
+    // Width not a multiple of the block, to cover the scalar tails.
+    int width = 101, height = 67;
+    auto prepixels = RandomHdrPixels(width, height);
+    prepixels[3][5] = Vector{0.0, 1e-9, 40.0};
+    Image image{width, height};
+    ToneMapping(image, prepixels);
+    auto legacy = LegacyToneMapping(prepixels);
+    size_t differing = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            auto a = image.GetPixel(y, x), b = legacy.GetPixel(y, x);
+            REQUIRE(std::abs(a.r - b.r) <= 1);
+            REQUIRE(std::abs(a.g - b.g) <= 1);
+            REQUIRE(std::abs(a.b - b.b) <= 1);
+            differing += !(a == b);
+        }
+    }
+    REQUIRE(differing * 100 < static_cast<size_t>(width * height));
+
+    Arena arena;
+    HdrBuffer hdr{width, height, arena};
+    GatherHdr(prepixels, hdr);
+    REQUIRE(MaxChannel(hdr) == 40.0f);
+    REQUIRE(MaxChannel(hdr, 3) == 40.0f);
+    REQUIRE(MaxChannel(HdrBuffer{width, 0, arena}) == -1.0f);
+    RequireKernelsAgree<ToneOperator::kReinhardExtended>(hdr);
+    RequireKernelsAgree<ToneOperator::kReinhard>(hdr);
+    RequireKernelsAgree<ToneOperator::kAces>(hdr);
+    RequireKernelsAgree<ToneOperator::kClamp>(hdr);
+    for (auto op : {ToneOperator::kReinhardExtended, ToneOperator::kReinhard, ToneOperator::kAces,
+                    ToneOperator::kClamp}) {
+        // More exposure never darkens a pixel.
+        Image dark{width, height}, bright{width, height};
+        ToneMap(hdr, dark, ToneMappingOptions{op, 0.5});
+        ToneMap(hdr, bright, ToneMappingOptions{op, 2.0});
+        size_t brighter = 0;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                auto a = dark.GetPixel(y, x), b = bright.GetPixel(y, x);
+                REQUIRE(a.r <= b.r);
+                REQUIRE(a.g <= b.g);
+                REQUIRE(a.b <= b.b);
+                brighter += a.r < b.r;
+            }
+        }
+        REQUIRE(brighter > 0);
+    }
+}
+
+TEST_CASE("Tone mapping speed", "[.][benchmark]") {
+    auto prepixels = RandomHdrPixels(3840, 2160);
+    Image image{3840, 2160};
+    auto time = [](auto&& body) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto legacy = time([&] { LegacyToneMapping(prepixels); });
+    auto current = time([&] { ToneMapping(image, prepixels); });
+    Arena arena;
+    HdrBuffer hdr{3840, 2160, arena};
+    GatherHdr(prepixels, hdr);
+    auto from_hdr = time([&] { ToneMap(hdr, image); });
+    std::cout << "legacy " << legacy << "s, ToneMapping " << current << "s, ToneMap on floats "
+              << from_hdr << "s\n";
+}
+
+TEST_CASE("Timeline", "[raytracer]") {
+    auto& timeline = Timeline::Get();
+    timeline.Clear();
+    auto camera_opts = BoxCamera();
+    Render(kBasePath + "tests/box/cube.obj", camera_opts, RenderOptions{4});
+    REQUIRE(timeline.EventCount() == 0);
+
+    timeline.Enable();
+    auto path = std::filesystem::temp_directory_path() / "raytracer_timeline.png";
+    Render(kBasePath + "tests/box/cube.obj", camera_opts, RenderOptions{4}).Write(path.string());
+    // Threads recording at the same time get rows of their own.
+    std::atomic<int> recorded = 0;
+    std::vector<std::thread> threads;
+    for (int k = 0; k < 4; ++k) {
+        threads.emplace_back([&recorded] {
+            for (int k = 0; k < 100; ++k) {
+                TIMELINE_SCOPE("Worker", "test", k);
+            }
+            // Keep every thread alive until all of them have recorded.
+            ++recorded;
+            while (recorded < 4) {
+                std::this_thread::yield();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    timeline.Disable();
+    std::filesystem::remove(path);
+
+    std::map<std::string, size_t> counts;
+    std::set<int> worker_threads;
+    timeline.ForEachEvent([&](int thread_id, const TimelineEvent& event) {
+        ++counts[event.name];
+        REQUIRE(event.duration_ns >= 0);
+        if (event.name == std::string{"Worker"}) {
+            worker_threads.insert(thread_id);
+        }
+    });
+    REQUIRE(counts["ReadScene"] == 1);
+    REQUIRE(counts["ReadMaterials"] == 1);
+    REQUIRE(counts["Setup"] == 1);
+    REQUIRE(counts["TraceTile"] == SplitIntoTiles(96, 72, kFrustumTileSize).size());
+    REQUIRE(counts["ToneMapping"] == 1);
+    REQUIRE(counts["Image::Write"] == 1);
+    REQUIRE(counts["Worker"] == 400);
+    REQUIRE(worker_threads.size() == 4);
+
+    auto json = timeline.ToChromeTrace();
+    REQUIRE(json.starts_with("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+    REQUIRE(json.find("\"name\":\"TraceTile\",\"cat\":\"trace\",\"ph\":\"X\"") != std::string::npos);
+    size_t events = 0;
+    for (auto at = json.find("\"ph\":\"X\""); at != std::string::npos;
+         at = json.find("\"ph\":\"X\"", at + 1)) {
+        ++events;
+    }
+    REQUIRE(events == timeline.EventCount());
+    timeline.Clear();
+    REQUIRE(timeline.EventCount() == 0);
+
+    // A cleared buffer refills the chunks it already has.
+    TimelineBuffer buffer{0};
+    auto fill = [&buffer](int64_t events) {
+        for (int64_t k = 0; k < events; ++k) {
+            buffer.Append(TimelineEvent{"Fill", "test", 0, 0, k});
+        }
+        int64_t seen = 0;
+        buffer.ForEach([&seen](const TimelineEvent& event) { REQUIRE(event.index == seen++); });
+        REQUIRE(seen == events);
+    };
+    fill(3 * TimelineBuffer::kChunkSize + 1);
+    buffer.Clear();
+    fill(2 * TimelineBuffer::kChunkSize + 5);
+    buffer.Clear();
+    fill(4 * TimelineBuffer::kChunkSize);
+}
+
+TEST_CASE("Hardware counters", "[raytracer]") {
+    auto camera_opts = BoxCamera();
+    auto filename = kBasePath + "tests/box/cube.obj";
+    RenderOptions render_opts{4};
+    auto reference = Render(filename, camera_opts, render_opts);
+    REQUIRE(CounterSession::Active() == nullptr);
+
+    // One thread: every tile is traced by the thread of the session.
+    render_opts.hardware_counters = true;
+    render_opts.tuning = TuningParameters{};
+    render_opts.tuning->threads = 1;
+    RenderStatistics statistics;
+    auto image = Render(filename, camera_opts, render_opts, &statistics);
+    std::vector<unsigned char> png;
+    {
+        CounterSession session{&statistics.hardware_counters};
+        png = image.EncodePng();
+    }
+    REQUIRE(CounterSession::Active() == nullptr);
+    RequireEqual(image, reference);
+
+    // Counters may be missing (no permission, no PMU); stage times are not.
+    const auto& report = statistics.hardware_counters;
+    REQUIRE(report.available == report.error.empty());
+    for (auto stage : {RenderStage::kLoad, RenderStage::kBuild, RenderStage::kPrimaryTrace,
+                       RenderStage::kShading, RenderStage::kToneMapping, RenderStage::kEncode}) {
+        REQUIRE(report[stage].entries > 0);
+        REQUIRE(report[stage].wall_ns > 0);
+        if (report.available) {
+            REQUIRE(report[stage].instructions > 0);
+        } else {
+            REQUIRE(report[stage].cycles == 0);
+        }
+    }
+    REQUIRE(report[RenderStage::kPrimaryTrace].entries > 1);
+    REQUIRE(report.ToString().find("primary trace") != std::string::npos);
+
+    // Pool threads count too: the same tiles enter the stages.
+    render_opts.tuning->threads = 4;
+    RenderStatistics pooled;
+    RequireEqual(Render(filename, camera_opts, render_opts, &pooled), reference);
+    for (auto stage : {RenderStage::kPrimaryTrace, RenderStage::kShading}) {
+        REQUIRE(pooled.hardware_counters[stage].entries == report[stage].entries);
+        if (pooled.hardware_counters.available) {
+            REQUIRE(pooled.hardware_counters[stage].instructions > 0);
+        }
+    }
+
+    // Without the option nothing is recorded.
+    RenderStatistics quiet;
+    Render(filename, camera_opts, RenderOptions{4}, &quiet);
+    REQUIRE(quiet.hardware_counters.stages[0].entries == 0);
+}
+
+TEST_CASE("Auto-tuning", "[raytracer]") {
+    auto camera_opts = BoxCamera();
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+
+    // Every configuration renders the same image.
+    for (bool rasterize : {false, true}) {
+        RenderOptions render_opts{4};
+        render_opts.rasterize_primary = rasterize;
+        auto reference = RenderScene(scene, camera_opts, render_opts);
+        for (int tile_size : {1, 7, 64}) {
+            for (int threads : {1, 3}) {
+                render_opts.tuning = TuningParameters{tile_size, threads, tile_size};
+                RequireEqual(RenderScene(scene, camera_opts, render_opts), reference);
+            }
+        }
+    }
+
+    // Tile sizes and thread counts out of range are rejected, not looped on.
+    auto streamed = std::filesystem::temp_directory_path() / "raytracer_bad_tuning.png";
+    for (auto tuning : {TuningParameters{0, 1, 8}, TuningParameters{-4, 1, 8},
+                        TuningParameters{8, -1, 8}}) {
+        RenderOptions render_opts{4};
+        render_opts.tuning = tuning;
+        REQUIRE_THROWS(RenderScene(scene, camera_opts, render_opts));
+        REQUIRE_THROWS(RenderStreaming(scene, camera_opts, render_opts, streamed.string()));
+    }
+    // The rasterizer has tiles of its own.
+    for (auto tuning : {TuningParameters{8, 1, 0}, TuningParameters{8, -1, 8}}) {
+        RenderOptions render_opts{4};
+        render_opts.tuning = tuning;
+        render_opts.rasterize_primary = true;
+        REQUIRE_THROWS(RenderScene(scene, camera_opts, render_opts));
+    }
+    std::filesystem::remove(streamed);
+    DistributedOptions distributed;
+    distributed.tile_size = 0;
+    REQUIRE_THROWS(RenderDistributed(kBasePath + "tests/box/cube.obj", camera_opts,
+                                     RenderOptions{4}, distributed));
+
+    auto directory = std::filesystem::temp_directory_path() / "raytracer_auto_tune";
+    std::filesystem::remove_all(directory);
+    std::filesystem::copy(kBasePath + "tests/box", directory);
+    auto filename = (directory / "cube.obj").string();
+    REQUIRE_FALSE(LoadTuningProfile(filename));
+
+    TuningGrid grid;
+    grid.tile_sizes = {8, 32};
+    grid.thread_counts = {1, 2};
+    grid.scale = 0.5;
+    grid.repetitions = 1;
+    auto result = AutoTune(filename, camera_opts, RenderOptions{4}, grid);
+    REQUIRE(result.timings.size() == 4);
+    REQUIRE(std::find(grid.tile_sizes.begin(), grid.tile_sizes.end(), result.best.tile_size) !=
+            grid.tile_sizes.end());
+    REQUIRE(LoadTuningProfile(filename) == result.best);
+    RequireEqual(Render(filename, camera_opts, RenderOptions{4}),
+                 RenderScene(scene, camera_opts, RenderOptions{4}));
+
+    // Profiles from other machines are ignored.
+    std::ofstream{TuningProfilePath(filename)} << "hardware_threads 100000\ntile_size 8\n";
+    REQUIRE_FALSE(LoadTuningProfile(filename));
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Scene generator", "[raytracer]") {
+    auto directory = std::filesystem::temp_directory_path() / "raytracer_scene_generator";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto filename = (directory / "generated.obj").string();
+
+    for (auto distribution : {SceneDistribution::kUniform, SceneDistribution::kClustered,
+                              SceneDistribution::kLongThin}) {
+        SceneGeneratorOptions options;
+        options.triangles = 400;
+        options.spheres = 40;
+        options.lights = 3;
+        options.mirror_fraction = 0.25;
+        options.glass_fraction = 0.1;
+        options.distribution = distribution;
+        GenerateScene(filename, options);
+        auto scene = ReadScene(filename);
+        REQUIRE(scene.GetObjects().size() == 400);
+        REQUIRE(scene.GetSphereObjects().size() == 40);
+        REQUIRE(scene.GetLights().size() == 3);
+
+        size_t mirrors = 0, glass = 0;
+        for (const auto& object : scene.GetObjects()) {
+            const auto& name = scene.GetMaterials().GetName(object.material_id);
+            mirrors += name == "mirror";
+            glass += name == "glass";
+            for (int k = 0; k < 3; ++k) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    REQUIRE(std::abs(object.polygon.GetVertex(k)[axis]) <= 2 * options.extent);
+                }
+            }
+        }
+        REQUIRE(mirrors == 100);
+        REQUIRE(glass == 40);
+
+        auto camera_opts = GeneratedSceneCamera(options, 48, 36);
+        auto image = RenderScene(scene, camera_opts, RenderOptions{4});
+        size_t lit = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                auto pixel = image.GetPixel(y, x);
+                lit += pixel.r + pixel.g + pixel.b > 0;
+            }
+        }
+        REQUIRE(lit > 0);
+    }
+
+    // The seed decides the scene.
+    SceneGeneratorOptions options;
+    options.triangles = 50;
+    auto contents = [&filename] {
+        std::ifstream file{filename};
+        return std::string{std::istreambuf_iterator<char>{file}, {}};
+    };
+    GenerateScene(filename, options);
+    auto first = contents();
+    GenerateScene(filename, options);
+    REQUIRE(contents() == first);
+    options.seed = 2;
+    GenerateScene(filename, options);
+    REQUIRE(contents() != first);
+
+    options.mirror_fraction = 0.8;
+    options.glass_fraction = 0.3;
+    REQUIRE_THROWS(GenerateScene(filename, options));
+    std::filesystem::remove_all(directory);
+}
+
+// Throughput of generation, loading and rendering from 10^3 primitives up.
+// Every primitive is tested by every tile whose frustum it overlaps, so the
+// sweep stops at RAYTRACER_BENCH_MAX_PRIMITIVES (10^5 unless set; up to 10^7).
+TEST_CASE("Scene scaling", "[.][benchmark]") {
+    using Clock = std::chrono::steady_clock;
+    auto seconds = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    size_t max_primitives = 100000;
+    if (auto value = std::getenv("RAYTRACER_BENCH_MAX_PRIMITIVES")) {
+        max_primitives = std::stoull(value);
+    }
+    auto directory = std::filesystem::temp_directory_path() / "raytracer_scene_scaling";
+    std::filesystem::create_directories(directory);
+    auto filename = (directory / "scene.obj").string();
+
+    for (auto distribution : {SceneDistribution::kUniform, SceneDistribution::kClustered,
+                              SceneDistribution::kLongThin}) {
+        for (size_t primitives = 1000; primitives <= std::min<size_t>(max_primitives, 10000000);
+             primitives *= 10) {
+            SceneGeneratorOptions options;
+            options.triangles = primitives - primitives / 10;
+            options.spheres = primitives / 10;
+            options.lights = 4;
+            options.mirror_fraction = 0.1;
+            options.glass_fraction = 0.05;
+            options.distribution = distribution;
+
+            auto start = Clock::now();
+            GenerateScene(filename, options);
+            double generate = seconds(start);
+            start = Clock::now();
+            auto scene = ReadScene(filename);
+            double load = seconds(start);
+            auto camera_opts = GeneratedSceneCamera(options, 128, 96);
+            start = Clock::now();
+            RenderScene(scene, camera_opts, RenderOptions{4});
+            double render = seconds(start);
+            WARN("distribution " << static_cast<int>(distribution) << ", " << primitives
+                                 << " primitives: generate " << generate << "s, load " << load
+                                 << "s (" << primitives / load << " primitives/s), render "
+                                 << render << "s (" << 128 * 96 / render << " pixels/s)");
+        }
+    }
+    std::filesystem::remove_all(directory);
+}
+
+double MeanLevelDifference(const Image& lhs, const Image& rhs) {
+    double output = 0;
+    for (int y = 0; y < lhs.Height(); ++y) {
+        for (int x = 0; x < lhs.Width(); ++x) {
+            auto a = lhs.GetPixel(y, x), b = rhs.GetPixel(y, x);
+            output += std::abs(a.r - b.r) + std::abs(a.g - b.g) + std::abs(a.b - b.b);
+        }
+    }
+    return output / (3.0 * lhs.Width() * lhs.Height());
+}
+
+TEST_CASE("Denoiser", "[raytracer]") {
+    for (int k = 0; k <= 1000; ++k) {
+        float x = -20.0f * k / 1000;
+        REQUIRE(std::abs(FastExp(x) - std::exp(x)) <= 2e-4f * std::exp(x));
+    }
+
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto camera_opts = BoxCamera();
+    int width = camera_opts.screen_width;
+    int height = camera_opts.screen_height;
+    Arena arena;
+    GuideBuffers guides{width, height, arena};
+    RenderGuides(scene, camera_opts, guides);
+    HdrBuffer clean{width, height, arena}, noisy{width, height, arena};
+    Camera camera{&camera_opts};
+    std::mt19937 rng{7};
+    std::normal_distribution<float> noise{0.0f, 0.4f};
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            Ray ray{camera_opts.look_from, camera.GetDirection(x, y)};
+            auto value = TracePixel(ray, scene, RenderOptions{4});
+            float factor = std::max(0.0f, 1.0f + noise(rng));
+            for (int c = 0; c < 3; ++c) {
+                clean.GetRow(y)[3 * x + c] = static_cast<float>(value[c]);
+                noisy.GetRow(y)[3 * x + c] = static_cast<float>(value[c]) * factor;
+            }
+        }
+    }
+    auto error = [&](const HdrBuffer& hdr) {
+        double output = 0;
+        for (int y = 0; y < height; ++y) {
+            for (int k = 0; k < 3 * width; ++k) {
+                double difference = hdr.GetRow(y)[k] - clean.GetRow(y)[k];
+                output += difference * difference;
+            }
+        }
+        return output;
+    };
+
+    // The scalar and the dispatched kernels agree, borders included.
+    PlanarBuffer input{width, height, 3, arena}, scalar{width, height, 3, arena},
+        dispatched{width, height, 3, arena};
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                input.GetRow(c, y)[x] = noisy.GetRow(y)[3 * x + c];
+            }
+        }
+    }
+    for (int step : {1, 4, 32}) {
+        auto parameters = MakeAtrousParameters(DenoiseOptions{}, step, MeanLuminance(input));
+        for (int y = 0; y < height; ++y) {
+            AtrousRowScalar(input, scalar, guides, y, 0, width, parameters);
+            AtrousRow(input, dispatched, guides, y, parameters);
+            for (int c = 0; c < 3; ++c) {
+                for (int x = 0; x < width; ++x) {
+                    float expected = scalar.GetRow(c, y)[x];
+                    REQUIRE(std::abs(dispatched.GetRow(c, y)[x] - expected) <=
+                            1e-5f * std::max(1.0f, expected));
+                }
+            }
+        }
+    }
+
+    double noisy_error = error(noisy);
+    Denoise(noisy, guides, DenoiseOptions{});
+    double denoised_error = error(noisy);
+    REQUIRE(denoised_error < 0.15 * noisy_error);
+
+    // The renderers run it as the last step before tone mapping.
+    // Plain Reinhard, since the filter may move the white point of the
+    // extended one.
+    RenderOptions render_opts{4};
+    render_opts.tone_mapping.tone_operator = ToneOperator::kReinhard;
+    auto plain = RenderScene(scene, camera_opts, render_opts);
+    render_opts.denoise = DenoiseOptions{};
+    for (bool rasterize : {false, true}) {
+        render_opts.rasterize_primary = rasterize;
+        auto denoised = RenderScene(scene, camera_opts, render_opts);
+        // A clean frame stays close; only the reflections in the spheres,
+        // which the guides know nothing about, get softer.
+        auto difference = MeanLevelDifference(denoised, plain);
+        REQUIRE(difference < 3);
+    }
+
+    // So do the other renderers, or they refuse.
+    render_opts.rasterize_primary = false;
+    auto filename = kBasePath + "tests/box/cube.obj";
+    auto denoised = RenderScene(scene, camera_opts, render_opts);
+    RequireEqual(*RenderProgressive(scene, camera_opts, render_opts, ProgressiveOptions{}),
+                 denoised);
+    DistributedOptions distributed;
+    distributed.workers = 2;
+    RequireEqual(RenderDistributed(filename, camera_opts, render_opts, distributed), denoised);
+    auto directory = std::filesystem::temp_directory_path() /
+                     ("raytracer-denoise-" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    OutOfCoreOptions out_of_core;
+    out_of_core.cache_path = (directory / "box.geometry").string();
+    out_of_core.cluster_size = 2;
+    Compare(RenderOutOfCore(OutOfCoreScene{filename, out_of_core}, camera_opts, render_opts),
+            denoised);
+    REQUIRE_THROWS(RenderStreaming(scene, camera_opts, render_opts,
+                                   (directory / "streamed.png").string()));
+    std::filesystem::remove_all(directory);
+
+    render_opts.mode = RenderMode::kDepth;
+    RequireEqual(RenderScene(scene, camera_opts, render_opts),
+                 RenderScene(scene, camera_opts, RenderOptions{4, RenderMode::kDepth}));
+}
+
+TEST_CASE("Camera path sequence", "[raytracer]") {
+    std::vector<CameraKeyframe> keyframes{{0.0, Vector{0.0, 0.7, 1.75}, Vector{0.0, 0.7, 0.0}, 1.0},
+                                          {1.0, Vector{0.5, 0.8, 1.5}, Vector{0.0, 0.6, 0.0}, 1.2},
+                                          {2.0, Vector{-0.4, 0.7, 1.6}, Vector{0.1, 0.7, 0.0}, 0.9}};
+    for (auto interpolation : {PathInterpolation::kLinear, PathInterpolation::kCatmullRom}) {
+        CameraPath path{keyframes, interpolation};
+        // Both pass through the keyframes.
+        for (const auto& keyframe : keyframes) {
+            auto camera_opts = path.At(keyframe.time, 32, 24);
+            REQUIRE(camera_opts.fov == Approx(keyframe.fov));
+            for (int k = 0; k < 3; ++k) {
+                REQUIRE(camera_opts.look_from[k] == Approx(keyframe.look_from[k]));
+                REQUIRE(camera_opts.look_to[k] == Approx(keyframe.look_to[k]));
+            }
+        }
+        REQUIRE(path.At(-1.0, 32, 24).look_from[0] == Approx(0.0));
+        REQUIRE(path.At(0.5, 32, 24).fov == Approx(1.1));
+    }
+    CameraPath linear{keyframes, PathInterpolation::kLinear};
+    REQUIRE(linear.At(0.5, 32, 24).look_from[0] == Approx(0.25));
+    REQUIRE_THROWS(CameraPath{{keyframes[1], keyframes[0]}});
+    REQUIRE(FrameCount(linear, 2.0) == 5);
+    REQUIRE(FrameFilename("out/frame_", 7, 4) == "out/frame_0007.png");
+
+    auto directory = std::filesystem::temp_directory_path() / "raytracer_sequence";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    CameraPath path{keyframes};
+    SequenceOptions options{48, 36, 2.5, (directory / "frame_").string()};
+    for (bool rasterize : {false, true}) {
+        RenderOptions render_opts{4};
+        render_opts.rasterize_primary = rasterize;
+        auto report = RenderSequence(scene, path, options, render_opts);
+        REQUIRE(report.frames == 6);
+        REQUIRE(report.frame_seconds.size() == 6);
+        REQUIRE(report.FramesPerSecond() > 0);
+        REQUIRE(report.ToString().find("fps") != std::string::npos);
+        // Every frame is what a separate RenderScene call would give.
+        for (size_t k = 0; k < report.frames; ++k) {
+            auto camera_opts = path.At(k / options.frame_rate, options.width, options.height);
+            RequireEqual(Image{FrameFilename(options.output_prefix, k, options.digits)},
+                         RenderScene(scene, camera_opts, render_opts));
+        }
+    }
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Temporal reprojection", "[raytracer]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto camera_opts = BoxCamera();
+    auto moved = camera_opts;
+    moved.look_from = std::array<double, 3>{0.02, 0.71, 1.74};
+
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions render_opts{4, mode};
+        TemporalRenderer renderer;
+        // The first frame is traced in full.
+        RequireEqual(renderer.Render(scene, camera_opts, render_opts),
+                     RenderScene(scene, camera_opts, render_opts));
+        REQUIRE(renderer.ReuseRatio() == 0.0);
+
+        auto image = renderer.Render(scene, moved, render_opts);
+        // In kFull the specular floor and back wall are traced again.
+        REQUIRE(renderer.ReuseRatio() > (mode == RenderMode::kFull ? 0.3 : 0.9));
+        REQUIRE(renderer.ReusedPixels() + renderer.TracedPixels() == 96 * 72);
+        // Reused pixels are off by less than a pixel of shift.
+        auto difference = MeanLevelDifference(image, RenderScene(scene, moved, render_opts));
+        REQUIRE(difference < 1);
+
+        // A camera that stops keeps the picture.
+        auto still = renderer.Render(scene, moved, render_opts);
+        REQUIRE(MeanLevelDifference(still, image) < 0.5);
+    }
+
+    // With visibility checks the reused pixels are also confirmed by their
+    // primary rays.
+    RenderOptions render_opts{4};
+    TemporalRenderer plain, verified{TemporalOptions{0.05, true}};
+    plain.Render(scene, camera_opts, render_opts);
+    verified.Render(scene, camera_opts, render_opts);
+    auto reference = RenderScene(scene, moved, render_opts);
+    REQUIRE(MeanLevelDifference(plain.Render(scene, moved, render_opts), reference) < 1);
+    REQUIRE(MeanLevelDifference(verified.Render(scene, moved, render_opts), reference) < 1);
+    REQUIRE(verified.ReuseRatio() <= plain.ReuseRatio());
+    REQUIRE(verified.ReuseRatio() > 0.3);
+
+    // Sequences report the ratio per frame.
+    auto directory = std::filesystem::temp_directory_path() / "raytracer_temporal";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    CameraPath path{{{0.0, Vector{0.0, 0.7, 1.75}, Vector{0.0, 0.7, 0.0}, M_PI / 3},
+                     {1.0, Vector{0.1, 0.75, 1.7}, Vector{0.0, 0.7, 0.0}, M_PI / 3}}};
+    SequenceOptions options{96, 72, 5.0, (directory / "frame_").string()};
+    options.temporal = TemporalOptions{};
+    auto report = RenderSequence(scene, path, options, RenderOptions{4});
+    REQUIRE(report.reuse_ratios.size() == report.frames);
+    REQUIRE(report.reuse_ratios[0] == 0.0);
+    REQUIRE(report.reuse_ratios[1] > 0.3);
+    REQUIRE(report.ToString().find("reused") != std::string::npos);
+    std::filesystem::remove_all(directory);
+}
+
+Image CropImage(const Image& image, const Tile& window) {
+    Image output{window.width, window.height};
+    for (int y = 0; y < window.height; ++y) {
+        for (int x = 0; x < window.width; ++x) {
+            output.SetPixel(image.GetPixel(window.y + y, window.x + x), y, x);
+        }
+    }
+    return output;
+}
+
+TEST_CASE("Region of interest", "[raytracer]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto camera_opts = BoxCamera();
+    Tile window{21, 13, 37, 29};
+    Tile frame{0, 0, 96, 72};
+
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        // kFull with kReinhardExtended, which needs the white point.
+        RenderOptions render_opts{4, mode};
+        auto full = RenderScene(scene, camera_opts, render_opts);
+        RequireEqual(RenderRegion(scene, camera_opts, render_opts, frame), full);
+        // Given the frame's maximum, the window is the frame's crop.
+        Arena arena;
+        PixelBuffer prepixels{96, 72, arena};
+        TraceFrame(scene, PrepareTrace(scene, render_opts), camera_opts, render_opts, prepixels);
+        auto frame_max_value = FrameMaxValue(prepixels, 96, 72, mode);
+        auto expected = CropImage(full, window);
+        RequireEqual(RenderRegion(scene, camera_opts, render_opts, window, frame_max_value),
+                     expected);
+        if (mode != RenderMode::kDepth) {
+            continue;
+        }
+        // Without it depth is normalized over the window; misses stay white.
+        auto region = RenderRegion(scene, camera_opts, render_opts, window);
+        RGB white{255, 255, 255};
+        for (int y = 0; y < window.height; ++y) {
+            for (int x = 0; x < window.width; ++x) {
+                REQUIRE((region.GetPixel(y, x) == white) == (expected.GetPixel(y, x) == white));
+            }
+        }
+    }
+    // Operators without image statistics need nothing.
+    RenderOptions plain_opts{4};
+    plain_opts.tone_mapping.tone_operator = ToneOperator::kReinhard;
+    RequireEqual(RenderRegion(scene, camera_opts, plain_opts, window),
+                 CropImage(RenderScene(scene, camera_opts, plain_opts), window));
+
+    // Adaptive anti-aliasing refines the same pixels as in the whole frame.
+    RenderOptions render_opts{4};
+    render_opts.tone_mapping.tone_operator = ToneOperator::kReinhard;
+    render_opts.anti_aliasing.max_samples = 9;
+    auto full = RenderScene(scene, camera_opts, render_opts);
+    RequireEqual(RenderRegion(scene, camera_opts, render_opts, window), CropImage(full, window));
+    RequireEqual(RenderRegion(scene, camera_opts, render_opts, Tile{90, 0, 6, 72}),
+                 CropImage(full, Tile{90, 0, 6, 72}));
+
+    REQUIRE_THROWS(RenderRegion(scene, camera_opts, render_opts, Tile{90, 0, 7, 72}));
+    REQUIRE_THROWS(RenderRegion(scene, camera_opts, render_opts, Tile{0, 0, 0, 10}));
+}
+
+TEST_CASE("Dynamic resolution", "[raytracer]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto camera_opts = BoxCamera();
+
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions render_opts{4, mode};
+        auto reference = RenderScene(scene, camera_opts, render_opts);
+        // A budget that fits everything traces the full resolution.
+        DynamicResolutionRenderer unlimited{DynamicResolutionOptions{1e3}};
+        RequireEqual(unlimited.Render(scene, camera_opts, render_opts), reference);
+        REQUIRE(unlimited.Scale() == 1.0);
+
+        // One that fits nothing stays at the smallest scale, upsampled.
+        DynamicResolutionRenderer starved{DynamicResolutionOptions{1e-9, 0.5}};
+        for (int frame = 0; frame < 2; ++frame) {
+            auto image = starved.Render(scene, camera_opts, render_opts);
+            REQUIRE(starved.Scale() == 0.5);
+            REQUIRE(image.Width() == 96);
+            REQUIRE(image.Height() == 72);
+            REQUIRE(MeanLevelDifference(image, reference) < 8);
+        }
+    }
+
+    // A budget between the two: 8 ms left for 100 x 100 pixels at 1 us each
+    // traces 8000 of them.
+    DynamicResolutionOptions options{0.01, 0.1};
+    REQUIRE(ChooseResolutionScale(options, 100, 100, 0.0, 1e-6, 0.002) ==
+            Approx(std::sqrt(0.8)));
+    REQUIRE(ChooseResolutionScale(options, 100, 100, 0.006, 1e-6, 0.002) ==
+            Approx(std::sqrt(0.2)));
+    REQUIRE(ChooseResolutionScale(options, 100, 100, 0.0, 1e-9, 0.002) == 1.0);
+    REQUIRE(ChooseResolutionScale(options, 100, 100, 0.0, 1e-3, 0.002) == 0.1);
+    REQUIRE(ChooseResolutionScale(options, 100, 100, 0.02, 1e-6, 0.002) == 0.1);
+
+    REQUIRE_THROWS(DynamicResolutionRenderer{DynamicResolutionOptions{1.0, 0.0}});
+    REQUIRE_THROWS(DynamicResolutionRenderer{DynamicResolutionOptions{1.0, 0.5, 2.0}});
+}
+
+TEST_CASE("Streaming output", "[raytracer]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto camera_opts = BoxCamera();
+    auto directory = std::filesystem::temp_directory_path() / "raytracer_streaming";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto filename = (directory / "poster.png").string();
+    StreamingOutputOptions options{(directory / "scratch").string()};
+
+    for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions render_opts{4, mode};
+        RenderStreaming(scene, camera_opts, render_opts, filename, options);
+        REQUIRE(!std::filesystem::exists(options.scratch_path));
+        auto reference = RenderScene(scene, camera_opts, render_opts);
+        if (mode == RenderMode::kFull) {
+            RequireEqual(Image{filename}, reference);
+        } else {
+            Compare(Image{filename}, reference);
+        }
+    }
+    for (auto op : {ToneOperator::kReinhard, ToneOperator::kAces, ToneOperator::kClamp}) {
+        RenderOptions render_opts{4};
+        render_opts.tone_mapping.tone_operator = op;
+        render_opts.tuning = TuningParameters{};
+        render_opts.tuning->tile_size = 20;
+        RenderStreaming(scene, camera_opts, render_opts, filename);
+        RequireEqual(Image{filename}, RenderScene(scene, camera_opts, render_opts));
+    }
+
+    // Only the scratch file grows with the image; the memory held is a few
+    // tiles and a tile row.
+    RenderOptions render_opts{4};
+    render_opts.tuning = TuningParameters{};
+    render_opts.tuning->threads = 2;
+    auto small = RenderStreaming(scene, camera_opts, render_opts, filename, options);
+    camera_opts.screen_height *= 4;
+    auto tall = RenderStreaming(scene, camera_opts, render_opts, filename, options);
+    REQUIRE(tall.buffer_bytes == small.buffer_bytes);
+    REQUIRE(tall.buffer_bytes > 2 * static_cast<size_t>(kFrustumTileSize) * kFrustumTileSize *
+                                    sizeof(Vector));
+    REQUIRE(tall.buffer_bytes < tall.scratch_bytes / 4);
+    REQUIRE(tall.scratch_bytes == 4 * small.scratch_bytes);
+    RequireEqual(Image{filename}, RenderScene(scene, camera_opts, render_opts));
+    std::filesystem::remove_all(directory);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <perf_counters.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A screen rectangle: columns [x, x + width), rows [y, y + height).
+struct Tile {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+inline void CheckTileSize(int tile_size) {
+    if (tile_size <= 0) {
+        throw std::runtime_error("Bad tile size " + std::to_string(tile_size));
+    }
+}
+
+inline std::vector<Tile> SplitIntoTiles(int width, int height, int tile_size) {
+    CheckTileSize(tile_size);
+    std::vector<Tile> output;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            output.push_back(
+                Tile{x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)});
+        }
+    }
+    return output;
+}
+
+// `requested` threads, or one per hardware thread for 0.
+inline size_t ThreadCount(int requested) {
+    if (requested < 0) {
+        throw std::runtime_error("Bad thread count " + std::to_string(requested));
+    }
+    if (requested > 0) {
+        return requested;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs body() on `threads` threads, the calling one included, and waits for
+// all of them. The new threads count into the calling thread's
+// CounterSession.
+template <class Body>
+void RunOnThreads(size_t threads, Body body) {
+    std::vector<std::thread> pool;
+    auto worker = CountOnWorker(body);
+    for (size_t k = 1; k < threads; ++k) {
+        pool.emplace_back(worker);
+    }
+    body();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <image.h>
+#include <arena.h>
+#include <render_options.h>
+#include <tile.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RAYTRACER_TONE_MAPPING_AVX2
+#include <immintrin.h>
+#endif
+
+// Row-major RGB floats, three per pixel, in arena memory.
+class HdrBuffer {
+public:
+    HdrBuffer(int width, int height, Arena& arena)
+        : width_{width},
+          height_{height},
+          data_{static_cast<float*>(
+              arena.Allocate(static_cast<size_t>(width) * height * 3 * sizeof(float), 32))} {
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    float* GetRow(int y) {
+        return data_ + static_cast<size_t>(y) * width_ * 3;
+    }
+
+    const float* GetRow(int y) const {
+        return data_ + static_cast<size_t>(y) * width_ * 3;
+    }
+
+private:
+    int width_;
+    int height_;
+    float* data_;
+};
+
+// Rows below this many per thread are not worth a thread of their own.
+const int kMinRowsPerThread = 64;
+
+// The thread count the render options ask for, as ThreadCount takes it.
+inline int RequestedThreads(const RenderOptions& render_options) {
+    return render_options.tuning ? render_options.tuning->threads : 0;
+}
+
+// Calls body(begin, end) on disjoint row ranges covering [0, rows), on up to
+// ThreadCount(threads) threads through RunOnThreads.
+template <class Body>
+void ParallelRows(int rows, int threads, Body body) {
+    int ranges = std::min(static_cast<int>(ThreadCount(threads)), rows / kMinRowsPerThread);
+    ranges = std::max(ranges, 1);
+    std::atomic<int> next_range = 0;
+    RunOnThreads(ranges, [&] {
+        for (int k = next_range++; k < ranges; k = next_range++) {
+            body(rows * k / ranges, rows * (k + 1) / ranges);
+        }
+    });
+}
+
+// Transposes column-major prepixels (prepixels[x][y]) into `output`.
+template <class Buffer>
+void GatherHdr(const Buffer& prepixels, HdrBuffer& output, int threads = 0) {
+    ParallelRows(output.Height(), threads, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            auto row = output.GetRow(y);
+            for (int x = 0; x < output.Width(); ++x) {
+                const auto& pixel = prepixels[x][y];
+                row[3 * x] = static_cast<float>(pixel[0]);
+                row[3 * x + 1] = static_cast<float>(pixel[1]);
+                row[3 * x + 2] = static_cast<float>(pixel[2]);
+            }
+        }
+    });
+}
+
+inline float MaxChannelScalar(const float* data, size_t size) {
+    float output = -1.0f;
+    for (size_t i = 0; i < size; ++i) {
+        output = std::max(output, data[i]);
+    }
+    return output;
+}
+
+#ifdef RAYTRACER_TONE_MAPPING_AVX2
+__attribute__((target("avx2"))) inline float MaxChannelAvx2(const float* data, size_t size) {
+    __m256 best = _mm256_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        best = _mm256_max_ps(best, _mm256_loadu_ps(data + i));
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, best);
+    float output = MaxChannelScalar(data + i, size - i);
+    for (float lane : lanes) {
+        output = std::max(output, lane);
+    }
+    return output;
+}
+#endif
+
+inline float MaxChannel(const float* data, size_t size) {
+#ifdef RAYTRACER_TONE_MAPPING_AVX2
+    static const bool kHasAvx2 = __builtin_cpu_supports("avx2");
+    if (kHasAvx2) {
+        return MaxChannelAvx2(data, size);
+    }
+#endif
+    return MaxChannelScalar(data, size);
+}
+
+// Largest channel value of the buffer, or -1 if it is empty.
+inline float MaxChannel(const HdrBuffer& hdr, int threads = 0) {
+    if (hdr.Height() == 0) {
+        return -1.0f;
+    }
+    std::vector<float> partial(hdr.Height(), -1.0f);
+    ParallelRows(hdr.Height(), threads, [&](int begin, int end) {
+        float output = -1.0f;
+        for (int y = begin; y < end; ++y) {
+            output = std::max(output, MaxChannel(hdr.GetRow(y), hdr.Width() * 3));
+        }
+        partial[begin] = output;
+    });
+    return *std::max_element(partial.begin(), partial.end());
+}
+
+// 255 * x^(1 / 2.2) as a piecewise linear function of the float bits of x:
+// kGammaOctaves octaves below 1, each cut into 2^kGammaSegmentBits segments
+// by the top mantissa bits. The segments are within 0.003 of the curve, so
+// rounding them gives the exact 8-bit value or, rarely, a neighbour; inputs
+// below the table round to 0 anyway.
+const int kGammaOctaves = 24;
+const int kGammaSegmentBits = 5;
+const int kGammaMinExponent = 127 - kGammaOctaves;
+const int kGammaFractionBits = 23 - kGammaSegmentBits;
+const uint32_t kGammaFractionMask = (1u << kGammaFractionBits) - 1;
+const float kGammaMin = 1.0f / (1 << kGammaOctaves);
+
+struct GammaTable {
+    static constexpr int kSize = kGammaOctaves << kGammaSegmentBits;
+
+    GammaTable() {
+        for (int index = 0; index < kSize; ++index) {
+            int exponent = kGammaMinExponent + (index >> kGammaSegmentBits);
+            int segment = index & ((1 << kGammaSegmentBits) - 1);
+            double octave = std::ldexp(1.0, exponent - 127);
+            double from = octave * (1 + static_cast<double>(segment) / (1 << kGammaSegmentBits));
+            double to = octave * (1 + static_cast<double>(segment + 1) / (1 << kGammaSegmentBits));
+            double start = 255 * std::pow(from, 1 / 2.2);
+            double end = 255 * std::pow(to, 1 / 2.2);
+            // The curve is concave: lift the chord by half its gap at the
+            // middle, which about halves the largest error.
+            double gap = 255 * std::pow((from + to) / 2, 1 / 2.2) - (start + end) / 2;
+            base[index] = static_cast<float>(start + gap / 2);
+            slope[index] = static_cast<float>(end - start);
+        }
+    }
+
+    alignas(32) float base[kSize];
+    alignas(32) float slope[kSize];
+};
+
+inline const GammaTable& GetGammaTable() {
+    static const GammaTable kTable;
+    return kTable;
+}
+
+// The unrounded table level of x in [kGammaMin, 1).
+inline float GammaLevel(float x) {
+    const auto& table = GetGammaTable();
+    auto bits = std::bit_cast<uint32_t>(x);
+    int index = static_cast<int>((bits >> kGammaFractionBits) -
+                                 (kGammaMinExponent << kGammaSegmentBits));
+    float t = static_cast<float>(bits & kGammaFractionMask) * (1.0f / (1 << kGammaFractionBits));
+    return table.base[index] + table.slope[index] * t;
+}
+
+// round(255 * x^(1 / 2.2)) within one level, for x in [0, 1]; 0 below and
+// 255 above.
+inline int EncodeGamma(float x) {
+    if (!(x >= kGammaMin)) {
+        return 0;
+    }
+    if (x >= 1.0f) {
+        return 255;
+    }
+    return static_cast<int>(GammaLevel(x) + 0.5f);
+}
+
+// What the row kernels need besides the colors.
+struct ToneParameters {
+    float exposure;
+    // 1 / w^2 for kReinhardExtended, 0 if the image has no positive value.
+    float inv_white2;
+};
+
+inline ToneParameters MakeToneParameters(const ToneMappingOptions& options, float max_channel) {
+    float exposure = static_cast<float>(options.exposure);
+    float white = exposure * max_channel;
+    return ToneParameters{exposure, white > 0 ? 1.0f / (white * white) : 0.0f};
+}
+
+template <ToneOperator Op>
+float ApplyToneOperator(float x, float inv_white2) {
+    if constexpr (Op == ToneOperator::kReinhardExtended) {
+        return x * (1.0f + x * inv_white2) / (1.0f + x);
+    } else if constexpr (Op == ToneOperator::kReinhard) {
+        return x / (1.0f + x);
+    } else if constexpr (Op == ToneOperator::kAces) {
+        return x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f);
+    } else {
+        return std::min(x, 1.0f);
+    }
+}
+
+// Channels are tone mapped in blocks of this many floats: 32 pixels, and a
+// multiple of the 8 AVX2 lanes.
+const int kToneBlock = 96;
+
+// Tone maps and gamma encodes `count` channel values into 8-bit levels.
+template <ToneOperator Op>
+void ToneMapBlockScalar(const float* input, int* levels, int count,
+                        const ToneParameters& parameters) {
+    for (int k = 0; k < count; ++k) {
+        levels[k] =
+            EncodeGamma(ApplyToneOperator<Op>(input[k] * parameters.exposure, parameters.inv_white2));
+    }
+}
+
+#ifdef RAYTRACER_TONE_MAPPING_AVX2
+template <ToneOperator Op>
+__attribute__((target("avx2"))) inline __m256 ApplyToneOperatorAvx2(__m256 x, __m256 inv_white2) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    if constexpr (Op == ToneOperator::kReinhardExtended) {
+        return _mm256_div_ps(_mm256_mul_ps(x, _mm256_add_ps(one, _mm256_mul_ps(x, inv_white2))),
+                             _mm256_add_ps(one, x));
+    } else if constexpr (Op == ToneOperator::kReinhard) {
+        return _mm256_div_ps(x, _mm256_add_ps(one, x));
+    } else if constexpr (Op == ToneOperator::kAces) {
+        __m256 numerator =
+            _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), x),
+                                           _mm256_set1_ps(0.03f)));
+        __m256 denominator = _mm256_add_ps(
+            _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), x),
+                                           _mm256_set1_ps(0.59f))),
+            _mm256_set1_ps(0.14f));
+        return _mm256_div_ps(numerator, denominator);
+    } else {
+        return _mm256_min_ps(x, one);
+    }
+}
+
+__attribute__((target("avx2"))) inline __m256i EncodeGammaAvx2(__m256 x) {
+    const auto& table = GetGammaTable();
+    const __m256 low = _mm256_set1_ps(kGammaMin);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    // NaN compares false, as in EncodeGamma.
+    __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(x, low, _CMP_GE_OQ),
+                                    _mm256_cmp_ps(x, one, _CMP_LT_OQ));
+    __m256 above = _mm256_cmp_ps(x, one, _CMP_GE_OQ);
+    __m256i bits = _mm256_castps_si256(_mm256_blendv_ps(low, x, in_range));
+    __m256i index = _mm256_sub_epi32(_mm256_srli_epi32(bits, kGammaFractionBits),
+                                     _mm256_set1_epi32(kGammaMinExponent << kGammaSegmentBits));
+    __m256 t = _mm256_mul_ps(
+        _mm256_cvtepi32_ps(_mm256_and_si256(bits, _mm256_set1_epi32(kGammaFractionMask))),
+        _mm256_set1_ps(1.0f / (1 << kGammaFractionBits)));
+    __m256 level = _mm256_add_ps(_mm256_i32gather_ps(table.base, index, 4),
+                                 _mm256_mul_ps(_mm256_i32gather_ps(table.slope, index, 4), t));
+    __m256i output = _mm256_cvttps_epi32(_mm256_add_ps(level, _mm256_set1_ps(0.5f)));
+    output = _mm256_and_si256(output, _mm256_castps_si256(in_range));
+    return _mm256_or_si256(output,
+                           _mm256_and_si256(_mm256_set1_epi32(255), _mm256_castps_si256(above)));
+}
+
+template <ToneOperator Op>
+__attribute__((target("avx2"))) void ToneMapBlockAvx2(const float* input, int* levels, int count,
+                                                      const ToneParameters& parameters) {
+    const __m256 exposure = _mm256_set1_ps(parameters.exposure);
+    const __m256 inv_white2 = _mm256_set1_ps(parameters.inv_white2);
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(input + k), exposure);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(levels + k),
+                            EncodeGammaAvx2(ApplyToneOperatorAvx2<Op>(x, inv_white2)));
+    }
+    ToneMapBlockScalar<Op>(input + k, levels + k, count - k, parameters);
+}
+#endif
+
+template <ToneOperator Op>
+void ToneMapBlock(const float* input, int* levels, int count, const ToneParameters& parameters) {
+#ifdef RAYTRACER_TONE_MAPPING_AVX2
+    static const bool kHasAvx2 = __builtin_cpu_supports("avx2");
+    if (kHasAvx2) {
+        ToneMapBlockAvx2<Op>(input, levels, count, parameters);
+        return;
+    }
+#endif
+    ToneMapBlockScalar<Op>(input, levels, count, parameters);
+}
+
+// Tone maps one row of `width` RGB floats into RGBA bytes; alpha stays as it
+// is.
+template <ToneOperator Op>
+void ToneMapRow(const float* input, png_bytep output, int width,
+                const ToneParameters& parameters) {
+    alignas(32) int levels[kToneBlock];
+    int channels = width * 3;
+    for (int k = 0; k < channels; k += kToneBlock) {
+        int count = std::min(kToneBlock, channels - k);
+        ToneMapBlock<Op>(input + k, levels, count, parameters);
+        for (int c = 0; c < count; ++c) {
+            int channel = k + c;
+            output[channel / 3 * 4 + channel % 3] = static_cast<png_byte>(levels[c]);
+        }
+    }
+}
+
+inline void ToneMapRow(const float* input, png_bytep output, int width,
+                       ToneOperator tone_operator, const ToneParameters& parameters) {
+    switch (tone_operator) {
+        case ToneOperator::kReinhardExtended:
+            ToneMapRow<ToneOperator::kReinhardExtended>(input, output, width, parameters);
+            break;
+        case ToneOperator::kReinhard:
+            ToneMapRow<ToneOperator::kReinhard>(input, output, width, parameters);
+            break;
+        case ToneOperator::kAces:
+            ToneMapRow<ToneOperator::kAces>(input, output, width, parameters);
+            break;
+        case ToneOperator::kClamp:
+            ToneMapRow<ToneOperator::kClamp>(input, output, width, parameters);
+            break;
+    }
+}
+
+template <ToneOperator Op>
+void ToneMapRows(const HdrBuffer& hdr, Image& image, const ToneParameters& parameters,
+                 int threads) {
+    ParallelRows(hdr.Height(), threads, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            ToneMapRow<Op>(hdr.GetRow(y), image.GetRow(y), hdr.Width(), parameters);
+        }
+    });
+}
+
+// Tone maps `hdr` into `image`, which must have the same size. The white
+// point of kReinhardExtended is `max_channel`, by default the largest
+// channel of hdr. `threads` is as in ThreadCount.
+inline void ToneMap(const HdrBuffer& hdr, Image& image, const ToneMappingOptions& options = {},
+                    std::optional<float> max_channel = {}, int threads = 0) {
+    float white = 0.0f;
+    if (options.tone_operator == ToneOperator::kReinhardExtended) {
+        white = max_channel ? *max_channel : MaxChannel(hdr, threads);
+    }
+    auto parameters = MakeToneParameters(options, white);
+    switch (options.tone_operator) {
+        case ToneOperator::kReinhardExtended:
+            ToneMapRows<ToneOperator::kReinhardExtended>(hdr, image, parameters, threads);
+            break;
+        case ToneOperator::kReinhard:
+            ToneMapRows<ToneOperator::kReinhard>(hdr, image, parameters, threads);
+            break;
+        case ToneOperator::kAces:
+            ToneMapRows<ToneOperator::kAces>(hdr, image, parameters, threads);
+            break;
+        case ToneOperator::kClamp:
+            ToneMapRows<ToneOperator::kClamp>(hdr, image, parameters, threads);
+            break;
+    }
+}
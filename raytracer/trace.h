@@ -0,0 +1,271 @@
+#pragma once
+
+#include <image.h>
+#include <render_options.h>
+#include <tone_mapping.h>
+#include <scene.h>
+#include <geometry.h>
+#include <sphere_batch.h>
+
+#include <optional>
+#include <vector>
+
+inline Vector ComputeNormal(const Object& obj, const Vector& point, const Vector& default_normal) {
+    auto coordinates = GetBarycentricCoords(obj.polygon, point);
+    Vector output;
+    for (int i = 0; i < 3; ++i) {
+        if (obj.GetNormal(i)) {
+            output = output + *obj.GetNormal(i) * coordinates[i];
+        } else {
+            output = output + default_normal * coordinates[i];
+        }
+    }
+    return output;
+}
+
+bool IsVisible(const Light& light, const Vector& position, const Scene& scene) {
+    auto dir = light.position - position;
+    auto length = Length(dir);
+    dir.Normalize();
+    Ray ray{position, dir};
+    for (const auto& obj : scene.GetObjects()) {
+        auto inter = GetIntersection(ray, obj.polygon);
+        if (inter and inter.value().GetDistance() < length) {
+            return false;
+        }
+    }
+    auto sphere_hit = FindNearestSphere(ray, scene.GetSphereBatch());
+    if (sphere_hit and sphere_hit.value().distance < length) {
+        return false;
+    }
+    return true;
+}
+
+// The shading functions below are templates over the scene type, so that
+// other scene representations only need their own FindNearestHit and
+// IsVisible overloads.
+template <class SceneT>
+Vector ComputeLightedColor(const Material* material, const Intersection& inter, const Ray& ray,
+                           const SceneT& scene) {
+    Vector output;
+    for (const auto& light : scene.GetLights()) {
+        if (IsVisible(light, inter.GetPosition(), scene)) {
+            auto vl = light.position - inter.GetPosition();
+            vl.Normalize();
+            auto normal_x_vl = DotProduct(inter.GetNormal(), vl);
+            output =
+                output + material->diffuse_color * light.intensity * std::max(0.0, normal_x_vl);
+            auto vr = 2 * normal_x_vl * inter.GetNormal() - vl;
+            auto ve = -1 * ray.GetDirection();
+            output =
+                output + material->specular_color * light.intensity *
+                             pow(std::max(0.0, DotProduct(ve, vr)), material->specular_exponent);
+        }
+    }
+    return output;
+}
+
+struct SurfaceHit {
+    Intersection intersection;
+    // Index into the scene's MaterialTable.
+    int material_id;
+    // Index into Scene::GetObjects(), continued by Scene::GetSphereObjects().
+    int object_id;
+};
+
+inline std::optional<SurfaceHit> FindNearestHit(const Ray& ray, const Scene& scene) {
+    double min_dist = std::numeric_limits<double>::max();
+    std::optional<SurfaceHit> best;
+    const auto& objects = scene.GetObjects();
+    for (size_t i = 0; i < objects.size(); ++i) {
+        auto inter = GetIntersection(ray, objects[i].polygon);
+        if (inter and inter.value().GetDistance() < min_dist) {
+            min_dist = inter.value().GetDistance();
+            Intersection new_inter{
+                inter.value().GetPosition(),
+                ComputeNormal(objects[i], inter.value().GetPosition(), inter.value().GetNormal()),
+                inter.value().GetDistance()};
+            best.emplace(SurfaceHit{new_inter, objects[i].material_id, static_cast<int>(i)});
+        }
+    }
+    auto sphere_hit = FindNearestSphere(ray, scene.GetSphereBatch());
+    if (sphere_hit and sphere_hit.value().distance < min_dist) {
+        auto index = sphere_hit.value().index;
+        best.emplace(SurfaceHit{
+            MakeSphereIntersection(ray, scene.GetSphereBatch(), sphere_hit.value()),
+            scene.GetSphereObjects()[index].material_id,
+            static_cast<int>(objects.size() + index)});
+    }
+    return best;
+}
+
+template <class SceneT>
+std::optional<std::pair<Intersection, const Material*>> FindIntersection(const Ray& ray,
+                                                                         const SceneT& scene) {
+    auto hit = FindNearestHit(ray, scene);
+    if (!hit) {
+        return {};
+    }
+    return std::make_pair(hit.value().intersection,
+                          &scene.GetMaterials().Get(hit.value().material_id));
+}
+
+template <class SceneT>
+Vector ComputeColor(int material_id, const Ray& ray, const Intersection& inter, int depth,
+                    const SceneT& scene, bool inside) {
+    if (depth < 1) {
+        return Vector();
+    }
+    double eps = 10e-5;
+
+    const auto* material = &scene.GetMaterials().Get(material_id);
+    const auto& constants = scene.GetMaterials().GetConstants(material_id);
+    Vector output = constants.emission;
+    output = output + material->albedo[0] * ComputeLightedColor(material, inter, ray, scene);
+    if (constants.reflects and depth > 1 and !inside) {
+        if (inside) {
+            std::cout << "ERROR" << std::endl;
+        }
+        auto reflect = Reflect(ray.GetDirection(), inter.GetNormal());
+        Ray reflect_ray{inter.GetPosition(), reflect};
+        auto reflect_hit = FindNearestHit(reflect_ray, scene);
+        if (reflect_hit) {
+            output = output + material->albedo[1] * ComputeColor(reflect_hit->material_id,
+                                                                 reflect_ray,
+                                                                 reflect_hit->intersection,
+                                                                 depth - 1, scene, inside);
+        }
+    }
+    if (constants.refracts and depth > 1) {
+        auto eta = material->refraction_index;
+        if (!inside) {
+            eta = 1 / eta;
+        }
+        auto refract = Refract(ray.GetDirection(), inter.GetNormal(), eta);
+        if (refract) {
+            double a = -1.0;
+            if (inside) {
+                a = -a;
+            }
+            Ray refract_ray{inter.GetPosition() + a * eps * inter.GetNormal(), refract.value()};
+            auto refract_hit = FindNearestHit(refract_ray, scene);
+            if (refract_hit) {
+                auto alb = material->albedo[2];
+                if (inside) {
+                    alb = 1;
+                }
+                output = output + alb * ComputeColor(refract_hit->material_id, refract_ray,
+                                                     refract_hit->intersection, depth - 1, scene,
+                                                     !inside);
+            }
+        }
+    }
+    return output;
+}
+
+// Raw per-pixel value for the given mode: the distance (repeated in every
+// component, 0 for a miss) for kDepth, the normal remapped to [0, 1] for
+// kNormal and the HDR color for kFull. ResolvePixels turns a buffer of these
+// into the final image.
+template <class SceneT>
+Vector ShadeSceneHit(const Ray& ray, const std::optional<SurfaceHit>& hit, const SceneT& scene,
+                     const RenderOptions& render_options) {
+    if (!hit) {
+        return Vector();
+    }
+    const auto& inter = hit.value().intersection;
+    switch (render_options.mode) {
+        case RenderMode::kDepth: {
+            auto value = inter.GetDistance();
+            return Vector{value, value, value};
+        }
+        case RenderMode::kNormal:
+            return inter.GetNormal() * 0.5 + 0.5;
+        case RenderMode::kFull:
+            return ComputeColor(hit.value().material_id, ray, inter, render_options.depth, scene,
+                                false);
+    }
+    return Vector();
+}
+
+inline Vector ShadeHit(const Ray& ray, const std::optional<SurfaceHit>& hit, const Scene& scene,
+                       const RenderOptions& render_options) {
+    return ShadeSceneHit(ray, hit, scene, render_options);
+}
+
+inline Vector TracePixel(const Ray& ray, const Scene& scene, const RenderOptions& render_options) {
+    return ShadeHit(ray, FindNearestHit(ray, scene), scene, render_options);
+}
+
+// Distances relative to `max_depth`, the largest of prepixels by default.
+template <class Buffer>
+void DepthMapping(Image& image, const Buffer& prepixels, std::optional<double> max_depth = {}) {
+    double max_value = max_depth.value_or(-1.0);
+    for (int i = 0; !max_depth and i < image.Width(); ++i) {
+        for (int j = 0; j < image.Height(); ++j) {
+            max_value = std::max(max_value, prepixels[i][j][0]);
+        }
+    }
+    for (int i = 0; i < image.Width(); ++i) {
+        for (int j = 0; j < image.Height(); ++j) {
+            RGB rgb;
+            if (prepixels[i][j][0] == 0) {
+                rgb = RGB{255, 255, 255};
+            } else {
+                rgb = RGB(round(255 * prepixels[i][j][0] / max_value));
+            }
+            image.SetPixel(rgb, j, i);
+        }
+    }
+}
+
+template <class Buffer>
+void NormalMapping(Image& image, const Buffer& prepixels) {
+    for (int i = 0; i < image.Width(); ++i) {
+        for (int j = 0; j < image.Height(); ++j) {
+            auto& normal = prepixels[i][j];
+            RGB rgb;
+            rgb.r = 255 * normal[0];
+            rgb.g = 255 * normal[1];
+            rgb.b = 255 * normal[2];
+            image.SetPixel(rgb, j, i);
+        }
+    }
+}
+
+// Tone maps and gamma encodes HDR colors; see tone_mapping.h.
+template <class Buffer>
+void ToneMapping(Image& image, const Buffer& prepixels, const ToneMappingOptions& options = {},
+                 std::optional<float> max_channel = {}, int threads = 0) {
+    TIMELINE_SCOPE("ToneMapping", "post");
+    auto& arena = ThreadArena();
+    ArenaScope scope{arena};
+    HdrBuffer hdr{image.Width(), image.Height(), arena};
+    GatherHdr(prepixels, hdr, threads);
+    ToneMap(hdr, image, options, max_channel, threads);
+}
+
+// Buffer is anything indexed as prepixels[i][j]: a vector of columns or a
+// PixelBuffer. `max_value` replaces the statistic of the image kDepth and
+// kReinhardExtended normalize by, the largest distance or channel: pass the
+// full frame's to resolve a part of it as the frame does. Tone mapping runs
+// on `threads` threads as in ThreadCount.
+template <class Buffer>
+void ResolvePixels(Image& image, const Buffer& prepixels, RenderMode mode,
+                   const ToneMappingOptions& tone_mapping = {},
+                   std::optional<double> max_value = {}, int threads = 0) {
+    StageScope stage{RenderStage::kToneMapping};
+    switch (mode) {
+        case RenderMode::kDepth:
+            DepthMapping(image, prepixels, max_value);
+            break;
+        case RenderMode::kNormal:
+            NormalMapping(image, prepixels);
+            break;
+        case RenderMode::kFull:
+            ToneMapping(image, prepixels, tone_mapping,
+                        max_value ? std::optional<float>{*max_value} : std::nullopt, threads);
+            break;
+    }
+}
+
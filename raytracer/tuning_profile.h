@@ -0,0 +1,62 @@
+#pragma once
+
+#include <render_options.h>
+#include <tile.h>
+
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Tuning profiles are small text files next to the scene, one "key value"
+// per line. A profile records the hardware thread count it was tuned on and
+// is ignored on other machines.
+inline std::string TuningProfilePath(const std::string& scene_filename) {
+    return scene_filename + ".tuning";
+}
+
+inline void SaveTuningProfile(const std::string& scene_filename,
+                              const TuningParameters& parameters) {
+    auto path = TuningProfilePath(scene_filename);
+    std::ofstream file{path};
+    if (!file) {
+        throw std::runtime_error("Can't open file " + path);
+    }
+    file << "hardware_threads " << ThreadCount(0) << "\n";
+    file << "tile_size " << parameters.tile_size << "\n";
+    file << "threads " << parameters.threads << "\n";
+    file << "raster_tile_size " << parameters.raster_tile_size << "\n";
+}
+
+inline std::optional<TuningParameters> LoadTuningProfile(const std::string& scene_filename) {
+    std::ifstream file{TuningProfilePath(scene_filename)};
+    if (!file) {
+        return {};
+    }
+    TuningParameters output;
+    size_t hardware_threads = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss{line};
+        std::string key;
+        int value;
+        if (!(iss >> key >> value)) {
+            continue;
+        }
+        if (key == "hardware_threads") {
+            hardware_threads = value;
+        } else if (key == "tile_size") {
+            output.tile_size = value;
+        } else if (key == "threads") {
+            output.threads = value;
+        } else if (key == "raster_tile_size") {
+            output.raster_tile_size = value;
+        }
+    }
+    if (hardware_threads != ThreadCount(0) or output.tile_size < 1 or output.threads < 0 or
+        output.raster_tile_size < 1) {
+        return {};
+    }
+    return output;
+}